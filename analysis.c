@@ -0,0 +1,316 @@
+/*
+ *  analysis.c
+ *  Static hazard analysis of code memory. Records, per instruction, which
+ *  earlier instructions of its basic block produce its sources, where it
+ *  branches to and how long decode has to stall for it, which gives a
+ *  lower bound on the cycle count without running the pipeline. Decode
+ *  only takes the source registers, from APEX_decode_table().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "analysis.h"
+
+/* Cycles from a producer leaving decode to the cycle a consumer may leave
+ * decode: EX, MEM and WB, where the result is forwarded. MUL spends one
+ * more cycle in EX. */
+#define PRODUCER_LATENCY 3
+#define MUL_EXTRA_CYCLES 1
+
+/* Cycles lost on a taken branch: it resolves in MEM and flushes DRF and EX */
+#define BRANCH_PENALTY 2
+
+/* Cycles to fill the pipeline before the first writeback */
+#define PIPELINE_FILL 4
+
+/* Registers decode reads for an instruction, -1 if unused */
+static void
+source_registers(APEX_Instruction* ins, int src[2])
+{
+    src[0] = -1;
+    src[1] = -1;
+    switch (ins->op) {
+    case OP_STORE:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+        src[0] = ins->rs1;
+        src[1] = ins->rs2;
+        break;
+    case OP_LOAD:
+    case OP_JUMP:
+        src[0] = ins->rs1;
+        break;
+    }
+}
+
+/*
+ * Register decode marks busy for an instruction, -1 if none. Decode claims
+ * rd of every instruction, and the parser leaves rd at R0 for instructions
+ * that have none, so STORE, BZ, BNZ, JUMP and HALT hold up readers of R0.
+ */
+static int
+claimed_register(APEX_Instruction* ins)
+{
+    return (ins->rd >= 0 && ins->rd <= 15) ? ins->rd : -1;
+}
+
+/* Code index a BZ/BNZ or JUMP lands on, -1 if unknown or outside code */
+static int
+target_index(APEX_Static_Info* info, int code_memory_size)
+{
+    int offset = info->target_pc - 4000;
+    if (info->target_pc < 0 || offset < 0 || offset % 4) {
+        return -1;
+    }
+    return offset / 4 < code_memory_size ? offset / 4 : -1;
+}
+
+/*
+ * Fills in producers, distances, JUMP targets and stall cycles for the
+ * basic blocks given by leader[]. Returns 1 if a JUMP target was found
+ * that is not a leader yet.
+ */
+static int
+scan_blocks(APEX_Static_Info* info, APEX_Instruction* code_memory,
+            int code_memory_size, char* leader, int* issue)
+{
+    int last_writer[16];
+    int block_start = 0;
+    int new_leader = 0;
+
+    for (int i = 0; i < code_memory_size; ++i) {
+        APEX_Instruction* ins = &code_memory[i];
+        APEX_Static_Info* cur = &info[i];
+
+        if (leader[i]) {
+            block_start = i;
+            memset(last_writer, -1, sizeof(last_writer));
+        }
+        cur->block_start = block_start;
+        source_registers(ins, cur->src);
+
+        /* Earliest cycle, relative to the block, decode can let it go */
+        int earliest = 0;
+        cur->after_mul = 0;
+        if (i > block_start) {
+            earliest = issue[i - 1] + 1;
+            if (code_memory[i - 1].op == OP_MUL) {
+                cur->after_mul = 1;
+                earliest = issue[i - 1] + 1 + MUL_EXTRA_CYCLES;
+            }
+        }
+        for (int s = 0; s < 2; ++s) {
+            cur->producer[s] = -1;
+            cur->distance[s] = 0;
+            if (cur->src[s] < 0 || cur->src[s] > 15 || last_writer[cur->src[s]] < 0) {
+                continue;
+            }
+            int p = last_writer[cur->src[s]];
+            int ready = issue[p] + PRODUCER_LATENCY;
+            if (code_memory[p].op == OP_MUL) {
+                ready += MUL_EXTRA_CYCLES;
+            }
+            if (ready > earliest) {
+                earliest = ready;
+            }
+            cur->producer[s] = p;
+            cur->distance[s] = i - p;
+        }
+        issue[i] = earliest;
+        cur->stall_cycles = (i > block_start) ? earliest - issue[i - 1] - 1 : 0;
+
+        /* Branch targets: BZ/BNZ are PC relative, a JUMP is known when its
+         * base register comes from a MOVC in the same block */
+        cur->target_pc = -1;
+        if (ins->op == OP_BZ || ins->op == OP_BNZ) {
+            cur->target_pc = 4000 + i * 4 + ins->imm;
+        } else if (ins->op == OP_JUMP && cur->producer[0] >= 0 &&
+                   code_memory[cur->producer[0]].op == OP_MOVC) {
+            cur->target_pc = code_memory[cur->producer[0]].imm + ins->imm;
+            int t = target_index(cur, code_memory_size);
+            if (t >= 0 && !leader[t]) {
+                leader[t] = 1;
+                new_leader = 1;
+            }
+        }
+
+        int rd = claimed_register(ins);
+        if (rd >= 0) {
+            last_writer[rd] = i;
+        }
+    }
+    return new_leader;
+}
+
+/*
+ * Source registers of every instruction in code memory, for decode.
+ * Returns NULL if the table cannot be allocated.
+ */
+APEX_Sources*
+APEX_decode_table(APEX_Instruction* code_memory, int code_memory_size)
+{
+    APEX_Sources* table = calloc(code_memory_size, sizeof(*table));
+    for (int i = 0; table && i < code_memory_size; ++i) {
+        source_registers(&code_memory[i], table[i].src);
+    }
+    return table;
+}
+
+/*
+ * Builds the hazard analysis of code memory. Returns NULL if it cannot be
+ * allocated.
+ */
+APEX_Static_Info*
+APEX_analyze(APEX_Instruction* code_memory, int code_memory_size)
+{
+    APEX_Static_Info* info = calloc(code_memory_size, sizeof(*info));
+    char* leader = calloc(code_memory_size, 1);
+    int* issue = calloc(code_memory_size, sizeof(int));
+    if (!info || !leader || !issue) {
+        free(info);
+        free(leader);
+        free(issue);
+        return NULL;
+    }
+
+    /* Blocks start at the entry, after every control transfer and at
+     * every BZ/BNZ target */
+    leader[0] = 1;
+    for (int i = 0; i < code_memory_size; ++i) {
+        int op = code_memory[i].op;
+        if (op != OP_BZ && op != OP_BNZ && op != OP_JUMP && op != OP_HALT) {
+            continue;
+        }
+        if (i + 1 < code_memory_size) {
+            leader[i + 1] = 1;
+        }
+        if (op == OP_BZ || op == OP_BNZ) {
+            info[i].target_pc = 4000 + i * 4 + code_memory[i].imm;
+            int t = target_index(&info[i], code_memory_size);
+            if (t >= 0) {
+                leader[t] = 1;
+            }
+        }
+    }
+
+    /* Known JUMP targets split blocks too, which can only remove
+     * producers, so rescan until no new leader turns up */
+    while (scan_blocks(info, code_memory, code_memory_size, leader, issue)) {
+    }
+
+    free(leader);
+    free(issue);
+    return info;
+}
+
+/*
+ * Lower bound on the cycles the pipeline needs: the cheapest path from the
+ * first instruction to one the run can stop at (HALT, the last instruction
+ * or a JUMP whose target is unknown). Every instruction on the path costs a
+ * cycle plus the stalls decode cannot avoid inside its block, and every
+ * taken BZ/BNZ or JUMP the branch penalty. Loops are not counted at all.
+ */
+int
+APEX_static_cycle_estimate(APEX_Static_Info* info, APEX_Instruction* code_memory,
+                           int code_memory_size)
+{
+    int* cost = malloc(sizeof(int) * code_memory_size);
+    char* done = calloc(code_memory_size, 1);
+    if (!cost || !done) {
+        free(cost);
+        free(done);
+        return 0;
+    }
+    for (int i = 0; i < code_memory_size; ++i) {
+        cost[i] = -1;
+    }
+
+    /* Dijkstra over code indices, cost[i] counts up to and including i */
+    int best = -1;
+    cost[0] = 1 + info[0].stall_cycles;
+    while (1) {
+        int i = -1;
+        for (int j = 0; j < code_memory_size; ++j) {
+            if (!done[j] && cost[j] >= 0 && (i < 0 || cost[j] < cost[i])) {
+                i = j;
+            }
+        }
+        if (i < 0) {
+            break;
+        }
+        done[i] = 1;
+
+        int op = code_memory[i].op;
+        int taken = target_index(&info[i], code_memory_size);
+        if (op == OP_HALT || i == code_memory_size - 1 ||
+            (op == OP_JUMP && taken < 0)) {
+            best = cost[i];
+            break;
+        }
+
+        int next[2] = { -1, -1 };
+        int penalty[2] = { 0, BRANCH_PENALTY };
+        if (op != OP_JUMP) {
+            next[0] = i + 1;
+        }
+        if (op == OP_BZ || op == OP_BNZ || op == OP_JUMP) {
+            next[1] = taken;
+        }
+        for (int k = 0; k < 2; ++k) {
+            int n = next[k];
+            if (n < 0 || done[n]) {
+                continue;
+            }
+            int c = cost[i] + penalty[k] + 1 + info[n].stall_cycles;
+            if (cost[n] < 0 || c < cost[n]) {
+                cost[n] = c;
+            }
+        }
+    }
+
+    free(cost);
+    free(done);
+    return best < 0 ? 0 : PIPELINE_FILL + best;
+}
+
+void
+APEX_analysis_print(APEX_Static_Info* info, APEX_Instruction* code_memory,
+                    int code_memory_size)
+{
+    printf("APEX_Analysis : %-9s %-9s %-9s %-14s %-14s %-9s %-9s\n",
+           "pc", "opcode", "block", "src1", "src2", "target", "stalls");
+    for (int i = 0; i < code_memory_size; ++i) {
+        APEX_Static_Info* cur = &info[i];
+        char src[2][32];
+        char target[16] = "-";
+
+        for (int s = 0; s < 2; ++s) {
+            if (cur->src[s] < 0) {
+                strcpy(src[s], "-");
+            } else if (cur->producer[s] < 0) {
+                snprintf(src[s], sizeof(src[s]), "R%d", cur->src[s]);
+            } else {
+                snprintf(src[s], sizeof(src[s]), "R%d<%d(d=%d)", cur->src[s],
+                         4000 + cur->producer[s] * 4, cur->distance[s]);
+            }
+        }
+        if (cur->target_pc >= 0) {
+            snprintf(target, sizeof(target), "%d", cur->target_pc);
+        } else if (code_memory[i].op == OP_JUMP) {
+            strcpy(target, "?");
+        }
+        /* A bare opcode on the last line keeps its newline */
+        int len = strcspn(code_memory[i].opcode, "\r\n");
+        printf("APEX_Analysis : %-9d %-9.*s %-9d %-14s %-14s %-9s %d%s\n",
+               4000 + i * 4, len, code_memory[i].opcode, 4000 + cur->block_start * 4,
+               src[0], src[1], target, cur->stall_cycles,
+               cur->after_mul ? " (MUL)" : "");
+    }
+    printf("APEX_Analysis : Static lower bound %d cycles\n",
+           APEX_static_cycle_estimate(info, code_memory, code_memory_size));
+}
@@ -0,0 +1,44 @@
+#ifndef _APEX_ANALYSIS_H_
+#define _APEX_ANALYSIS_H_
+/**
+ *  analysis.h
+ *  Static hazard analysis of code memory, run once at load time
+ */
+#include "cpu.h"
+
+/* Registers decode reads for one instruction, -1 if unused. This is all
+ * the pipeline keeps of the analysis: readiness still comes from
+ * regs_valid, which also covers writers outside the basic block */
+typedef struct APEX_Sources
+{
+    int src[2];
+} APEX_Sources;
+
+/* What is known about one instruction without running the program, for
+ * the static cycle estimate and --analyze */
+typedef struct APEX_Static_Info
+{
+    int src[2];		    // Registers decode has to read (rs1, rs2), -1 if unused
+    int producer[2];	    // Closest earlier writer of src[i] in the basic block, -1 if none
+    int distance[2];	    // Instructions between that producer and this one
+    int after_mul;	    // Directly follows a MUL, decode waits for the MUL unit
+    int block_start;	    // Code index of the first instruction of the basic block
+    int target_pc;	    // Branch target if known statically, else -1
+    int stall_cycles;	    // Decode stall cycles implied by the above
+} APEX_Static_Info;
+
+APEX_Sources*
+APEX_decode_table(APEX_Instruction* code_memory, int code_memory_size);
+
+APEX_Static_Info*
+APEX_analyze(APEX_Instruction* code_memory, int code_memory_size);
+
+int
+APEX_static_cycle_estimate(APEX_Static_Info* info, APEX_Instruction* code_memory,
+                           int code_memory_size);
+
+void
+APEX_analysis_print(APEX_Static_Info* info, APEX_Instruction* code_memory,
+                    int code_memory_size);
+
+#endif
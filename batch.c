@@ -0,0 +1,617 @@
+/*
+ *  batch.c
+ *  Lane-parallel functional engine. All lanes run the same program; at
+ *  every step the lanes sitting at the lowest PC execute the instruction
+ *  there while the others are masked off, so lanes that diverge on
+ *  BZ/BNZ/JUMP simply wait until they meet again (min-PC reconvergence).
+ *
+ *  Each decoded instruction is applied to all lanes either with AVX2 (when
+ *  the host supports it, checked at run time) or with the portable scalar
+ *  loop. Both produce the same architectural result as func.c per lane.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "cpu.h"
+#include "func.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BATCH_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+/* Lanes per vector; stride is kept a multiple of this */
+#define BATCH_VECTOR_LANES 8
+
+static int*
+batch_alloc(int count)
+{
+    int* p = aligned_alloc(32, sizeof(int) * count);
+    if (p) {
+        memset(p, 0, sizeof(int) * count);
+    }
+    return p;
+}
+
+APEX_Batch*
+APEX_batch_init(APEX_Instruction* code_memory, int code_memory_size,
+                int lanes)
+{
+    if (lanes <= 0) {
+        return NULL;
+    }
+
+    APEX_Batch* batch = malloc(sizeof(*batch));
+    if (!batch) {
+        return NULL;
+    }
+
+    batch->lanes = lanes;
+    batch->stride = (lanes + BATCH_VECTOR_LANES - 1) & ~(BATCH_VECTOR_LANES - 1);
+    batch->code_memory = code_memory;
+    batch->code_memory_size = code_memory_size;
+    batch->max_steps = 0;
+
+    int s = batch->stride;
+    batch->pc = batch_alloc(s);
+    batch->zero_flag = batch_alloc(s);
+    batch->status = batch_alloc(s);
+    batch->ins_completed = batch_alloc(s);
+    batch->regs = batch_alloc(16 * s);
+    batch->data_memory = batch_alloc(4096 * s);
+
+    if (!batch->pc || !batch->zero_flag || !batch->status ||
+        !batch->ins_completed || !batch->regs || !batch->data_memory) {
+        APEX_batch_stop(batch);
+        return NULL;
+    }
+
+    /* Padding lanes start stopped so they never take part */
+    for (int l = 0; l < s; ++l) {
+        if (l < lanes) {
+            batch->pc[l] = 4000;
+            batch->status[l] = FUNC_RUNNING;
+        } else {
+            batch->pc[l] = BATCH_LANE_STOPPED;
+            batch->status[l] = FUNC_END;
+        }
+    }
+
+    batch->use_avx2 = 0;
+#ifdef BATCH_HAVE_AVX2
+    __builtin_cpu_init();
+    batch->use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+    return batch;
+}
+
+void
+APEX_batch_stop(APEX_Batch* batch)
+{
+    free(batch->pc);
+    free(batch->zero_flag);
+    free(batch->status);
+    free(batch->ins_completed);
+    free(batch->regs);
+    free(batch->data_memory);
+    free(batch);
+}
+
+/*
+ * Counts the lanes described by a seed file: one lane per line
+ */
+int
+APEX_batch_count_lanes(const char* filename)
+{
+    FILE* fp = fopen(filename, "r");
+    if (!fp) {
+        return 0;
+    }
+
+    char* line = NULL;
+    size_t len = 0;
+    int lanes = 0;
+    while (getline(&line, &len, fp) != -1) {
+        lanes++;
+    }
+    free(line);
+    fclose(fp);
+    return lanes;
+}
+
+/*
+ * Loads the initial state of every lane from a seed file. Line N seeds
+ * lane N with comma separated assignments, e.g.
+ *
+ *     R1=5,R2=-3,M100=7
+ *
+ * Anything not mentioned starts at zero; an empty line is an all-zero lane.
+ * Returns 0 on success, -1 on a malformed file.
+ */
+int
+APEX_batch_load_seeds(APEX_Batch* batch, const char* filename)
+{
+    FILE* fp = fopen(filename, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    char* line = NULL;
+    size_t len = 0;
+    int lane = 0;
+    int ret = 0;
+    while (lane < batch->lanes && getline(&line, &len, fp) != -1) {
+        char* token = strtok(line, ",\n");
+        while (token != NULL) {
+            int slot, value;
+            if (sscanf(token, "R%d=%d", &slot, &value) == 2 &&
+                slot >= 0 && slot < 16) {
+                batch->regs[slot * batch->stride + lane] = value;
+            } else if (sscanf(token, "M%d=%d", &slot, &value) == 2 &&
+                       slot >= 0 && slot < 4096) {
+                batch->data_memory[slot * batch->stride + lane] = value;
+            } else {
+                fprintf(stderr,
+                        "APEX_Batch : Bad seed '%s' for lane %d\n", token, lane);
+                ret = -1;
+            }
+            token = strtok(NULL, ",\n");
+        }
+        lane++;
+    }
+
+    free(line);
+    fclose(fp);
+    return ret;
+}
+
+/* Marks a lane as stopped with the given FUNC_* status */
+static void
+batch_stop_lane(APEX_Batch* batch, int lane, int status)
+{
+    batch->status[lane] = status;
+    batch->pc[lane] = BATCH_LANE_STOPPED;
+}
+
+/*
+ * Scalar engine
+ */
+
+/*
+ * Finds the lowest PC among running lanes and sets mask[l] to -1 for the
+ * lanes at that PC, 0 otherwise. Returns the PC.
+ */
+static int
+batch_select_scalar(APEX_Batch* batch, int* mask)
+{
+    int cur = BATCH_LANE_STOPPED;
+    for (int l = 0; l < batch->stride; ++l) {
+        if (batch->pc[l] < cur) {
+            cur = batch->pc[l];
+        }
+    }
+    for (int l = 0; l < batch->stride; ++l) {
+        mask[l] = (batch->pc[l] == cur) ? -1 : 0;
+    }
+    return cur;
+}
+
+static void
+batch_exec_scalar(APEX_Batch* batch, APEX_Instruction* ins, int* mask)
+{
+    int s = batch->stride;
+    int* pc = batch->pc;
+    int* zf = batch->zero_flag;
+    int* rd = &batch->regs[ins->rd * s];
+    int* rs1 = &batch->regs[ins->rs1 * s];
+    int* rs2 = &batch->regs[ins->rs2 * s];
+    int is_branch = 0;
+
+    switch (ins->op) {
+        case OP_MOVC:
+            for (int l = 0; l < s; ++l) {
+                rd[l] = mask[l] ? ins->imm : rd[l];
+            }
+            break;
+
+        case OP_STORE:
+            for (int l = 0; l < s; ++l) {
+                if (!mask[l]) {
+                    continue;
+                }
+                int address = rs2[l] + ins->imm;
+                if (address < 0 || address >= 4096) {
+                    batch_stop_lane(batch, l, FUNC_FAULT);
+                    mask[l] = 0;
+                    continue;
+                }
+                batch->data_memory[address * s + l] = rs1[l];
+            }
+            break;
+
+        case OP_LOAD:
+            for (int l = 0; l < s; ++l) {
+                if (!mask[l]) {
+                    continue;
+                }
+                int address = rs1[l] + ins->imm;
+                if (address < 0 || address >= 4096) {
+                    batch_stop_lane(batch, l, FUNC_FAULT);
+                    mask[l] = 0;
+                    continue;
+                }
+                rd[l] = batch->data_memory[address * s + l];
+            }
+            break;
+
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+            for (int l = 0; l < s; ++l) {
+                if (!mask[l]) {
+                    continue;
+                }
+                if (ins->op == OP_ADD) {
+                    rd[l] = rs1[l] + rs2[l];
+                } else if (ins->op == OP_SUB) {
+                    rd[l] = rs1[l] - rs2[l];
+                } else {
+                    rd[l] = rs1[l] * rs2[l];
+                }
+                zf[l] = rd[l] ? 0 : -1;
+            }
+            break;
+
+        case OP_AND:
+            for (int l = 0; l < s; ++l) {
+                rd[l] = mask[l] ? (rs1[l] & rs2[l]) : rd[l];
+            }
+            break;
+
+        case OP_OR:
+            for (int l = 0; l < s; ++l) {
+                rd[l] = mask[l] ? (rs1[l] | rs2[l]) : rd[l];
+            }
+            break;
+
+        case OP_XOR:
+            for (int l = 0; l < s; ++l) {
+                rd[l] = mask[l] ? (rs1[l] ^ rs2[l]) : rd[l];
+            }
+            break;
+
+        case OP_BZ:
+        case OP_BNZ:
+            for (int l = 0; l < s; ++l) {
+                int taken = (ins->op == OP_BZ) ? zf[l] : ~zf[l];
+                if (mask[l]) {
+                    pc[l] += taken ? ins->imm : 4;
+                }
+            }
+            is_branch = 1;
+            break;
+
+        case OP_JUMP:
+            for (int l = 0; l < s; ++l) {
+                pc[l] = mask[l] ? rs1[l] + ins->imm : pc[l];
+            }
+            is_branch = 1;
+            break;
+
+        case OP_HALT:
+            for (int l = 0; l < s; ++l) {
+                if (mask[l]) {
+                    batch_stop_lane(batch, l, FUNC_HALTED);
+                }
+            }
+            is_branch = 1;
+            break;
+
+        default:
+            break;
+    }
+
+    for (int l = 0; l < s; ++l) {
+        if (!is_branch) {
+            pc[l] += mask[l] & 4;
+        }
+        batch->ins_completed[l] -= mask[l];
+    }
+}
+
+/*
+ * AVX2 engine, eight lanes per operation
+ */
+#ifdef BATCH_HAVE_AVX2
+
+__attribute__((target("avx2"))) static int
+batch_select_avx2(APEX_Batch* batch, int* mask)
+{
+    int s = batch->stride;
+    __m256i vmin = _mm256_set1_epi32(BATCH_LANE_STOPPED);
+    for (int l = 0; l < s; l += 8) {
+        vmin = _mm256_min_epi32(vmin,
+                                _mm256_load_si256((__m256i*)&batch->pc[l]));
+    }
+
+    int part[8];
+    _mm256_storeu_si256((__m256i*)part, vmin);
+    int cur = part[0];
+    for (int i = 1; i < 8; ++i) {
+        if (part[i] < cur) {
+            cur = part[i];
+        }
+    }
+
+    __m256i vcur = _mm256_set1_epi32(cur);
+    for (int l = 0; l < s; l += 8) {
+        __m256i vpc = _mm256_load_si256((__m256i*)&batch->pc[l]);
+        _mm256_store_si256((__m256i*)&mask[l], _mm256_cmpeq_epi32(vpc, vcur));
+    }
+    return cur;
+}
+
+__attribute__((target("avx2"))) static void
+batch_exec_avx2(APEX_Batch* batch, APEX_Instruction* ins, int* mask)
+{
+    int s = batch->stride;
+    int* rd = &batch->regs[ins->rd * s];
+    int* rs1 = &batch->regs[ins->rs1 * s];
+    int* rs2 = &batch->regs[ins->rs2 * s];
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i four = _mm256_set1_epi32(4);
+    const __m256i imm = _mm256_set1_epi32(ins->imm);
+    const __m256i limit = _mm256_set1_epi32(4095);
+    const __m256i iota = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    int is_branch = (ins->op == OP_BZ || ins->op == OP_BNZ ||
+                     ins->op == OP_JUMP || ins->op == OP_HALT);
+
+    for (int l = 0; l < s; l += 8) {
+        __m256i m = _mm256_load_si256((__m256i*)&mask[l]);
+        if (_mm256_testz_si256(m, m)) {
+            continue;
+        }
+
+        __m256i* prd = (__m256i*)&rd[l];
+        __m256i* ppc = (__m256i*)&batch->pc[l];
+        __m256i* pzf = (__m256i*)&batch->zero_flag[l];
+        __m256i a;
+        __m256i b;
+        __m256i pc = _mm256_load_si256(ppc);
+        __m256i value;
+        __m256i address;
+        __m256i bad;
+
+        switch (ins->op) {
+            case OP_MOVC:
+                _mm256_store_si256(prd, _mm256_blendv_epi8(
+                                       _mm256_load_si256(prd), imm, m));
+                break;
+
+            case OP_STORE:
+                /* AVX2 has no scatter, store the active lanes one by one */
+                for (int i = 0; i < 8; ++i) {
+                    if (!mask[l + i]) {
+                        continue;
+                    }
+                    int addr = rs2[l + i] + ins->imm;
+                    if (addr < 0 || addr >= 4096) {
+                        batch_stop_lane(batch, l + i, FUNC_FAULT);
+                        mask[l + i] = 0;
+                        continue;
+                    }
+                    batch->data_memory[addr * s + l + i] = rs1[l + i];
+                }
+                m = _mm256_load_si256((__m256i*)&mask[l]);
+                pc = _mm256_load_si256(ppc);
+                break;
+
+            case OP_LOAD:
+                a = _mm256_load_si256((__m256i*)&rs1[l]);
+                address = _mm256_add_epi32(a, imm);
+                bad = _mm256_and_si256(
+                    m, _mm256_or_si256(_mm256_cmpgt_epi32(zero, address),
+                                       _mm256_cmpgt_epi32(address, limit)));
+                if (!_mm256_testz_si256(bad, bad)) {
+                    for (int i = 0; i < 8; ++i) {
+                        int addr = rs1[l + i] + ins->imm;
+                        if (mask[l + i] && (addr < 0 || addr >= 4096)) {
+                            batch_stop_lane(batch, l + i, FUNC_FAULT);
+                            mask[l + i] = 0;
+                        }
+                    }
+                    m = _mm256_andnot_si256(bad, m);
+                    pc = _mm256_load_si256(ppc);
+                }
+                address = _mm256_add_epi32(
+                    _mm256_mullo_epi32(_mm256_andnot_si256(bad, address),
+                                       _mm256_set1_epi32(s)),
+                    _mm256_add_epi32(iota, _mm256_set1_epi32(l)));
+                value = _mm256_mask_i32gather_epi32(
+                    _mm256_load_si256(prd), batch->data_memory, address, m, 4);
+                _mm256_store_si256(prd, value);
+                break;
+
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+                a = _mm256_load_si256((__m256i*)&rs1[l]);
+                b = _mm256_load_si256((__m256i*)&rs2[l]);
+                if (ins->op == OP_ADD) {
+                    value = _mm256_add_epi32(a, b);
+                } else if (ins->op == OP_SUB) {
+                    value = _mm256_sub_epi32(a, b);
+                } else {
+                    value = _mm256_mullo_epi32(a, b);
+                }
+                _mm256_store_si256(prd, _mm256_blendv_epi8(
+                                       _mm256_load_si256(prd), value, m));
+                _mm256_store_si256(pzf, _mm256_blendv_epi8(
+                                       _mm256_load_si256(pzf),
+                                       _mm256_cmpeq_epi32(value, zero), m));
+                break;
+
+            case OP_AND:
+            case OP_OR:
+            case OP_XOR:
+                a = _mm256_load_si256((__m256i*)&rs1[l]);
+                b = _mm256_load_si256((__m256i*)&rs2[l]);
+                if (ins->op == OP_AND) {
+                    value = _mm256_and_si256(a, b);
+                } else if (ins->op == OP_OR) {
+                    value = _mm256_or_si256(a, b);
+                } else {
+                    value = _mm256_xor_si256(a, b);
+                }
+                _mm256_store_si256(prd, _mm256_blendv_epi8(
+                                       _mm256_load_si256(prd), value, m));
+                break;
+
+            case OP_BZ:
+            case OP_BNZ:
+                value = _mm256_load_si256(pzf);
+                if (ins->op == OP_BZ) {
+                    value = _mm256_blendv_epi8(four, imm, value);
+                } else {
+                    value = _mm256_blendv_epi8(imm, four, value);
+                }
+                pc = _mm256_blendv_epi8(pc, _mm256_add_epi32(pc, value), m);
+                break;
+
+            case OP_JUMP:
+                a = _mm256_load_si256((__m256i*)&rs1[l]);
+                pc = _mm256_blendv_epi8(pc, _mm256_add_epi32(a, imm), m);
+                break;
+
+            case OP_HALT:
+                for (int i = 0; i < 8; ++i) {
+                    if (mask[l + i]) {
+                        batch_stop_lane(batch, l + i, FUNC_HALTED);
+                    }
+                }
+                pc = _mm256_load_si256(ppc);
+                break;
+
+            default:
+                break;
+        }
+
+        if (!is_branch) {
+            pc = _mm256_add_epi32(pc, _mm256_and_si256(m, four));
+        }
+        _mm256_store_si256(ppc, pc);
+
+        __m256i* pic = (__m256i*)&batch->ins_completed[l];
+        _mm256_store_si256(pic, _mm256_sub_epi32(_mm256_load_si256(pic), m));
+    }
+}
+
+#endif
+
+/* Stops the lanes that just ran an instruction once they reach the step
+ * limit. Returns how many it stopped */
+static int
+batch_check_limit(APEX_Batch* batch, int* mask)
+{
+    int stopped = 0;
+    for (int l = 0; l < batch->lanes; ++l) {
+        if (mask[l] && batch->status[l] == FUNC_RUNNING &&
+            batch->ins_completed[l] >= batch->max_steps) {
+            batch_stop_lane(batch, l, FUNC_LIMIT);
+            stopped++;
+        }
+    }
+    return stopped;
+}
+
+/*
+ * Runs every lane until it halts, runs off the end of code memory, faults
+ * on a data memory access or reaches max_steps. Returns the number of
+ * lanes stopped by the step limit.
+ */
+int
+APEX_batch_run(APEX_Batch* batch)
+{
+    int limited = 0;
+    int* mask = batch_alloc(batch->stride);
+    if (!mask) {
+        return 0;
+    }
+
+    while (1) {
+        int cur;
+#ifdef BATCH_HAVE_AVX2
+        if (batch->use_avx2) {
+            cur = batch_select_avx2(batch, mask);
+        } else
+#endif
+        {
+            cur = batch_select_scalar(batch, mask);
+        }
+
+        if (cur == BATCH_LANE_STOPPED) {
+            break;
+        }
+
+        int index = (cur - 4000) / 4;
+        if (cur < 4000 || index >= batch->code_memory_size) {
+            for (int l = 0; l < batch->stride; ++l) {
+                if (mask[l]) {
+                    batch_stop_lane(batch, l, FUNC_END);
+                }
+            }
+            continue;
+        }
+
+        APEX_Instruction* ins = &batch->code_memory[index];
+#ifdef BATCH_HAVE_AVX2
+        if (batch->use_avx2) {
+            batch_exec_avx2(batch, ins, mask);
+        } else
+#endif
+        {
+            batch_exec_scalar(batch, ins, mask);
+        }
+        if (batch->max_steps) {
+            limited += batch_check_limit(batch, mask);
+        }
+    }
+
+    free(mask);
+    return limited;
+}
+
+/*
+ * Prints the final state of every lane. The hash uses the same scheme as
+ * APEX_Func.state_hash, so a lane can be checked against a single
+ * functional run of the same seed.
+ */
+void
+APEX_batch_print(APEX_Batch* batch)
+{
+    static const char* status_names[] = { "running", "halted", "end", "fault",
+                                          "limit" };
+    int s = batch->stride;
+
+    printf("APEX_Batch : %d lanes, %s engine\n", batch->lanes,
+           batch->use_avx2 ? "AVX2" : "scalar");
+    for (int l = 0; l < batch->lanes; ++l) {
+        unsigned long long hash = 0;
+        for (int r = 0; r < 16; ++r) {
+            hash ^= apex_hash_slot(r, batch->regs[r * s + l]);
+        }
+        for (int a = 0; a < 4096; ++a) {
+            hash ^= apex_hash_slot(APEX_HASH_MEM_SLOT(a),
+                                   batch->data_memory[a * s + l]);
+        }
+
+        printf("Lane %-5d: %-7s ins(%d) hash(%016llx)", l,
+               status_names[batch->status[l]], batch->ins_completed[l], hash);
+        for (int r = 0; r < 16; ++r) {
+            printf(" R%d=%d", r, batch->regs[r * s + l]);
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef _APEX_BATCH_H_
+#define _APEX_BATCH_H_
+/**
+ *  batch.h
+ *  Lane-parallel functional engine: runs one APEX program over many
+ *  independent data variants ("lanes") at once. Registers and data memory
+ *  are kept structure-of-arrays, element [slot * stride + lane], so every
+ *  decoded instruction is applied to all lanes with vector operations.
+ */
+#include "cpu.h"
+
+/* PC of a lane that has stopped; it never wins the min-PC schedule */
+#define BATCH_LANE_STOPPED 0x7fffffff
+
+typedef struct APEX_Batch
+{
+    int lanes;		// Number of lanes in use
+    int stride;		// lanes rounded up to the vector width
+
+    int* pc;		// [stride]
+    int* zero_flag;	// [stride], -1 when the last ADD/SUB/MUL gave zero
+    int* status;	// [stride], FUNC_* of each lane
+    int* ins_completed;	// [stride]
+    int* regs;		// [16 * stride]
+    int* data_memory;	// [4096 * stride]
+
+    APEX_Instruction* code_memory;
+    int code_memory_size;
+
+    /* Instructions a lane may complete before it is stopped with
+     * FUNC_LIMIT, 0 = no limit. Lanes run in min-PC order, so one stuck
+     * in a loop would otherwise hold up every lane behind it */
+    int max_steps;
+
+    int use_avx2;	// Chosen at init from the host CPU features
+} APEX_Batch;
+
+APEX_Batch*
+APEX_batch_init(APEX_Instruction* code_memory, int code_memory_size,
+                int lanes);
+
+int
+APEX_batch_load_seeds(APEX_Batch* batch, const char* filename);
+
+int
+APEX_batch_run(APEX_Batch* batch);
+
+void
+APEX_batch_print(APEX_Batch* batch);
+
+void
+APEX_batch_stop(APEX_Batch* batch);
+
+int
+APEX_batch_count_lanes(const char* filename);
+
+#endif
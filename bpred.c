@@ -0,0 +1,169 @@
+/*
+ *  bpred.c
+ *  Fetch stage branch predictors and branch target buffer
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bpred.h"
+
+static const char* bpred_names[] = { "not-taken", "btfn", "bimodal", "gshare" };
+
+/* Counter / BTB slot of a pc; instruction PCs are word aligned */
+static int
+counter_index(APEX_BPred* bp, int pc)
+{
+    unsigned int index = (unsigned int)pc >> 2;
+    if (bp->kind == BPRED_GSHARE) {
+        index ^= bp->history;
+    }
+    return index & (bp->size - 1);
+}
+
+static int
+btb_index(APEX_BPred* bp, int pc)
+{
+    return ((unsigned int)pc >> 2) & (bp->btb_size - 1);
+}
+
+/*
+ * Creates a predictor by name (not-taken, btfn, bimodal, gshare) with
+ * size 2-bit counters and a BTB of a quarter of that. Returns NULL if the
+ * name or size is not valid.
+ */
+APEX_BPred*
+APEX_bpred_init(const char* kind, int size)
+{
+    int id = -1;
+    for (int i = 0; i < (int)(sizeof(bpred_names) / sizeof(bpred_names[0])); ++i) {
+        if (strcmp(kind, bpred_names[i]) == 0) {
+            id = i;
+        }
+    }
+    if (id < 0 || size < 4 || (size & (size - 1))) {
+        fprintf(stderr, "APEX_BPred : Invalid predictor %s of size %d\n", kind, size);
+        return NULL;
+    }
+
+    APEX_BPred* bp = calloc(1, sizeof(*bp));
+    if (!bp) {
+        return NULL;
+    }
+    bp->kind = id;
+    bp->size = size;
+    bp->btb_size = size / 4;
+    bp->counters = malloc(bp->size);
+    bp->btb_pc = malloc(sizeof(int) * bp->btb_size);
+    bp->btb_target = malloc(sizeof(int) * bp->btb_size);
+    if (!bp->counters || !bp->btb_pc || !bp->btb_target) {
+        APEX_bpred_stop(bp);
+        return NULL;
+    }
+
+    /* Weakly not taken, empty BTB */
+    memset(bp->counters, 1, bp->size);
+    for (int i = 0; i < bp->btb_size; ++i) {
+        bp->btb_pc[i] = -1;
+    }
+    return bp;
+}
+
+/*
+ * PC fetch continues with after fetching ins at pc. *index is set to the
+ * counter the prediction was read from; it goes along with the branch to
+ * APEX_bpred_update, as the gshare history may have moved on by then.
+ */
+int
+APEX_bpred_predict(APEX_BPred* bp, APEX_Instruction* ins, int pc, int* index)
+{
+    *index = counter_index(bp, pc);
+    if (ins->op != OP_BZ && ins->op != OP_BNZ && ins->op != OP_JUMP) {
+        return pc + 4;
+    }
+
+    switch (bp->kind) {
+    case BPRED_BTFN:
+        /* The target of a BZ/BNZ is in the instruction, a JUMP's is not */
+        if (ins->op != OP_JUMP && ins->imm < 0) {
+            return pc + ins->imm;
+        }
+        return pc + 4;
+    case BPRED_BIMODAL:
+    case BPRED_GSHARE: {
+        int slot = btb_index(bp, pc);
+        if (bp->btb_pc[slot] != pc) {
+            return pc + 4;
+        }
+        if (ins->op == OP_JUMP || bp->counters[*index] >= 2) {
+            return bp->btb_target[slot];
+        }
+        return pc + 4;
+    }
+    }
+    return pc + 4;
+}
+
+/*
+ * Trains the predictor with a branch resolved in MEM and counts it; index
+ * is the counter APEX_bpred_predict used for it
+ */
+void
+APEX_bpred_update(APEX_BPred* bp, int op, int pc, int index, int taken,
+                  int target, int mispredicted)
+{
+    if (op == OP_JUMP) {
+        bp->jumps++;
+    } else {
+        bp->branches++;
+    }
+    bp->taken += taken;
+    bp->mispredicts += mispredicted;
+
+    if (bp->kind != BPRED_BIMODAL && bp->kind != BPRED_GSHARE) {
+        return;
+    }
+    if (taken) {
+        int slot = btb_index(bp, pc);
+        bp->btb_pc[slot] = pc;
+        bp->btb_target[slot] = target;
+    }
+    if (op != OP_JUMP) {
+        unsigned char* counter = &bp->counters[index];
+        if (taken && *counter < 3) {
+            (*counter)++;
+        } else if (!taken && *counter > 0) {
+            (*counter)--;
+        }
+        bp->history = ((bp->history << 1) | taken) & (bp->size - 1);
+    }
+}
+
+void
+APEX_bpred_print(APEX_BPred* bp, int penalty)
+{
+    long long resolved = bp->branches + bp->jumps;
+
+    printf("APEX_BPred : %s predictor", bpred_names[bp->kind]);
+    if (bp->kind == BPRED_BIMODAL || bp->kind == BPRED_GSHARE) {
+        printf(", %d counters, %d BTB entries", bp->size, bp->btb_size);
+    }
+    printf("\n");
+    printf("APEX_BPred : %lld branches resolved (%lld BZ/BNZ, %lld JUMP), "
+           "%lld taken\n", resolved, bp->branches, bp->jumps, bp->taken);
+    printf("APEX_BPred : %lld mispredicted (%.2f%%)",
+           bp->mispredicts, resolved ? 100.0 * bp->mispredicts / resolved : 0.0);
+    if (penalty) {
+        printf(", %lld penalty cycles", bp->mispredicts * penalty);
+    }
+    printf("\n");
+}
+
+void
+APEX_bpred_stop(APEX_BPred* bp)
+{
+    free(bp->counters);
+    free(bp->btb_pc);
+    free(bp->btb_target);
+    free(bp);
+}
@@ -0,0 +1,58 @@
+#ifndef _APEX_BPRED_H_
+#define _APEX_BPRED_H_
+/**
+ *  bpred.h
+ *  Branch prediction in fetch. BZ/BNZ/JUMP still resolve in MEM; a
+ *  prediction only decides which PC fetch continues with, and a wrong one
+ *  is squashed from DRF and EX the same way a taken branch always was.
+ */
+#include "cpu.h"
+
+enum
+{
+    BPRED_NOT_TAKEN,	// Always fetch pc + 4
+    BPRED_BTFN,		// Backward BZ/BNZ taken, forward not taken
+    BPRED_BIMODAL,	// 2-bit counters indexed by pc, targets from the BTB
+    BPRED_GSHARE	// 2-bit counters indexed by pc ^ global history
+};
+
+/* Cycles a misprediction costs the 5-stage and superscalar pipelines:
+ * the wrong-path DRF and EX latches */
+#define BPRED_PENALTY 2
+
+typedef struct APEX_BPred
+{
+    int kind;		    // BPRED_*
+    int size;		    // Counters, power of 2
+    int btb_size;	    // BTB entries, power of 2
+    unsigned char* counters;	// [size], 0-1 predict not taken, 2-3 taken
+    int* btb_pc;	    // [btb_size], branch pc, -1 if empty
+    int* btb_target;	    // [btb_size]
+    unsigned int history;   // Outcomes of the last resolved BZ/BNZ, newest in bit 0
+
+    /* Run summary */
+    long long branches;	    // BZ/BNZ resolved
+    long long jumps;	    // JUMP resolved
+    long long taken;
+    long long mispredicts;
+} APEX_BPred;
+
+APEX_BPred*
+APEX_bpred_init(const char* kind, int size);
+
+int
+APEX_bpred_predict(APEX_BPred* bp, APEX_Instruction* ins, int pc, int* index);
+
+void
+APEX_bpred_update(APEX_BPred* bp, int op, int pc, int index, int taken,
+                  int target, int mispredicted);
+
+/* penalty is the cost of one misprediction in cycles, 0 when the engine
+ * has no fixed cost (the out-of-order model) and none is printed */
+void
+APEX_bpred_print(APEX_BPred* bp, int penalty);
+
+void
+APEX_bpred_stop(APEX_BPred* bp);
+
+#endif
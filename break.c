@@ -0,0 +1,218 @@
+/*
+ *  break.c
+ *  Breakpoints and watchpoints, see break.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "break.h"
+
+static const char* stall_names[NUM_BREAK_STALLS] = { "decode", "hazard", "dcache" };
+
+/* Parses one spec into check. Returns 0, or -1 if it is not valid. */
+static int
+parse_spec(APEX_Break_Check* check, const char* spec)
+{
+    char name[16];
+    char tail;
+
+    memset(check, 0, sizeof(*check));
+    snprintf(check->text, sizeof(check->text), "%s", spec);
+
+    if (sscanf(spec, "pc=%d%c", &check->target, &tail) == 1) {
+        check->kind = BREAK_PC;
+        return 0;
+    }
+    if (sscanf(spec, "cycle=%d%c", &check->target, &tail) == 1) {
+        check->kind = BREAK_CYCLE;
+        return check->target >= 0 ? 0 : -1;
+    }
+    if (sscanf(spec, "R%d=%d%c", &check->target, &check->value, &tail) == 2 ||
+        sscanf(spec, "R%d%c", &check->target, &tail) == 1) {
+        check->kind = BREAK_REG;
+        check->has_value = strchr(spec, '=') != NULL;
+        return (check->target >= 0 && check->target < 16) ? 0 : -1;
+    }
+    if (sscanf(spec, "mem[%d]=%d%c", &check->target, &check->value, &tail) == 2 ||
+        (sscanf(spec, "mem[%d%c", &check->target, &tail) == 2 && tail == ']' &&
+         spec[strlen(spec) - 1] == ']')) {
+        check->kind = BREAK_MEM;
+        check->has_value = strchr(spec, '=') != NULL;
+        return (check->target >= 0 && check->target < APEX_DATA_WORDS) ? 0 : -1;
+    }
+    if (sscanf(spec, "stall:%15[a-z]>%d%c", name, &check->value, &tail) == 2) {
+        check->kind = BREAK_STALL;
+        for (int i = 0; i < NUM_BREAK_STALLS; ++i) {
+            if (strcmp(name, stall_names[i]) == 0) {
+                check->target = i;
+                return check->value >= 0 ? 0 : -1;
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+ * Compiles the specs into a check table for a program of code_memory_size
+ * instructions. Returns NULL (after saying why) if a spec is not valid.
+ */
+APEX_Breaks*
+APEX_break_compile(const char** specs, int count, int code_memory_size)
+{
+    if (count > BREAK_MAX_CHECKS) {
+        fprintf(stderr, "APEX_Break : At most %d breakpoints\n", BREAK_MAX_CHECKS);
+        return NULL;
+    }
+
+    APEX_Breaks* breaks = calloc(1, sizeof(*breaks));
+    if (!breaks) {
+        return NULL;
+    }
+    breaks->pc_watch = calloc(code_memory_size > 0 ? code_memory_size : 1, 1);
+    breaks->code_memory_size = code_memory_size;
+    breaks->next_cycle = -1;
+    if (!breaks->pc_watch) {
+        APEX_break_stop(breaks);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        APEX_Break_Check* check = &breaks->checks[breaks->num_checks++];
+        if (parse_spec(check, specs[i]) != 0) {
+            fprintf(stderr, "APEX_Break : Invalid breakpoint %s\n", specs[i]);
+            APEX_break_stop(breaks);
+            return NULL;
+        }
+
+        int index = get_code_index(check->target);
+        switch (check->kind) {
+        case BREAK_PC:
+            if (check->target < 4000 || (check->target - 4000) % 4 != 0 ||
+                index >= code_memory_size) {
+                fprintf(stderr, "APEX_Break : No instruction at pc(%d)\n",
+                        check->target);
+                APEX_break_stop(breaks);
+                return NULL;
+            }
+            breaks->pc_watch[index] = 1;
+            break;
+        case BREAK_CYCLE:
+            if (breaks->next_cycle < 0 || check->target < breaks->next_cycle) {
+                breaks->next_cycle = check->target;
+            }
+            break;
+        case BREAK_REG:
+            breaks->reg_watch |= 1u << check->target;
+            break;
+        case BREAK_MEM:
+            breaks->mem_watch[check->target / 64] |= 1ULL << (check->target % 64);
+            break;
+        case BREAK_STALL:
+            breaks->stall_watch |= 1u << check->target;
+            break;
+        }
+    }
+    return breaks;
+}
+
+/* Reports a check that fired and stops the run at the end of the cycle */
+static void
+break_hit(APEX_CPU* cpu, APEX_Break_Check* check)
+{
+    APEX_Breaks* breaks = cpu->breaks;
+    printf("APEX_Break : %s hit at clock %d\n", check->text, cpu->clock);
+    breaks->hit = 1;
+    if (cpu->exit_status == APEX_EXIT_OK) {
+        cpu->exit_status = APEX_EXIT_BREAK;
+    }
+}
+
+/* Instruction at pc committed, pc has a breakpoint */
+void
+APEX_break_commit(APEX_CPU* cpu, int pc)
+{
+    APEX_Breaks* breaks = cpu->breaks;
+    for (int i = 0; i < breaks->num_checks; ++i) {
+        if (breaks->checks[i].kind == BREAK_PC && breaks->checks[i].target == pc) {
+            break_hit(cpu, &breaks->checks[i]);
+        }
+    }
+}
+
+static void
+break_write(APEX_CPU* cpu, int kind, int target, int old_value, int value)
+{
+    APEX_Breaks* breaks = cpu->breaks;
+    for (int i = 0; i < breaks->num_checks; ++i) {
+        APEX_Break_Check* check = &breaks->checks[i];
+        if (check->kind != kind || check->target != target) {
+            continue;
+        }
+        if (check->has_value ? value == check->value : value != old_value) {
+            printf("APEX_Break : %s written %d -> %d\n", check->text, old_value,
+                   value);
+            break_hit(cpu, check);
+        }
+    }
+}
+
+/* Watched register r is being written */
+void
+APEX_break_reg(APEX_CPU* cpu, int r, int old_value, int value)
+{
+    break_write(cpu, BREAK_REG, r, old_value, value);
+}
+
+/* Watched data memory word is being written */
+void
+APEX_break_mem(APEX_CPU* cpu, int address, int old_value, int value)
+{
+    break_write(cpu, BREAK_MEM, address, old_value, value);
+}
+
+/* Clock reached next_cycle */
+void
+APEX_break_cycle(APEX_CPU* cpu)
+{
+    APEX_Breaks* breaks = cpu->breaks;
+    for (int i = 0; i < breaks->num_checks; ++i) {
+        if (breaks->checks[i].kind == BREAK_CYCLE &&
+            breaks->checks[i].target == cpu->clock) {
+            break_hit(cpu, &breaks->checks[i]);
+        }
+    }
+}
+
+/* Stall signals of the cycle just resolved, with a stall check set */
+void
+APEX_break_stall(APEX_CPU* cpu)
+{
+    APEX_Breaks* breaks = cpu->breaks;
+    CPU_Signals* sig = &cpu->sig;
+    int active[NUM_BREAK_STALLS];
+
+    active[BREAK_STALL_DECODE] = sig->drf_stalled;
+    active[BREAK_STALL_HAZARD] = sig->drf_hazard;
+    active[BREAK_STALL_DCACHE] = sig->mem_stall;
+
+    for (int c = 0; c < NUM_BREAK_STALLS; ++c) {
+        breaks->stall_run[c] = active[c] ? breaks->stall_run[c] + 1 : 0;
+    }
+    for (int i = 0; i < breaks->num_checks; ++i) {
+        APEX_Break_Check* check = &breaks->checks[i];
+        if (check->kind == BREAK_STALL &&
+            breaks->stall_run[check->target] == check->value + 1) {
+            printf("APEX_Break : %s stall for %d cycles\n",
+                   stall_names[check->target], check->value + 1);
+            break_hit(cpu, check);
+        }
+    }
+}
+
+void
+APEX_break_stop(APEX_Breaks* breaks)
+{
+    free(breaks->pc_watch);
+    free(breaks);
+}
@@ -0,0 +1,94 @@
+#ifndef _APEX_BREAK_H_
+#define _APEX_BREAK_H_
+/**
+ *  break.h
+ *  Breakpoints and watchpoints (--break). The specs are compiled once into
+ *  a check table with a mask per kind of event, and the simulator only
+ *  calls in here on an event some check watches: a commit at a watched
+ *  PC, a write to a watched register or data memory word, the cycle of a
+ *  cycle breakpoint, and stall signals when a stall check is set. With no
+ *  --break the table is NULL and none of the hooks run.
+ *
+ *  Specs:
+ *      pc=<pc>		    instruction at pc commits
+ *      cycle=<n>	    end of clock cycle n
+ *      R<r>		    register r is written with a new value
+ *      R<r>=<v>	    register r is written with v
+ *      mem[<a>]	    data memory word a is written with a new value
+ *      mem[<a>]=<v>	    data memory word a is written with v
+ *      stall:<cause>><n>   5-stage pipeline only, a stall lasts more than n
+ *			    cycles; cause is decode (DRF holds its latch for
+ *			    any reason), hazard (DRF waits on a source
+ *			    register) or dcache (MEM waits on the data cache)
+ */
+#include "cpu.h"
+#include "image.h"
+
+/* Most --break options */
+#define BREAK_MAX_CHECKS 32
+
+enum
+{
+    BREAK_PC,
+    BREAK_CYCLE,
+    BREAK_REG,
+    BREAK_MEM,
+    BREAK_STALL
+};
+
+enum
+{
+    BREAK_STALL_DECODE,
+    BREAK_STALL_HAZARD,
+    BREAK_STALL_DCACHE,
+    NUM_BREAK_STALLS
+};
+
+typedef struct APEX_Break_Check
+{
+    int kind;		    // BREAK_*
+    int target;		    // PC, cycle, register, address or BREAK_STALL_*
+    int has_value;	    // REG/MEM: break on equality rather than change
+    int value;		    // Value, or the stall length to exceed
+    char text[32];	    // Spec as given, for the report
+} APEX_Break_Check;
+
+typedef struct APEX_Breaks
+{
+    int num_checks;
+    APEX_Break_Check checks[BREAK_MAX_CHECKS];
+
+    /* What the hooks test before calling in */
+    char* pc_watch;	    // [code_memory_size], 1 for PCs with a breakpoint
+    int code_memory_size;
+    unsigned int reg_watch;	// Bit per register
+    unsigned long long mem_watch[APEX_DATA_WORDS / 64];	// Bit per word
+    int next_cycle;	    // Earliest cycle breakpoint, -1 if none
+    unsigned int stall_watch;	// Bit per BREAK_STALL_*
+    int stall_run[NUM_BREAK_STALLS];	// Cycles each cause has lasted
+
+    int hit;		    // A check fired, the run stops after this cycle
+} APEX_Breaks;
+
+APEX_Breaks*
+APEX_break_compile(const char** specs, int count, int code_memory_size);
+
+void
+APEX_break_commit(APEX_CPU* cpu, int pc);
+
+void
+APEX_break_reg(APEX_CPU* cpu, int r, int old_value, int value);
+
+void
+APEX_break_mem(APEX_CPU* cpu, int address, int old_value, int value);
+
+void
+APEX_break_cycle(APEX_CPU* cpu);
+
+void
+APEX_break_stall(APEX_CPU* cpu);
+
+void
+APEX_break_stop(APEX_Breaks* breaks);
+
+#endif
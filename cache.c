@@ -0,0 +1,236 @@
+/*
+ *  cache.c
+ *  Set-associative L1 data cache timing model
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+/* data_memory holds 4096 words of 4 bytes, 14 bits of byte address */
+#define CACHE_ADDRESS_MASK ((4096 * 4) - 1)
+
+#define TAG_VALID 1
+#define TAG_DIRTY 2
+
+static int
+log2_exact(int value)
+{
+    int bits = 0;
+    if (value <= 0 || (value & (value - 1))) {
+        return -1;
+    }
+    while ((1 << bits) < value) {
+        bits++;
+    }
+    return bits;
+}
+
+/* Way at position pos of a set's replacement order */
+static int
+order_way(unsigned long long order, int pos)
+{
+    return (order >> (4 * pos)) & 0xf;
+}
+
+/* Moves way to the front of the order, keeping the others in sequence */
+static unsigned long long
+order_touch(unsigned long long order, int ways, int way)
+{
+    for (int pos = 0; pos < ways; ++pos) {
+        if (order_way(order, pos) != way) {
+            continue;
+        }
+        unsigned long long newer = order & ((1ULL << (4 * pos)) - 1);
+        unsigned long long older =
+        (pos + 1 < CACHE_MAX_WAYS) ? (order >> (4 * (pos + 1))) << (4 * (pos + 1)) : 0;
+        return older | (newer << 4) | (unsigned long long)way;
+    }
+    return order;
+}
+
+/*
+ * Parses "<size>,<ways>,<line>[,lru|fifo|random][,wb|wt]" (sizes in
+ * bytes, powers of two). Returns NULL and says why on a bad config.
+ */
+APEX_Cache*
+APEX_cache_init(const char* config, int hit_latency, int miss_latency)
+{
+    APEX_Cache* cache = calloc(1, sizeof(*cache));
+    if (!cache) {
+        return NULL;
+    }
+    cache->replacement = CACHE_LRU;
+    cache->write_policy = CACHE_WRITE_BACK;
+    cache->hit_latency = hit_latency;
+    cache->miss_latency = miss_latency;
+    cache->random_state = 0x2545f491;
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s", config);
+    char* token = strtok(buf, ",");
+    for (int field = 0; token; ++field, token = strtok(NULL, ",")) {
+        if (field == 0) {
+            cache->size = atoi(token);
+        } else if (field == 1) {
+            cache->ways = atoi(token);
+        } else if (field == 2) {
+            cache->line_size = atoi(token);
+        } else if (strcmp(token, "lru") == 0) {
+            cache->replacement = CACHE_LRU;
+        } else if (strcmp(token, "fifo") == 0) {
+            cache->replacement = CACHE_FIFO;
+        } else if (strcmp(token, "random") == 0) {
+            cache->replacement = CACHE_RANDOM;
+        } else if (strcmp(token, "wb") == 0) {
+            cache->write_policy = CACHE_WRITE_BACK;
+        } else if (strcmp(token, "wt") == 0) {
+            cache->write_policy = CACHE_WRITE_THROUGH;
+        } else {
+            fprintf(stderr, "APEX_Cache : Unknown cache option %s\n", token);
+            free(cache);
+            return NULL;
+        }
+    }
+
+    cache->offset_bits = log2_exact(cache->line_size);
+    if (cache->ways < 1 || cache->ways > CACHE_MAX_WAYS ||
+        cache->offset_bits < 2 || log2_exact(cache->size) < 0 ||
+        cache->size < cache->line_size * cache->ways ||
+        cache->size % (cache->line_size * cache->ways) != 0 ||
+        cache->size > CACHE_ADDRESS_MASK + 1 ||
+        hit_latency < 1 || miss_latency < hit_latency) {
+        fprintf(stderr, "APEX_Cache : Invalid cache %s, latency %d/%d\n",
+                config, hit_latency, miss_latency);
+        free(cache);
+        return NULL;
+    }
+    cache->sets = cache->size / (cache->line_size * cache->ways);
+    cache->set_bits = log2_exact(cache->sets);
+    if (cache->set_bits < 0) {
+        fprintf(stderr, "APEX_Cache : %d ways do not divide %s into a power "
+                "of two sets\n", cache->ways, config);
+        free(cache);
+        return NULL;
+    }
+
+    cache->tags = calloc(cache->sets * cache->ways, sizeof(*cache->tags));
+    cache->order = malloc(sizeof(*cache->order) * cache->sets);
+    if (!cache->tags || !cache->order) {
+        APEX_cache_stop(cache);
+        return NULL;
+    }
+    unsigned long long order = 0;
+    for (int way = 0; way < cache->ways; ++way) {
+        order |= (unsigned long long)way << (4 * way);
+    }
+    for (int set = 0; set < cache->sets; ++set) {
+        cache->order[set] = order;
+    }
+    return cache;
+}
+
+/* Way to refill in a set: an invalid one if any, else by policy */
+static int
+choose_victim(APEX_Cache* cache, int set)
+{
+    unsigned short* tags = &cache->tags[set * cache->ways];
+    for (int way = 0; way < cache->ways; ++way) {
+        if (!(tags[way] & TAG_VALID)) {
+            return way;
+        }
+    }
+    if (cache->replacement == CACHE_RANDOM) {
+        unsigned int x = cache->random_state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        cache->random_state = x;
+        return x % cache->ways;
+    }
+    return order_way(cache->order[set], cache->ways - 1);
+}
+
+/*
+ * Looks up the data memory word at address and updates the cache for a
+ * load or store. Returns the cycles the access spends in MEM.
+ */
+int
+APEX_cache_access(APEX_Cache* cache, int address, int is_store)
+{
+    unsigned int byte_address = ((unsigned int)address * 4) & CACHE_ADDRESS_MASK;
+    int set = (byte_address >> cache->offset_bits) & (cache->sets - 1);
+    unsigned short tag = byte_address >> (cache->offset_bits + cache->set_bits);
+    unsigned short* tags = &cache->tags[set * cache->ways];
+    int latency = cache->miss_latency;
+    int way;
+
+    if (is_store) {
+        cache->stores++;
+    } else {
+        cache->loads++;
+    }
+
+    for (way = 0; way < cache->ways; ++way) {
+        if ((tags[way] & TAG_VALID) && (tags[way] >> 2) == tag) {
+            break;
+        }
+    }
+
+    if (way < cache->ways) {
+        latency = cache->hit_latency;
+        if (cache->replacement == CACHE_LRU) {
+            cache->order[set] = order_touch(cache->order[set], cache->ways, way);
+        }
+        if (is_store && cache->write_policy == CACHE_WRITE_BACK) {
+            tags[way] |= TAG_DIRTY;
+        }
+    } else {
+        if (is_store) {
+            cache->store_misses++;
+        } else {
+            cache->load_misses++;
+        }
+        if (!is_store || cache->write_policy == CACHE_WRITE_BACK) {
+            way = choose_victim(cache, set);
+            if ((tags[way] & TAG_VALID) && (tags[way] & TAG_DIRTY)) {
+                cache->writebacks++;
+            }
+            tags[way] = (tag << 2) | TAG_VALID | (is_store ? TAG_DIRTY : 0);
+            cache->order[set] = order_touch(cache->order[set], cache->ways, way);
+        }
+    }
+
+    cache->stall_cycles += latency - 1;
+    return latency;
+}
+
+void
+APEX_cache_print(APEX_Cache* cache)
+{
+    static const char* replacement[] = { "LRU", "FIFO", "random" };
+    long long accesses = cache->loads + cache->stores;
+    long long misses = cache->load_misses + cache->store_misses;
+
+    printf("APEX_Cache : L1D %d B, %d-way, %d B lines, %d sets, %s, %s, "
+           "hit %d / miss %d cycles\n",
+           cache->size, cache->ways, cache->line_size, cache->sets,
+           replacement[cache->replacement],
+           cache->write_policy == CACHE_WRITE_BACK ? "write-back" : "write-through",
+           cache->hit_latency, cache->miss_latency);
+    printf("APEX_Cache : loads %lld (%lld misses), stores %lld (%lld misses), "
+           "hit rate %.2f%%\n",
+           cache->loads, cache->load_misses, cache->stores, cache->store_misses,
+           accesses ? 100.0 * (accesses - misses) / accesses : 0.0);
+    printf("APEX_Cache : writebacks %lld, MEM stall cycles %lld\n",
+           cache->writebacks, cache->stall_cycles);
+}
+
+void
+APEX_cache_stop(APEX_Cache* cache)
+{
+    free(cache->tags);
+    free(cache->order);
+    free(cache);
+}
@@ -0,0 +1,65 @@
+#ifndef _APEX_CACHE_H_
+#define _APEX_CACHE_H_
+/**
+ *  cache.h
+ *  Timing model of a set-associative L1 data cache in front of
+ *  data_memory. It only decides how many cycles a LOAD/STORE spends in
+ *  MEM; values are always read from and written to data_memory.
+ */
+
+enum
+{
+    CACHE_LRU,
+    CACHE_FIFO,
+    CACHE_RANDOM
+};
+
+enum
+{
+    CACHE_WRITE_BACK,	    // Write-allocate, dirty lines written back on eviction
+    CACHE_WRITE_THROUGH	    // No-write-allocate, every store goes to memory
+};
+
+/* Most ways a set can have: the replacement order of a set is packed as
+ * one 4-bit way number per position into 64 bits */
+#define CACHE_MAX_WAYS 16
+
+typedef struct APEX_Cache
+{
+    int size;		    // Bytes
+    int ways;
+    int line_size;	    // Bytes
+    int sets;
+    int offset_bits;
+    int set_bits;
+    int replacement;	    // CACHE_LRU / FIFO / RANDOM
+    int write_policy;	    // CACHE_WRITE_BACK / WRITE_THROUGH
+    int hit_latency;	    // Cycles in MEM on a hit, 1 is the plain pipeline
+    int miss_latency;	    // Cycles in MEM on a miss
+
+    unsigned short* tags;   // [sets * ways], tag << 2 | dirty << 1 | valid
+    unsigned long long* order;	// [sets], way numbers, most recent first
+    unsigned int random_state;
+
+    /* Run summary */
+    long long loads;
+    long long load_misses;
+    long long stores;
+    long long store_misses;
+    long long writebacks;
+    long long stall_cycles;
+} APEX_Cache;
+
+APEX_Cache*
+APEX_cache_init(const char* config, int hit_latency, int miss_latency);
+
+int
+APEX_cache_access(APEX_Cache* cache, int address, int is_store);
+
+void
+APEX_cache_print(APEX_Cache* cache);
+
+void
+APEX_cache_stop(APEX_Cache* cache);
+
+#endif
@@ -0,0 +1,345 @@
+/*
+ *  checkpoint.c
+ *  Prefix checkpoints for incremental re-simulation, see checkpoint.h
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "image.h"
+
+static const char ckpt_magic[4] = { 'A', 'P', 'X', 'C' };
+
+static unsigned long long
+ckpt_mix(unsigned long long h, unsigned long long value)
+{
+    return (h ^ value) * 0x100000001b3ULL;
+}
+
+/* Hash of one instruction, everything the pipeline reads of it */
+static unsigned long long
+instruction_hash(const APEX_Instruction* ins)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    for (const char* c = ins->opcode; *c; ++c) {
+        h = ckpt_mix(h, (unsigned char)*c);
+    }
+    h = ckpt_mix(h, (unsigned int)ins->op);
+    h = ckpt_mix(h, (unsigned int)ins->rd);
+    h = ckpt_mix(h, (unsigned int)ins->rs1);
+    h = ckpt_mix(h, (unsigned int)ins->rs2);
+    return ckpt_mix(h, (unsigned int)ins->imm);
+}
+
+/*
+ * Sets up checkpoints in dir (created if need be) every period cycles,
+ * for a CPU whose memory and register images are already loaded. Returns
+ * NULL if dir cannot be used.
+ */
+APEX_Checkpoints*
+APEX_ckpt_init(APEX_CPU* cpu, const char* dir, int period)
+{
+    if (period < 1) {
+        fprintf(stderr, "APEX_Ckpt : Checkpoint period must be at least 1\n");
+        return NULL;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "APEX_Ckpt : Unable to create %s\n", dir);
+        return NULL;
+    }
+
+    APEX_Checkpoints* ckpt = calloc(1, sizeof(*ckpt));
+    if (!ckpt) {
+        return NULL;
+    }
+    ckpt->prefix_hash = malloc(sizeof(unsigned long long) *
+                               (cpu->code_memory_size + 1));
+    if (!ckpt->prefix_hash) {
+        free(ckpt);
+        return NULL;
+    }
+    ckpt->dir = dir;
+    ckpt->period = period;
+    ckpt->next = period;
+
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    ckpt->prefix_hash[0] = h;
+    for (int i = 0; i < cpu->code_memory_size; ++i) {
+        h = ckpt_mix(h, instruction_hash(&cpu->code_memory[i]));
+        ckpt->prefix_hash[i + 1] = h;
+    }
+
+    /* The start state: the images through the state hash, and which
+     * registers a register image made ready */
+    h = ckpt_mix(0xcbf29ce484222325ULL, cpu->state_hash);
+    for (int r = 0; r < 16; ++r) {
+        h = ckpt_mix(h, (unsigned int)cpu->regs_valid[r]);
+    }
+    ckpt->config = ckpt_mix(h, (unsigned int)cpu->loop_check_period);
+    return ckpt;
+}
+
+/*
+ * First code index at which the program differs from the one the last
+ * run in the directory saved, code_memory_size if none of it does (it may
+ * still have been cut short), or -1 if there is no saved program
+ */
+static int
+first_modified(APEX_CPU* cpu, const char* dir)
+{
+    char path[PATH_MAX];
+    int count;
+
+    snprintf(path, sizeof(path), "%s/program", dir);
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        return -1;
+    }
+    if (fread(&count, sizeof(count), 1, fp) != 1) {
+        fclose(fp);
+        return -1;
+    }
+    int i = 0;
+    for (; i < cpu->code_memory_size && i < count; ++i) {
+        unsigned long long h;
+        if (fread(&h, sizeof(h), 1, fp) != 1 ||
+            h != instruction_hash(&cpu->code_memory[i])) {
+            break;
+        }
+    }
+    fclose(fp);
+    return i;
+}
+
+/* Saves the hashes of the program being run for the next first_modified() */
+static void
+save_program(APEX_CPU* cpu, const char* dir)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 16];
+
+    snprintf(path, sizeof(path), "%s/program", dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+    FILE* fp = fopen(tmp, "wb");
+    if (!fp) {
+        return;
+    }
+    fwrite(&cpu->code_memory_size, sizeof(int), 1, fp);
+    for (int i = 0; i < cpu->code_memory_size; ++i) {
+        unsigned long long h = instruction_hash(&cpu->code_memory[i]);
+        fwrite(&h, sizeof(h), 1, fp);
+    }
+    int err = ferror(fp);
+    if (fclose(fp) != 0 || err || rename(tmp, path) != 0) {
+        unlink(tmp);
+    }
+}
+
+/* Key of a state that depends on code indices 0..depends */
+static void
+make_key(APEX_CPU* cpu, int depends, int* prefix, int* past_end,
+         unsigned long long* prefix_hash)
+{
+    *past_end = depends >= cpu->code_memory_size;
+    *prefix = *past_end ? cpu->code_memory_size : depends + 1;
+    *prefix_hash = cpu->ckpt->prefix_hash[*prefix];
+}
+
+/* Whether a key made by a run of a program code_size long holds for this one */
+static int
+key_holds(APEX_CPU* cpu, int prefix, int past_end, int code_size,
+          unsigned long long prefix_hash)
+{
+    return prefix >= 0 && prefix <= cpu->code_memory_size &&
+           prefix_hash == cpu->ckpt->prefix_hash[prefix] &&
+           (!past_end || code_size == cpu->code_memory_size);
+}
+
+/* Whether a checkpoint with header can be resumed by this CPU */
+static int
+usable(APEX_CPU* cpu, const APEX_Ckpt_Header* header)
+{
+    APEX_Checkpoints* ckpt = cpu->ckpt;
+    return memcmp(header->magic, ckpt_magic, sizeof(ckpt_magic)) == 0 &&
+           header->version == APEX_CKPT_VERSION &&
+           header->snapshot_size == (int)sizeof(CPU_Snapshot) &&
+           header->config == ckpt->config &&
+           header->samples >= 0 && header->samples <= LOOP_TABLE_SIZE &&
+           key_holds(cpu, header->prefix, header->past_end, header->code_size,
+                     header->prefix_hash);
+}
+
+/*
+ * Reads the livelock check samples of a checkpoint back into the table,
+ * those whose key holds for this program. Returns 0 on a damaged file.
+ */
+static int
+read_samples(APEX_CPU* cpu, const APEX_Ckpt_Header* header, FILE* fp)
+{
+    APEX_Ckpt_Sample saved;
+    CPU_Loop_Sample* table = header->samples ? APEX_cpu_loop_table(cpu) : NULL;
+    if (header->samples && !table) {
+        return 0;
+    }
+    for (int i = 0; i < header->samples; ++i) {
+        if (fread(&saved, sizeof(saved), 1, fp) != 1 ||
+            saved.slot < 0 || saved.slot >= LOOP_TABLE_SIZE) {
+            return 0;
+        }
+        if (key_holds(cpu, saved.prefix, saved.past_end, header->code_size,
+                      saved.prefix_hash)) {
+            table[saved.slot] = saved.sample;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Resumes from the latest usable checkpoint in the directory, if any.
+ * Returns the cycle resumed at, 0 when starting from the beginning.
+ */
+int
+APEX_ckpt_resume(APEX_CPU* cpu)
+{
+    APEX_Checkpoints* ckpt = cpu->ckpt;
+    char path[PATH_MAX];
+    APEX_Ckpt_Header header;
+    int best = -1;
+
+    int modified = first_modified(cpu, ckpt->dir);
+
+    DIR* d = opendir(ckpt->dir);
+    struct dirent* ent;
+    while (d && (ent = readdir(d))) {
+        int clock;
+        char tail;
+        if (sscanf(ent->d_name, "ckpt.%d%c", &clock, &tail) != 1 ||
+            clock <= best) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", ckpt->dir, ent->d_name);
+        FILE* fp = fopen(path, "rb");
+        if (!fp) {
+            continue;
+        }
+        if (fread(&header, sizeof(header), 1, fp) == 1 &&
+            header.clock == clock && usable(cpu, &header)) {
+            best = clock;
+        }
+        fclose(fp);
+    }
+    if (d) {
+        closedir(d);
+    }
+    save_program(cpu, ckpt->dir);
+
+    if (modified >= 0 && modified < cpu->code_memory_size) {
+        printf("APEX_Ckpt : Program differs from pc(%d) on\n",
+               4000 + modified * 4);
+    }
+    if (best < 0) {
+        printf("APEX_Ckpt : No checkpoint to resume from in %s\n", ckpt->dir);
+        return 0;
+    }
+
+    /* Everything is checked, only a damaged file can fail from here */
+    CPU_Snapshot* snap = malloc(sizeof(*snap));
+    int* data = malloc(sizeof(int) * APEX_DATA_WORDS);
+    snprintf(path, sizeof(path), "%s/ckpt.%d", ckpt->dir, best);
+    FILE* fp = fopen(path, "rb");
+    int ok = snap && data && fp &&
+             fread(&header, sizeof(header), 1, fp) == 1 &&
+             fread(snap, sizeof(*snap), 1, fp) == 1 &&
+             fread(data, sizeof(int), APEX_DATA_WORDS, fp) == APEX_DATA_WORDS &&
+             read_samples(cpu, &header, fp);
+    if (fp) {
+        fclose(fp);
+    }
+    if (ok) {
+        APEX_cpu_restore(cpu, snap);
+        memcpy(cpu->data_memory, data, sizeof(int) * APEX_DATA_WORDS);
+        ckpt->next = cpu->clock + ckpt->period;
+        printf("APEX_Ckpt : Resuming at cycle %d from %s, code up to pc(%d) "
+               "unchanged\n", cpu->clock, path, 4000 + (header.prefix - 1) * 4);
+    } else {
+        for (int i = 0; cpu->loop_table && i < LOOP_TABLE_SIZE; ++i) {
+            cpu->loop_table[i].clock = -1;
+        }
+        fprintf(stderr, "APEX_Ckpt : Unable to read %s, starting from cycle 0\n",
+                path);
+    }
+    free(snap);
+    free(data);
+    return ok ? cpu->clock : 0;
+}
+
+/* Writes a checkpoint of the state at the start of this cycle */
+void
+APEX_ckpt_take(APEX_CPU* cpu)
+{
+    APEX_Checkpoints* ckpt = cpu->ckpt;
+    APEX_Ckpt_Header header;
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 16];
+
+    CPU_Snapshot* snap = malloc(sizeof(*snap));
+    if (!snap) {
+        return;
+    }
+    APEX_cpu_snapshot(cpu, snap);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ckpt_magic, sizeof(ckpt_magic));
+    header.version = APEX_CKPT_VERSION;
+    header.snapshot_size = sizeof(CPU_Snapshot);
+    header.clock = cpu->clock;
+    make_key(cpu, APEX_cpu_depends_on(cpu), &header.prefix, &header.past_end,
+             &header.prefix_hash);
+    header.code_size = cpu->code_memory_size;
+    header.config = ckpt->config;
+    for (int i = 0; cpu->loop_table && i < LOOP_TABLE_SIZE; ++i) {
+        header.samples += cpu->loop_table[i].clock >= 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/ckpt.%d", ckpt->dir, cpu->clock);
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+    FILE* fp = fopen(tmp, "wb");
+    if (fp) {
+        fwrite(&header, sizeof(header), 1, fp);
+        fwrite(snap, sizeof(*snap), 1, fp);
+        fwrite(cpu->data_memory, sizeof(int), APEX_DATA_WORDS, fp);
+        for (int i = 0; cpu->loop_table && i < LOOP_TABLE_SIZE; ++i) {
+            CPU_Loop_Sample* sample = &cpu->loop_table[i];
+            if (sample->clock >= 0) {
+                APEX_Ckpt_Sample saved;
+                memset(&saved, 0, sizeof(saved));
+                saved.slot = i;
+                saved.sample = *sample;
+                make_key(cpu, sample->depends, &saved.prefix, &saved.past_end,
+                         &saved.prefix_hash);
+                fwrite(&saved, sizeof(saved), 1, fp);
+            }
+        }
+        int err = ferror(fp);
+        if (fclose(fp) != 0 || err || rename(tmp, path) != 0) {
+            unlink(tmp);
+        } else {
+            ckpt->taken++;
+        }
+    }
+    free(snap);
+    ckpt->next = cpu->clock + ckpt->period;
+}
+
+void
+APEX_ckpt_stop(APEX_Checkpoints* ckpt)
+{
+    free(ckpt->prefix_hash);
+    free(ckpt);
+}
@@ -0,0 +1,86 @@
+#ifndef _APEX_CHECKPOINT_H_
+#define _APEX_CHECKPOINT_H_
+/**
+ *  checkpoint.h
+ *  Periodic checkpoints of the 5-stage pipeline for incremental
+ *  re-simulation (--checkpoint). Every few cycles the pipeline snapshot
+ *  (CPU_Snapshot), data memory and the livelock check samples are written
+ *  to <dir>/ckpt.<cycle>, keyed by:
+ *
+ *      config	    hash of the start state (memory and register images)
+ *		    and of the livelock check period
+ *      prefix	    code indices 0..prefix-1 cover every instruction
+ *		    committed so far and every one in a latch
+ *      prefix_hash   hash of those instructions
+ *
+ *  The state at a checkpoint only depends on its prefix: what fetch
+ *  brought in past a loop's back branch and got squashed left nothing
+ *  behind. After an edit a checkpoint is still good if the edited program
+ *  has the same prefix, and the run resumes from the latest such one. If
+ *  a latch holds a fetch past the end of the program the program length
+ *  counts as well, since the pipeline stops on its last instruction.
+ *
+ *  Each livelock check sample is keyed the same way by the state it was
+ *  taken in, and on resume only the samples whose key still holds go back
+ *  into the table: the others are of states the edited program may never
+ *  reach. No checkpoint is taken while a livelock's PCs are collected.
+ *  <dir>/program holds a hash per instruction of the last program run, to
+ *  report the first modified PC.
+ *
+ *  Files are in host layout and only meant to be read back by the same
+ *  build; a different version or snapshot size is ignored.
+ */
+#include "cpu.h"
+
+#define APEX_CKPT_VERSION 2
+
+/* Cycles between checkpoints unless --checkpoint-every says so */
+#define DEFAULT_CKPT_PERIOD 256
+
+typedef struct APEX_Ckpt_Header
+{
+    char magic[4];	    // "APXC"
+    int version;
+    int snapshot_size;	    // sizeof(CPU_Snapshot)
+    int clock;
+    int prefix;
+    int past_end;	    // A latch holds a fetch past the last instruction
+    int code_size;
+    int samples;	    // APEX_Ckpt_Samples after the data memory
+    unsigned long long config;
+    unsigned long long prefix_hash;
+} APEX_Ckpt_Header;
+
+/* A used slot of the livelock check table, keyed like the header */
+typedef struct APEX_Ckpt_Sample
+{
+    int slot;
+    int prefix;
+    int past_end;
+    unsigned long long prefix_hash;
+    CPU_Loop_Sample sample;
+} APEX_Ckpt_Sample;
+
+typedef struct APEX_Checkpoints
+{
+    const char* dir;
+    int period;
+    int next;		    // Cycle the next checkpoint is taken at
+    int taken;
+    unsigned long long config;
+    unsigned long long* prefix_hash;	// [code_memory_size + 1], of indices 0..i-1
+} APEX_Checkpoints;
+
+APEX_Checkpoints*
+APEX_ckpt_init(APEX_CPU* cpu, const char* dir, int period);
+
+int
+APEX_ckpt_resume(APEX_CPU* cpu);
+
+void
+APEX_ckpt_take(APEX_CPU* cpu);
+
+void
+APEX_ckpt_stop(APEX_Checkpoints* ckpt);
+
+#endif
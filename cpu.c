@@ -10,17 +10,28 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "analysis.h"
+#include "break.h"
+#include "bpred.h"
+#include "cache.h"
+#include "checkpoint.h"
 #include "cpu.h"
+#include "func.h"
+#include "image.h"
+#include "perf.h"
+#include "trace.h"
 
 /* Set this flag to 1 to enable debug messages */
 #define ENABLE_DEBUG_MESSAGES 1
 //CPU_Stage* stageE;
 int stallFlag = 0;
-int bzF = 0;
-int bnzF = 0;
 int breakCounter = 0;
 int haltFlag = 0;
 
+/* Instruction record of an empty latch, cpu->ins[0] */
+static CPU_Stage empty_stage = { .op = OP_NONE, .rd = -1, .rs1 = -1,
+                                 .rs2 = -1, .imm = -1 };
+
 /*
  * This function creates and initializes APEX cpu.
  *
@@ -41,15 +52,57 @@ APEX_cpu_init(const char* filename)
     
     /* Initialize PC, Registers and all pipeline stages */
     cpu->pc = 4000;
+    cpu->commit_pc = 4000;
     memset(cpu->regs, 0, sizeof(int) * 16);
     memset(cpu->regs_valid, 1, sizeof(int) * 16);
-    memset(cpu->stage, 0, sizeof(CPU_Stage) * NUM_STAGES);
-    memset(cpu->data_memory, 0, sizeof(int) * 4000);
+    memset(cpu->ins, 0, sizeof(cpu->ins));
+    cpu->ins[0] = empty_stage;
+    memset(cpu->latch, 0, sizeof(cpu->latch));
+    cpu->stage = cpu->latch[0];
+    cpu->next_stage = cpu->latch[1];
+    cpu->clock = 0;
+    cpu->ins_completed = 0;
+    cpu->state_hash = 0;
+    cpu->max_cycles = 0;
+    cpu->loop_check_period = 0;
+    cpu->loop_table = NULL;
+    cpu->loop_period = 0;
+    cpu->loop_end = 0;
+    cpu->loop_pcs = NULL;
+    cpu->exit_status = APEX_EXIT_OK;
+    cpu->ref = NULL;
+    cpu->cosim_mismatch = 0;
+    cpu->dcache = NULL;
+    cpu->dcache_accessed = 0;
+    cpu->dcache_wait = 0;
+    cpu->trace = NULL;
+    cpu->bpred = NULL;
+    cpu->breaks = NULL;
+    cpu->ckpt = NULL;
+    cpu->commit_max = -1;
+    
+    cpu->data_memory = APEX_image_map(NULL, APEX_DATA_WORDS);
+    if (!cpu->data_memory) {
+        free(cpu);
+        return NULL;
+    }
     
     /* Parse input file and create code memory */
+    APEX_perf_phase(PERF_PHASE_PARSE);
     cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size);
+    APEX_perf_phase(PERF_PHASE_INIT);
     
     if (!cpu->code_memory) {
+        APEX_image_unmap(cpu->data_memory, APEX_DATA_WORDS);
+        free(cpu);
+        return NULL;
+    }
+    
+    /* Decode takes its source operands from this table */
+    cpu->sources = APEX_decode_table(cpu->code_memory, cpu->code_memory_size);
+    if (!cpu->sources) {
+        APEX_image_unmap(cpu->data_memory, APEX_DATA_WORDS);
+        free(cpu->code_memory);
         free(cpu);
         return NULL;
     }
@@ -58,6 +111,12 @@ APEX_cpu_init(const char* filename)
         fprintf(stderr,
                 "APEX_CPU : Initialized APEX CPU, loaded %d instructions\n",
                 cpu->code_memory_size);
+        APEX_Static_Info* info = APEX_analyze(cpu->code_memory,
+                                              cpu->code_memory_size);
+        fprintf(stderr, "APEX_CPU : Static lower bound %d cycles\n",
+                info ? APEX_static_cycle_estimate(info, cpu->code_memory,
+                                                  cpu->code_memory_size) : 0);
+        free(info);
         fprintf(stderr, "APEX_CPU : Printing Code Memory\n");
         printf("%-9s %-9s %-9s %-9s %-9s\n", "opcode", "rd", "rs1", "rs2", "imm");
         
@@ -89,10 +148,50 @@ APEX_cpu_init(const char* filename)
 void
 APEX_cpu_stop(APEX_CPU* cpu)
 {
+    if (cpu->ref) {
+        APEX_func_stop(cpu->ref);
+    }
+    if (cpu->dcache) {
+        APEX_cache_stop(cpu->dcache);
+    }
+    if (cpu->trace) {
+        APEX_trace_close(cpu->trace);
+    }
+    if (cpu->bpred) {
+        APEX_bpred_stop(cpu->bpred);
+    }
+    if (cpu->breaks) {
+        APEX_break_stop(cpu->breaks);
+    }
+    if (cpu->ckpt) {
+        APEX_ckpt_stop(cpu->ckpt);
+    }
+    APEX_image_unmap(cpu->data_memory, APEX_DATA_WORDS);
+    free(cpu->loop_table);
+    free(cpu->loop_pcs);
+    free(cpu->sources);
     free(cpu->code_memory);
     free(cpu);
 }
 
+/*
+ * Preloads data memory and/or the register file from binary images
+ * (image.h). Preloaded registers are ready for decode from the first
+ * cycle. Returns 0, or -1 if an image cannot be loaded.
+ */
+int
+APEX_cpu_load_images(APEX_CPU* cpu, const char* data_file, const char* reg_file)
+{
+    if (APEX_image_load(data_file, reg_file, &cpu->data_memory, cpu->regs,
+                        &cpu->state_hash) != 0) {
+        return -1;
+    }
+    if (reg_file) {
+        memset(cpu->regs_valid, 0, sizeof(cpu->regs_valid));
+    }
+    return 0;
+}
+
 /* Converts the PC(4000 series) into
  * array index for code memory
  *
@@ -105,49 +204,47 @@ get_code_index(int pc)
     return (pc - 4000) / 4;
 }
 
+/* Instruction record a latch holds */
+static CPU_Stage*
+latch_ins(APEX_CPU* cpu, CPU_Latch* latch)
+{
+    return &cpu->ins[latch->ins];
+}
+
 static void
 print_instruction(CPU_Stage* stage)
 {
-    if (strcmp(stage->opcode, "STORE") == 0) {
+    const char* opcode = get_opcode_name(stage->op);
+    
+    if (stage->op == OP_STORE) {
         printf(
-               "%s,R%d,R%d,#%d ", stage->opcode, stage->rs1, stage->rs2, stage->imm);
+               "%s,R%d,R%d,#%d ", opcode, stage->rs1, stage->rs2, stage->imm);
     }
     
-    if (strcmp(stage->opcode, "LOAD") == 0) {
-        printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
+    if (stage->op == OP_LOAD) {
+        printf("%s,R%d,R%d,R%d ", opcode, stage->rd, stage->rs1, stage->imm);
     }
     
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-        printf("%s,R%d,#%d ", stage->opcode, stage->rd, stage->imm);
+    if (stage->op == OP_MOVC) {
+        printf("%s,R%d,#%d ", opcode, stage->rd, stage->imm);
     }
     
-    if ((strcmp(stage->opcode, "ADD") == 0) || (strcmp(stage->opcode, "AND") == 0) || (strcmp(stage->opcode, "OR") == 0) || (strcmp(stage->opcode, "XOR") == 0) || (strcmp(stage->opcode, "SUB") == 0) || (strcmp(stage->opcode, "MUL") == 0)) {
-        printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
+    if (stage->op == OP_ADD || stage->op == OP_AND || stage->op == OP_OR ||
+        stage->op == OP_XOR || stage->op == OP_SUB || stage->op == OP_MUL) {
+        printf("%s,R%d,R%d,R%d ", opcode, stage->rd, stage->rs1, stage->rs2);
     }
     
-//    if (strcmp(stage->opcode, "SUB") == 0) {
-//        printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
-//    }
-//
-//    if (strcmp(stage->opcode, "MUL") == 0) {
-//        printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
-//    }
-    
-    if ((strcmp(stage->opcode, "BZ") == 0) || (strcmp(stage->opcode, "BNZ") == 0)) {
-        printf("%s,#%d ", stage->opcode, stage->imm);
+    if (stage->op == OP_BZ || stage->op == OP_BNZ) {
+        printf("%s,#%d ", opcode, stage->imm);
     }
     
-    if (strcmp(stage->opcode, "JUMP") == 0) {
-        printf("%s,R%d,#%d ", stage->opcode, stage->rs1, stage->imm);
+    if (stage->op == OP_JUMP) {
+        printf("%s,R%d,#%d ", opcode, stage->rs1, stage->imm);
     }
     
-    if (strcmp(stage->opcode, "HALT") == 0) {
-        printf("%s ", stage->opcode);
+    if (stage->op == OP_HALT) {
+        printf("%s ", opcode);
     }
-    
-//    if (strcmp(stage->opcode, "BNZ") == 0) {
-//        printf("%s,#%d ", stage->opcode, stage->imm);
-//    }
 }
 
 /* Debug function which dumps the cpu stage
@@ -164,7 +261,178 @@ print_stage_content(char* name, CPU_Stage* stage)
     printf("\n");
 }
 
+/* Register file and data memory writes, keeping the state hash current */
+static void
+write_reg(APEX_CPU* cpu, int rd, int value)
+{
+    if (cpu->breaks && ((cpu->breaks->reg_watch >> rd) & 1)) {
+        APEX_break_reg(cpu, rd, cpu->regs[rd], value);
+    }
+    cpu->state_hash ^=
+    apex_hash_slot(rd, cpu->regs[rd]) ^ apex_hash_slot(rd, value);
+    cpu->regs[rd] = value;
+}
+
+static void
+write_mem(APEX_CPU* cpu, int address, int value)
+{
+    if (cpu->breaks && ((cpu->breaks->mem_watch[address / 64] >> (address % 64)) & 1)) {
+        APEX_break_mem(cpu, address, cpu->data_memory[address], value);
+    }
+    cpu->state_hash ^=
+    apex_hash_slot(APEX_HASH_MEM_SLOT(address), cpu->data_memory[address]) ^
+    apex_hash_slot(APEX_HASH_MEM_SLOT(address), value);
+    cpu->data_memory[address] = value;
+}
+
+/*
+ * Co-simulation: steps the functional reference over the instruction the
+ * pipeline just committed and compares the two state hashes. The full
+ * register / memory diff is only computed once they disagree.
+ */
+static void
+cosim_commit(APEX_CPU* cpu, CPU_Stage* stage)
+{
+    APEX_Func* ref = cpu->ref;
+    int ref_pc = APEX_func_step(ref);
+    
+    if (ref_pc == stage->pc && ref->state_hash == cpu->state_hash) {
+        return;
+    }
+    
+    printf("APEX_Cosim : Mismatch at clock %d committing pc(%d), "
+           "reference committed pc(%d)\n", cpu->clock, stage->pc, ref_pc);
+    for (int i = 0; i < 16; ++i) {
+        if (cpu->regs[i] != ref->regs[i]) {
+            printf("APEX_Cosim :   R%d pipeline %d reference %d\n",
+                   i, cpu->regs[i], ref->regs[i]);
+        }
+    }
+    for (int i = 0; i < 4096; ++i) {
+        if (cpu->data_memory[i] != ref->data_memory[i]) {
+            printf("APEX_Cosim :   MEM[%d] pipeline %d reference %d\n",
+                   i, cpu->data_memory[i], ref->data_memory[i]);
+        }
+    }
+    cpu->cosim_mismatch = 1;
+    cpu->exit_status = APEX_EXIT_COSIM_MISMATCH;
+    breakCounter = 1;
+}
+
+void
+APEX_cpu_write_reg(APEX_CPU* cpu, int rd, int value)
+{
+    write_reg(cpu, rd, value);
+}
+
+void
+APEX_cpu_write_mem(APEX_CPU* cpu, int address, int value)
+{
+    write_mem(cpu, address, value);
+}
+
+/* Breakpoint at the PC of a committed instruction, if any */
+static void
+break_commit(APEX_CPU* cpu, int pc)
+{
+    int index = get_code_index(pc);
+    if (cpu->breaks && index >= 0 && index < cpu->breaks->code_memory_size &&
+        cpu->breaks->pc_watch[index]) {
+        APEX_break_commit(cpu, pc);
+    }
+}
+
+/* Co-simulation and PC breakpoint checks for an instruction committed */
+void
+APEX_cpu_commit_check(APEX_CPU* cpu, CPU_Stage* stage)
+{
+    if (cpu->ref) {
+        cosim_commit(cpu, stage);
+    }
+    break_commit(cpu, stage->pc);
+}
+
+void
+APEX_cpu_print_stage(const char* name, CPU_Stage* stage)
+{
+    print_stage_content((char*)name, stage);
+}
+
+/* Copies the pipeline state at the start of a cycle into snap */
+void
+APEX_cpu_snapshot(APEX_CPU* cpu, CPU_Snapshot* snap)
+{
+    memset(snap, 0, sizeof(*snap));
+    snap->clock = cpu->clock;
+    snap->pc = cpu->pc;
+    snap->commit_pc = cpu->commit_pc;
+    memcpy(snap->regs, cpu->regs, sizeof(snap->regs));
+    memcpy(snap->regs_valid, cpu->regs_valid, sizeof(snap->regs_valid));
+    memcpy(snap->ins, cpu->ins, sizeof(snap->ins));
+    memcpy(snap->latch, cpu->latch, sizeof(snap->latch));
+    snap->bank = cpu->stage == cpu->latch[0] ? 0 : 1;
+    snap->sig = cpu->sig;
+    snap->ins_completed = cpu->ins_completed;
+    snap->bzFlag = cpu->bzFlag;
+    snap->bnzFlag = cpu->bnzFlag;
+    snap->stallFlag = stallFlag;
+    snap->breakCounter = breakCounter;
+    snap->haltFlag = haltFlag;
+    snap->commit_max = cpu->commit_max;
+    snap->state_hash = cpu->state_hash;
+}
+
+/* Puts the pipeline back into the state snap was taken in */
+void
+APEX_cpu_restore(APEX_CPU* cpu, const CPU_Snapshot* snap)
+{
+    cpu->clock = snap->clock;
+    cpu->pc = snap->pc;
+    cpu->commit_pc = snap->commit_pc;
+    memcpy(cpu->regs, snap->regs, sizeof(cpu->regs));
+    memcpy(cpu->regs_valid, snap->regs_valid, sizeof(cpu->regs_valid));
+    memcpy(cpu->ins, snap->ins, sizeof(cpu->ins));
+    memcpy(cpu->latch, snap->latch, sizeof(cpu->latch));
+    cpu->stage = cpu->latch[snap->bank];
+    cpu->next_stage = cpu->latch[!snap->bank];
+    cpu->sig = snap->sig;
+    cpu->ins_completed = snap->ins_completed;
+    cpu->bzFlag = snap->bzFlag;
+    cpu->bnzFlag = snap->bnzFlag;
+    stallFlag = snap->stallFlag;
+    breakCounter = snap->breakCounter;
+    haltFlag = snap->haltFlag;
+    cpu->commit_max = snap->commit_max;
+    cpu->state_hash = snap->state_hash;
+}
+
+/*
+ * Highest code index the pipeline state depends on: the instructions
+ * committed so far and those in either latch bank, an empty fetch past
+ * the end of code memory included. A squashed instruction only counts
+ * while it is still in a latch.
+ */
+int
+APEX_cpu_depends_on(APEX_CPU* cpu)
+{
+    int max = cpu->commit_max;
+    for (int b = 0; b < 2; ++b) {
+        for (int i = 0; i < NUM_STAGES; ++i) {
+            int pc = latch_ins(cpu, &cpu->latch[b][i])->pc;
+            int index = get_code_index(pc);
+            if (pc >= 4000 && index > max) {
+                max = index;
+            }
+        }
+    }
+    return max;
+}
+
 void make_reg_valid(APEX_CPU* cpu, CPU_Stage *stage) {
+    /* Bubbles carry rd = -1, there is nothing to release */
+    if (stage->rd < 0 || stage->rd > 15) {
+        return;
+    }
     if (cpu->regs_valid[stage->rd] == 1 ) {
         cpu->regs_valid[stage->rd] = 0;
         //        } else if (stage->rd == stage->rs1 || stage->rd==stage->rs2) {
@@ -175,13 +443,283 @@ void make_reg_valid(APEX_CPU* cpu, CPU_Stage *stage) {
 //    printf("\ndec: %d:%d",stage->rd, cpu->regs_valid[stage->rd]);
 }
 
-void make_stage_empty(CPU_Stage *stage) {
-    strcpy(stage->opcode, "");
-    stage->rd = -1;
-    stage->rs1 = -1;
-    stage->rs2 = -1;
-    stage->imm = -1;
-    stage->pc = 0;
+/* Empties a latch; the stage keeps its busy and stalled state */
+void make_stage_empty(CPU_Latch *latch) {
+    latch->ins = 0;
+}
+
+/*
+ * A record no latch in either bank holds, for fetch to fill. A record can
+ * be in several latches at once (decode keeps what it stalls into EX, a
+ * MUL stays in EX while it moves on), so it is only reused once it has
+ * left both banks.
+ */
+static int
+free_ins(APEX_CPU* cpu)
+{
+    unsigned int used = 1;
+    for (int b = 0; b < 2; ++b) {
+        for (int i = 0; i < NUM_STAGES; ++i) {
+            used |= 1u << cpu->latch[b][i].ins;
+        }
+    }
+    int n = 1;
+    while ((used >> n) & 1) {
+        n++;
+    }
+    return n;
+}
+
+/* Pipeline control
+ *
+ * Every stage reads its input latch from the current bank (cpu->stage) and
+ * writes its output into the next bank (cpu->next_stage); the banks are
+ * swapped by pointer at the end of the cycle. A latch names the record in
+ * cpu->ins it holds, so handing an instruction on copies that index and
+ * the stage flags while stages fill in the record itself. Whatever one
+ * stage decides that another stage needs in the same cycle (branch squash, HALT flush,
+ * MUL and data hazard stalls) is worked out up front by resolve_cycle()
+ * from the current bank alone, and updates to state shared between stages
+ * (regs_valid, data memory, pc) are applied by end_cycle(). The stage
+ * functions therefore do not depend on the order they are called in.
+ */
+
+static int
+writes_register(CPU_Stage* stage)
+{
+    return stage->op == OP_MOVC || stage->op == OP_LOAD ||
+    stage->op == OP_ADD || stage->op == OP_SUB || stage->op == OP_MUL ||
+    stage->op == OP_AND || stage->op == OP_OR || stage->op == OP_XOR;
+}
+
+/* True when writeback commits (and releases rd of) its latch this cycle */
+static int
+wb_commits(APEX_CPU* cpu)
+{
+    return !cpu->stage[WB].busy && !cpu->stage[WB].stalled;
+}
+
+/* Register readiness as decode sees it, after this cycle's writeback */
+static int
+reg_ready(APEX_CPU* cpu, int r)
+{
+    int valid = cpu->regs_valid[r];
+    if (wb_commits(cpu) && latch_ins(cpu, &cpu->stage[WB])->rd == r) {
+        valid = (valid == 1) ? 0 : valid - 1;
+    }
+    return valid == 0;
+}
+
+/* Register value as decode sees it, after this cycle's writeback */
+static int
+reg_value(APEX_CPU* cpu, int r)
+{
+    CPU_Stage* wb = latch_ins(cpu, &cpu->stage[WB]);
+    if (wb_commits(cpu) && wb->rd == r && writes_register(wb)) {
+        return wb->buffer;
+    }
+    return cpu->regs[r];
+}
+
+/* Source registers of the instruction in a latch, from cpu->sources;
+ * empty latches and PCs past the end of code memory read none */
+static const int no_sources[2] = { -1, -1 };
+
+static const int*
+stage_sources(APEX_CPU* cpu, CPU_Stage* stage)
+{
+    int index = get_code_index(stage->pc);
+    if (stage->op == OP_NONE || index < 0 ||
+        index >= cpu->code_memory_size) {
+        return no_sources;
+    }
+    return cpu->sources[index].src;
+}
+
+/* True when decode has to wait for a source register */
+static int
+has_data_hazard(APEX_CPU* cpu, CPU_Stage* stage)
+{
+    const int* src = stage_sources(cpu, stage);
+    return (src[0] >= 0 && !reg_ready(cpu, src[0])) ||
+    (src[1] >= 0 && !reg_ready(cpu, src[1]));
+}
+
+/* Input latch of decode this cycle, flushed by a squash or HALT */
+static CPU_Latch*
+decode_input(APEX_CPU* cpu, CPU_Latch* buf)
+{
+    if (cpu->sig.squash || cpu->sig.halt) {
+        *buf = cpu->stage[DRF];
+        make_stage_empty(buf);
+        return buf;
+    }
+    return &cpu->stage[DRF];
+}
+
+/* False for a LOAD/STORE whose address is outside data memory */
+static int
+valid_address(CPU_Stage* stage)
+{
+    return (stage->op != OP_LOAD && stage->op != OP_STORE) ||
+    (stage->mem_address >= 0 && stage->mem_address < APEX_DATA_WORDS);
+}
+
+/*
+ * Data cache access of the LOAD/STORE in MEM. An address outside data
+ * memory is not looked up, memory() stops the run on it. The cache is looked up on
+ * the first cycle the access is in MEM, so that whether MEM holds on to
+ * it is known before any stage runs. Returns 1 while it has to wait.
+ */
+static int
+dcache_stall(APEX_CPU* cpu)
+{
+    CPU_Stage* mem = latch_ins(cpu, &cpu->stage[MEM]);
+    int is_store = mem->op == OP_STORE;
+    
+    if (!cpu->dcache || cpu->stage[MEM].busy || cpu->stage[MEM].stalled ||
+        (!is_store && mem->op != OP_LOAD) || !valid_address(mem)) {
+        return 0;
+    }
+    if (!cpu->dcache_accessed) {
+        cpu->dcache_accessed = 1;
+        cpu->dcache_wait =
+        APEX_cache_access(cpu->dcache, mem->mem_address, is_store) - 1;
+    }
+    if (cpu->dcache_wait > 0) {
+        cpu->dcache_wait--;
+        return 1;
+    }
+    cpu->dcache_accessed = 0;
+    return 0;
+}
+
+/* PC a BZ/BNZ/JUMP that went through execute continues with */
+static int
+resolved_pc(CPU_Stage* stage)
+{
+    if (stage->op == OP_JUMP || stage->branch_taken) {
+        return stage->buffer;
+    }
+    return stage->pc + 4;
+}
+
+/*
+ * Decides, from the current latches only, everything stages need to know
+ * about each other this cycle
+ */
+static void
+resolve_cycle(APEX_CPU* cpu)
+{
+    CPU_Signals* sig = &cpu->sig;
+    CPU_Latch* mem_latch = &cpu->stage[MEM];
+    CPU_Latch* ex_latch = &cpu->stage[EX];
+    CPU_Latch* fe = &cpu->stage[F];
+    CPU_Stage* mem = latch_ins(cpu, mem_latch);
+    CPU_Stage* ex = latch_ins(cpu, ex_latch);
+    CPU_Latch buf;
+    
+    memset(sig, 0, sizeof(*sig));
+    sig->reserve_rd = -1;
+    
+    /* A data cache miss freezes MEM and everything behind it */
+    if (dcache_stall(cpu)) {
+        sig->mem_stall = 1;
+        sig->fetch_pc = cpu->pc;
+        sig->drf_stalled = 1;
+        return;
+    }
+    
+    /* BZ/BNZ and JUMP resolve in memory. Without a predictor fetch went on
+     * with pc + 4, so a taken one flushes DRF and EX and redirects fetch;
+     * with one, a mispredicted one does */
+    if (!mem_latch->busy && !mem_latch->stalled &&
+        (mem->op == OP_JUMP || mem->op == OP_BZ || mem->op == OP_BNZ)) {
+        sig->resolved = 1;
+        sig->resolved_pc = resolved_pc(mem);
+        if (cpu->bpred) {
+            sig->squash = sig->resolved_pc != mem->pred_pc;
+        } else {
+            sig->squash = mem->op == OP_JUMP || mem->branch_taken;
+        }
+    }
+    sig->fetch_pc = sig->squash ? sig->resolved_pc : cpu->pc;
+    
+    /* State of the MUL unit once execute is done with its latch */
+    int ex_mul = !sig->squash && ex->op == OP_MUL && !ex_latch->stalled;
+    int ex_mul_busy = ex_mul && !ex_latch->busy;
+    
+    /* HALT in execute flushes decode and stops fetch for good */
+    if (!sig->squash && ex->op == OP_HALT &&
+        !ex_latch->busy && !ex_latch->stalled && haltFlag) {
+        sig->halt = 1;
+    }
+    
+    /* Decode stalls behind a MUL in its first cycle and on data hazards */
+    CPU_Latch* drf = decode_input(cpu, &buf);
+    int stalled = drf->stalled;
+    if (ex_mul) {
+        stalled = ex_mul_busy;
+    }
+    if (stallFlag) {
+        stalled = 0;
+    }
+    if (!drf->busy && !stalled) {
+        sig->drf_advance = 1;
+        sig->drf_hazard = has_data_hazard(cpu, latch_ins(cpu, drf));
+        stalled = sig->drf_hazard;
+    }
+    sig->drf_stalled = stalled;
+    
+    /* Fetch hands over to decode unless decode holds on to its latch */
+    if (!fe->busy && !fe->stalled && !sig->halt && !sig->drf_stalled) {
+        sig->fetch_advance = 1;
+    }
+}
+
+/*
+ * Applies the shared-state updates of the cycle in pipeline order and
+ * swaps the latch banks
+ */
+static void
+end_cycle(APEX_CPU* cpu)
+{
+    CPU_Signals* sig = &cpu->sig;
+    
+    if (wb_commits(cpu)) {
+        make_reg_valid(cpu, latch_ins(cpu, &cpu->stage[WB]));
+    }
+    if (sig->squash && !cpu->stage[EX].stalled) {
+        /* Of the two flushed latches only EX has claimed its rd, unless
+         * decode stalled it there */
+        make_reg_valid(cpu, latch_ins(cpu, &cpu->stage[EX]));
+    }
+    if (sig->resolved && cpu->bpred) {
+        CPU_Stage* mem = latch_ins(cpu, &cpu->stage[MEM]);
+        APEX_bpred_update(cpu->bpred, mem->op, mem->pc, mem->pred_index,
+                          mem->op == OP_JUMP || mem->branch_taken,
+                          sig->resolved_pc, sig->squash);
+    }
+    if (sig->reserve_rd >= 0) {
+        if (cpu->regs_valid[sig->reserve_rd] >= 1 && cpu->regs_valid[sig->reserve_rd] < 5) {
+            cpu->regs_valid[sig->reserve_rd]++;
+        } else {
+            cpu->regs_valid[sig->reserve_rd] = 1;
+        }
+    }
+    if (sig->store_pending) {
+        write_mem(cpu, sig->store_address, sig->store_value);
+    }
+    
+    if (sig->fetch_advance) {
+        cpu->pc = sig->fetch_next;
+    } else {
+        cpu->pc = sig->fetch_pc;
+    }
+    
+    CPU_Latch* stage = cpu->stage;
+    cpu->stage = cpu->next_stage;
+    cpu->next_stage = stage;
 }
 
 /*
@@ -193,73 +731,55 @@ void make_stage_empty(CPU_Stage *stage) {
 int
 fetch(APEX_CPU* cpu)
 {
-    CPU_Stage* stage = &cpu->stage[F];
-    //    if(stallFlag) {
-    //        stage->stalled = 1;
-    //        if (ENABLE_DEBUG_MESSAGES) {
-    //            print_stage_content("Fetch", stage);
-    //        }
-    //    } else {
-    //        stage->stalled = 0;
-    //    }
-    //
-    //    if(cpu->stage[DRF].stalled == 1) {
-    //        stage->stalled = 1;
-    //    } else {
-    //        stage->stalled = 0;
-    //    }
-    if (!stage->busy && !stage->stalled) {
-        /* Store current PC in fetch latch */
-        stage->pc = cpu->pc;
+    CPU_Latch* latch = &cpu->next_stage[F];
+    *latch = cpu->stage[F];
+    
+    if (cpu->sig.halt) {
+        latch->stalled = 1;
+    }
+    
+    if (!latch->busy && !latch->stalled) {
+        /* Store current PC in a fresh instruction record */
+        latch->ins = free_ins(cpu);
+        CPU_Stage* stage = latch_ins(cpu, latch);
+        memset(stage, 0, sizeof(*stage));
+        stage->pc = cpu->sig.fetch_pc;
         
         /* Index into code memory using this pc and copy all instruction fields into
-         * fetch latch
+         * fetch latch. Past the end of code memory an empty instruction is fetched.
          */
-        APEX_Instruction* current_ins = &cpu->code_memory[get_code_index(cpu->pc)];
-        strcpy(stage->opcode, current_ins->opcode);
+        int index = get_code_index(stage->pc);
+        APEX_Instruction none = { .op = OP_NONE };
+        APEX_Instruction* current_ins = &none;
+        if (index >= 0 && index < cpu->code_memory_size) {
+            current_ins = &cpu->code_memory[index];
+        }
+        stage->op = current_ins->op;
         stage->rd = current_ins->rd;
         stage->rs1 = current_ins->rs1;
         stage->rs2 = current_ins->rs2;
         stage->imm = current_ins->imm;
-        //stage->rd = current_ins->rd;
         
-        /* To check if destination register is valid or not 0:valid, 1: not valid*/
-        //        if (cpu->regs_valid[stage->rd] == 1) {
-        //            cpu->regs_valid[stage->rd]++;
-        //        } else if (stage->rd == stage->rs1 || stage->rd==stage->rs2) {
-        //            cpu->regs_valid[stage->rd] = cpu->regs_valid[stage->rd];
-        //        }
-        //
-        //        else {
-        //            cpu->regs_valid[stage->rd] = 1;
-        //        }
-//        printf("\nopcode: %s\n", stage->opcode);
-        if (cpu->stage[DRF].stalled == 1) {
-            //            printf("\nInside fetch stall cond: %s", stage->opcode);
-            //stage->stalled = 1;
-            if (ENABLE_DEBUG_MESSAGES) {
-                print_stage_content("Fetch", stage);
-            }
-            return 0;
-            //        } else {
-            //            stage->stalled = 0;
+        /* Where fetch goes next */
+        if (cpu->bpred) {
+            stage->pred_pc = APEX_bpred_predict(cpu->bpred, current_ins, stage->pc,
+                                                &stage->pred_index);
+        } else {
+            stage->pred_pc = stage->pc + 4;
         }
+        cpu->sig.fetch_next = stage->pred_pc;
         
-        /* Update PC for next instruction */
-        cpu->pc += 4;
-        
-        /* Copy data from fetch latch to decode latch*/
-        cpu->stage[DRF] = cpu->stage[F];
+        /* Hand the instruction over to decode, unless decode is stalled */
+        if (cpu->sig.fetch_advance) {
+            cpu->next_stage[DRF] = *latch;
+        }
         
         if (ENABLE_DEBUG_MESSAGES) {
             print_stage_content("Fetch", stage);
         }
-        //    } else if (stage->stalled == 1) {
-        //        print_stage_content("Fetch", stage);
     } else {
-        make_stage_empty(stage);
-        print_stage_content("Fetch", stage);
-//        print_empty_stage_fetch("Fetch", cpu->pc);
+        make_stage_empty(latch);
+        print_stage_content("Fetch", latch_ins(cpu, latch));
     }
     return 0;
 }
@@ -273,120 +793,63 @@ fetch(APEX_CPU* cpu)
 int
 decode(APEX_CPU* cpu)
 {
-    CPU_Stage* stage = &cpu->stage[DRF];
-    //printf("drf value: %s", stage->opcode);
-    //    if(stallFlag) {
-    //        stage->stalled = 1;
-    //        if (ENABLE_DEBUG_MESSAGES) {
-    //            print_stage_content("Decode/RF", stage);
-    //        }
-    //    } else {
-    //        stage->stalled = 0;
-    //    }
-    //if (strcmp(stage->opcode, "") != 0) {
-    int validFlag = 0;
-    if (cpu->stage[EX].busy && (strcmp(cpu->stage[EX].opcode, "MUL") == 0)) {
-        stage->stalled = 1;
-    } else if (!cpu->stage[EX].busy && (strcmp(cpu->stage[EX].opcode, "MUL") == 0)) {
-        //        printf("!cpu->stage[EX].busy && (strcmp(cpu->stage[EX].opcode, MUL) == 0");
-        stage->stalled = 0;
-    }
-    if (stallFlag) {
-        stage->stalled = 0;
-        //        printf("\nupdated stage->stalled = 0");
+    CPU_Signals* sig = &cpu->sig;
+    CPU_Latch buf;
+    CPU_Latch* in = decode_input(cpu, &buf);
+    
+    if (sig->mem_stall) {
+        cpu->next_stage[DRF] = cpu->stage[DRF];
+        print_stage_content("Decode/RF", latch_ins(cpu, &cpu->stage[DRF]));
+        return 0;
     }
-    if (!stage->busy && !stage->stalled) {
-        
-        /* Read data from register file for store */
-        if (strcmp(stage->opcode, "STORE") == 0) {
-            if (cpu->regs_valid[stage->rs2]==0 && cpu->regs_valid[stage->rs1]==0) {
-                stage->rs2_value = cpu->regs[stage->rs2];
-                stage->rs1_value = cpu->regs[stage->rs1];
-            } else {
-                validFlag = 1;
-            }
-        }
+    
+    if (sig->drf_advance) {
+        CPU_Latch* latch = &cpu->next_stage[EX];
+        *latch = *in;
+        latch->stalled = sig->drf_hazard;
+        CPU_Stage* stage = latch_ins(cpu, latch);
         
-        /* Read data from register file for load */
-        if (strcmp(stage->opcode, "LOAD") == 0) {
-            if (cpu->regs_valid[stage->rs1] == 0) {
-                stage->rs1_value = cpu->regs[stage->rs1];
-            } else {
-                validFlag = 1;
+        if (!sig->drf_hazard) {
+            /* Read the source registers cpu->sources lists */
+            const int* src = stage_sources(cpu, stage);
+            if (src[0] >= 0) {
+                stage->rs1_value = reg_value(cpu, src[0]);
             }
-        }
-        
-        /* No Register file read needed for MOVC */
-        if (strcmp(stage->opcode, "MOVC") == 0) {
-        }
-        
-        /* ADD, AND, OR, XOR, MUL, SUB */
-        if ((strcmp(stage->opcode, "ADD") == 0) || (strcmp(stage->opcode, "AND") == 0) || (strcmp(stage->opcode, "OR") == 0) || (strcmp(stage->opcode, "XOR") == 0) || (strcmp(stage->opcode, "SUB") == 0) || (strcmp(stage->opcode, "MUL") == 0)) {
-            if (cpu->regs_valid[stage->rs1]==0 && cpu->regs_valid[stage->rs2]==0) {
-                stage->rs2_value = cpu->regs[stage->rs2];
-                stage->rs1_value = cpu->regs[stage->rs1];
-            } else {
-                validFlag = 1;
+            if (src[1] >= 0) {
+                stage->rs2_value = reg_value(cpu, src[1]);
             }
             
-//            printf("\nIndecoding: %d:%d::%d:%d::dest %d:%d\n",stage->rs1, cpu->regs_valid[stage->rs1], stage->rs2, cpu->regs_valid[stage->rs2], stage->rd, cpu->regs_valid[stage->rd]);
-        }
-        
-        if (strcmp(stage->opcode, "JUMP") == 0) {
-            if (cpu->regs_valid[stage->rs1] == 0) {
-                stage->rs1_value = cpu->regs[stage->rs1];
-            } else {
-                validFlag = 1;
+            /* Destination register becomes busy once the bank is swapped */
+            if (stage->rd <= 15 && stage->rd >= 0) {
+                sig->reserve_rd = stage->rd;
             }
         }
         
-        if (strcmp(stage->opcode, "HALT") == 0) {
+        if (stage->op == OP_HALT) {
             haltFlag = 1;
         }
+        stallFlag = sig->drf_hazard;
         
-        if(validFlag) {
-            stage->stalled = 1;
-            stallFlag = 1;
-            //            printf("\nupdated stallFlag = 1");
-            //            if (ENABLE_DEBUG_MESSAGES) {
-            //                print_stage_content("Decode/RF", stage);
-            //            }
-            //            return 0;
-        } else {
-            stallFlag = 0;
-            if (stage->rd <= 15 && stage->rd >= 0) {
-                if (cpu->regs_valid[stage->rd] >= 1 && cpu->regs_valid[stage->rd] < 5) {
-                    cpu->regs_valid[stage->rd]++;
-                    //        } else if (stage->rd == stage->rs1 || stage->rd==stage->rs2) {
-                    //            cpu->regs_valid[stage->rd] = cpu->regs_valid[stage->rd];
-                } else {
-                    cpu->regs_valid[stage->rd] = 1;
-                }
-//                printf("\ninc: %d:%d\n",stage->rd, cpu->regs_valid[stage->rd]);
-            }
-            //            printf("\nupdated stallFlag = 0");
+        /* Decode keeps the instruction too, in case fetch cannot replace it */
+        if (!sig->fetch_advance) {
+            cpu->next_stage[DRF] = *latch;
         }
         
-        /* Copy data from decode latch to execute latch*/
-        //        if(!stage->stalled) {
-        cpu->stage[EX] = cpu->stage[DRF];
-        //        }
-        
-//        printf("\nDecode: cpu->regs_valid[stage->rd]: %d\n",stage->rd);
-        
-        
-        
         if (ENABLE_DEBUG_MESSAGES) {
             print_stage_content("Decode/RF", stage);
         }
-    } else if (stage->stalled == 1) {
-        print_stage_content("Decode/RF", stage);
     } else {
-        make_stage_empty(stage);
-        print_stage_content("Decode/RF", stage);
-//        print_empty_stage_content("Decode/RF");
+        CPU_Latch* latch = &buf;
+        *latch = *in;
+        latch->stalled = sig->drf_stalled;
+        if (!latch->stalled) {
+            make_stage_empty(latch);
+        }
+        if (!sig->fetch_advance) {
+            cpu->next_stage[DRF] = *latch;
+        }
+        print_stage_content("Decode/RF", latch_ins(cpu, latch));
     }
-//}
     return 0;
 }
 
@@ -399,51 +862,55 @@ decode(APEX_CPU* cpu)
 int
 execute(APEX_CPU* cpu)
 {
-    CPU_Stage* stage = &cpu->stage[EX];
-    //    if(stage->stalled) {
-    ////        stage->stalled = 0;
-    //        if (ENABLE_DEBUG_MESSAGES) {
-    //            print_stage_content("Execute", stage);
-    //        }
-    //        cpu->stage[EX] = cpu->stage[EX];
-    //        cpu->stage[MEM] = cpu->stage[EX];
-    //        stage->stalled = 0;
-    //        stallFlag = 1;
-    //        return 0;
-    //    }
-    if ((strcmp(stage->opcode, "MUL") == 0) && stage->busy == 0 && stage->stalled == 0) {
-        //        printf("\nhello\n");
-        stage->busy = 1;
-        cpu->stage[MEM] = cpu->stage[EX];
+    if (cpu->sig.mem_stall) {
+        cpu->next_stage[EX] = cpu->stage[EX];
+        print_stage_content("Execute", latch_ins(cpu, &cpu->stage[EX]));
+        return 0;
+    }
+    
+    CPU_Latch* latch = &cpu->next_stage[MEM];
+    *latch = cpu->stage[EX];
+    
+    /* Flushed by a taken branch in memory */
+    if (cpu->sig.squash) {
+        make_stage_empty(latch);
+    }
+    CPU_Stage* stage = latch_ins(cpu, latch);
+    
+    /* MUL takes two cycles: the first one only marks the unit busy */
+    if (stage->op == OP_MUL && latch->busy == 0 && latch->stalled == 0) {
+        latch->busy = 1;
+        if (!cpu->sig.drf_advance) {
+            cpu->next_stage[EX] = *latch;
+        }
         if (ENABLE_DEBUG_MESSAGES) {
             print_stage_content("Execute", stage);
         }
         return 0;
-    } else if ((strcmp(stage->opcode, "MUL") == 0) && stage->busy == 1) {
-        //        printf("\nworld\n");
-        stage->busy = 0;
+    } else if (stage->op == OP_MUL && latch->busy == 1) {
+        latch->busy = 0;
     }
     
-    
-    if (!stage->busy && !stage->stalled) {
-        //        stallFlag = 0;
+    if (!latch->busy && !latch->stalled) {
+        stage->branch_taken = 0;
+        
         /* Store */
-        if (strcmp(stage->opcode, "STORE") == 0) {
+        if (stage->op == OP_STORE) {
             stage->mem_address = stage->rs2_value + stage->imm;
         }
         
-        /* Store */
-        if (strcmp(stage->opcode, "LOAD") == 0) {
+        /* Load */
+        if (stage->op == OP_LOAD) {
             stage->mem_address = stage->rs1_value + stage->imm;
         }
         
         /* MOVC */
-        if (strcmp(stage->opcode, "MOVC") == 0) {
+        if (stage->op == OP_MOVC) {
             stage->buffer = stage->imm + 0;
         }
         
         /* ADD*/
-        if (strcmp(stage->opcode, "ADD") == 0) {
+        if (stage->op == OP_ADD) {
             stage->buffer = stage->rs1_value + stage->rs2_value;
             if (!stage->buffer) {
                 cpu->bzFlag = 0;
@@ -453,7 +920,7 @@ execute(APEX_CPU* cpu)
         }
         
         /* SUB*/
-        if (strcmp(stage->opcode, "SUB") == 0) {
+        if (stage->op == OP_SUB) {
             stage->buffer = stage->rs1_value - stage->rs2_value;
             if (!stage->buffer) {
                 cpu->bzFlag = 0;
@@ -463,9 +930,8 @@ execute(APEX_CPU* cpu)
         }
         
         /* MUL */
-        if (strcmp(stage->opcode, "MUL") == 0) {
+        if (stage->op == OP_MUL) {
             stage->buffer = stage->rs1_value * stage->rs2_value;
-            //            stage->busy = 1;
             if (!stage->buffer) {
                 cpu->bzFlag = 0;
             } else {
@@ -474,76 +940,89 @@ execute(APEX_CPU* cpu)
         }
         
         /* AND */
-        if (strcmp(stage->opcode, "AND") == 0) {
+        if (stage->op == OP_AND) {
             stage->buffer = stage->rs1_value & stage->rs2_value;
         }
         
         /* OR */
-        if (strcmp(stage->opcode, "OR") == 0) {
+        if (stage->op == OP_OR) {
             stage->buffer = stage->rs1_value | stage->rs2_value;
         }
         
         /* XOR */
-        if (strcmp(stage->opcode, "XOR") == 0) {
+        if (stage->op == OP_XOR) {
             stage->buffer = stage->rs1_value ^ stage->rs2_value;
         }
         
         /* BZ */
-        if (strcmp(stage->opcode, "BZ") == 0) {
-//            stage->buffer = stage->rs1_value ^ stage->rs2_value;
+        if (stage->op == OP_BZ) {
             if (!cpu->bzFlag) {
                 stage->buffer = stage->pc + (stage->imm);
-//                printf("stage->buffer: %d",stage->buffer);
-                bzF = 1;
+                stage->branch_taken = 1;
             } else {
                 stage->buffer = cpu->pc+4;
             }
         }
         
         /* BNZ */
-        if (strcmp(stage->opcode, "BNZ") == 0) {
-            //            stage->buffer = stage->rs1_value ^ stage->rs2_value;
+        if (stage->op == OP_BNZ) {
             if (cpu->bzFlag) {
                 stage->buffer = stage->pc + (stage->imm);
-                //                printf("stage->buffer: %d",stage->buffer);
-                bnzF = 1;
+                stage->branch_taken = 1;
             } else {
                 stage->buffer = cpu->pc+4;
             }
         }
         
-        if (strcmp(stage->opcode, "JUMP") == 0) {
+        if (stage->op == OP_JUMP) {
             stage->buffer = stage->rs1_value + stage->imm;
         }
         
-        if (strcmp(stage->opcode, "HALT") == 0) {
-            if (haltFlag) {
-                make_stage_empty(&cpu->stage[DRF]);
-                cpu->stage[F].stalled = 1;
-            }
-        }
+        /* HALT: flushing decode and stopping fetch is done through cpu->sig.halt */
         
-        /* Copy data from Execute latch to Memory latch*/
-        cpu->stage[MEM] = cpu->stage[EX];
+        if (!cpu->sig.drf_advance) {
+            cpu->next_stage[EX] = *latch;
+        }
         
         if (ENABLE_DEBUG_MESSAGES) {
             print_stage_content("Execute", stage);
         }
     } else {
-        cpu->stage[MEM] = cpu->stage[EX]; //for dependancy
-        
-        make_stage_empty(stage);
-        print_stage_content("Execute", stage);
-//        print_empty_stage_content("Execute");
+        /* The latch still moves on to memory (for dependancy), execute keeps an empty one */
+        if (!cpu->sig.drf_advance) {
+            cpu->next_stage[EX] = *latch;
+            make_stage_empty(&cpu->next_stage[EX]);
+        }
+        print_stage_content("Execute", &empty_stage);
     }
-    //  else if(stage->busy == 0) {
-    //    stage->busy = 1;
-    //    cpu->stage[MEM] = cpu->stage[EX];
-    //  }
     
     return 0;
 }
 
+/* Trace record of a LOAD/STORE or BZ/BNZ/JUMP going through memory */
+void
+APEX_cpu_trace_memory(APEX_CPU* cpu, CPU_Stage* stage)
+{
+    int kind = -1;
+    int value = stage->buffer;
+    
+    if (stage->op == OP_LOAD) {
+        kind = TRACE_LOAD;
+        value = stage->mem_address;
+    } else if (stage->op == OP_STORE) {
+        kind = TRACE_STORE;
+        value = stage->mem_address;
+    } else if (stage->op == OP_BZ || stage->op == OP_BNZ) {
+        kind = stage->branch_taken ? TRACE_BRANCH_TAKEN : TRACE_BRANCH_NOT_TAKEN;
+        value = stage->pc + stage->imm;
+    } else if (stage->op == OP_JUMP) {
+        kind = TRACE_JUMP;
+    }
+    if (kind >= 0) {
+        APEX_trace_write(cpu->trace, kind, cpu->clock, stage->pc, value);
+    }
+}
+
 /*
  *  Memory Stage of APEX Pipeline
  *
@@ -553,93 +1032,83 @@ execute(APEX_CPU* cpu)
 int
 memory(APEX_CPU* cpu)
 {
-    CPU_Stage* stage = &cpu->stage[MEM];
-    //    if(stage->stalled) {
-    //        print_empty_stage_content("Memory");
-    //        strcpy(cpu->stage[WB].opcode, "Stall");
-    //        return 0;
-    //    }
-    if (!stage->busy && !stage->stalled) {
-        
-        /* Store */
-        if (strcmp(stage->opcode, "STORE") == 0) {
-            cpu->data_memory[stage->mem_address] = stage->rs1_value;
-        }
-        
-        /* Load */
-        if (strcmp(stage->opcode, "LOAD") == 0) {
-            stage->buffer = cpu->data_memory[stage->mem_address];
-        }
-        
-        /* MOVC */
-        if (strcmp(stage->opcode, "MOVC") == 0) {
-        }
-        
-        /* ADD: Does't do anything*/
-        if (strcmp(stage->opcode, "ADD") == 0) {
-        }
+    CPU_Latch* latch = &cpu->next_stage[WB];
+    *latch = cpu->stage[MEM];
+    
+    /* Waiting on the data cache: keep the latch, writeback gets a bubble */
+    if (cpu->sig.mem_stall) {
+        cpu->next_stage[MEM] = cpu->stage[MEM];
+        make_stage_empty(latch);
+        latch->stalled = 1;
+        print_stage_content("Memory", latch_ins(cpu, &cpu->stage[MEM]));
+        return 0;
+    }
+    
+    CPU_Stage* stage = latch_ins(cpu, latch);
+    if (!latch->busy && !latch->stalled) {
         
-        /* SUB: Does't do anything*/
-        if (strcmp(stage->opcode, "SUB") == 0) {
+        /* Address outside data memory: stop before it is read or written */
+        if (!valid_address(stage)) {
+            print_stage_content("Memory", stage);
+            printf("APEX_CPU : pc(%d) data memory address %d out of range\n",
+                   stage->pc, stage->mem_address);
+            cpu->exit_status = APEX_EXIT_ERROR;
+            breakCounter = 1;
+            return 0;
         }
         
-        /* MUL: Does't do anything*/
-        if (strcmp(stage->opcode, "MUL") == 0) {
+        /* Store: written to data memory at the end of the cycle */
+        if (stage->op == OP_STORE) {
+            cpu->sig.store_pending = 1;
+            cpu->sig.store_address = stage->mem_address;
+            cpu->sig.store_value = stage->rs1_value;
         }
         
-        if (strcmp(stage->opcode, "BZ") == 0) {
-            if(bzF) {
-//                strcpy(cpu->stage[EX].opcode, "");
-//                strcpy(cpu->stage[DRF].opcode, "");
-//                cpu->stage[EX].pc = 0000;
-//                cpu->stage[DRF].pc = 0000;
-                make_reg_valid(cpu, &cpu->stage[EX]);
-                make_reg_valid(cpu, &cpu->stage[DRF]);
-                make_stage_empty(&cpu->stage[EX]);
-                make_stage_empty(&cpu->stage[DRF]);
-                bzF = 0;
-                cpu->pc = stage->buffer;
-            }
+        /* Load */
+        if (stage->op == OP_LOAD) {
+            stage->buffer = cpu->data_memory[stage->mem_address];
         }
         
-        if (strcmp(stage->opcode, "BNZ") == 0) {
-            if(bnzF) {
-                //                strcpy(cpu->stage[EX].opcode, "");
-                //                strcpy(cpu->stage[DRF].opcode, "");
-                //                cpu->stage[EX].pc = 0000;
-                //                cpu->stage[DRF].pc = 0000;
-                make_reg_valid(cpu, &cpu->stage[EX]);
-                make_reg_valid(cpu, &cpu->stage[DRF]);
-                make_stage_empty(&cpu->stage[EX]);
-                make_stage_empty(&cpu->stage[DRF]);
-                bnzF = 0;
-                cpu->pc = stage->buffer;
-            }
-        }
+        /* Taken BZ/BNZ and JUMP squash DRF and EX, see resolve_cycle() */
         
-        if (strcmp(stage->opcode, "JUMP") == 0) {
-            make_reg_valid(cpu, &cpu->stage[EX]);
-            make_reg_valid(cpu, &cpu->stage[DRF]);
-            make_stage_empty(&cpu->stage[EX]);
-            make_stage_empty(&cpu->stage[DRF]);
-            cpu->pc = stage->buffer;
+        if (cpu->trace) {
+            APEX_cpu_trace_memory(cpu, stage);
         }
         
-        /* Copy data from decode latch to execute latch*/
-        cpu->stage[WB] = cpu->stage[MEM];
-        
         if (ENABLE_DEBUG_MESSAGES) {
             print_stage_content("Memory", stage);\
         }
     } else {
-        cpu->stage[WB] = cpu->stage[MEM];
-        make_stage_empty(stage);
-        print_stage_content("Memory", stage);
-//        print_empty_stage_content("Memory");
+        print_stage_content("Memory", &empty_stage);
     }
     return 0;
 }
 
+/*
+ * Commits the instruction leaving writeback, at every pipeline width:
+ * writes its result, counts it, moves commit_pc past it and runs the
+ * co-simulation and PC breakpoint checks. A STORE has written data memory
+ * before it gets here. Returns 1 if it was HALT or the last instruction.
+ */
+int
+APEX_cpu_commit(APEX_CPU* cpu, CPU_Stage* stage)
+{
+    if (writes_register(stage)) {
+        write_reg(cpu, stage->rd, stage->buffer);
+    }
+    cpu->ins_completed++;
+    if (stage->op != OP_NONE) {
+        int index = get_code_index(stage->pc);
+        if (index > cpu->commit_max) {
+            cpu->commit_max = index;
+        }
+        cpu->commit_pc = resolved_pc(stage);
+        APEX_cpu_commit_check(cpu, stage);
+    }
+    return stage->op == OP_HALT ||
+           stage->pc == (((cpu->code_memory_size-1) * 4)+4000);
+}
+
 /*
  *  Writeback Stage of APEX Pipeline
  *
@@ -649,71 +1118,156 @@ memory(APEX_CPU* cpu)
 int
 writeback(APEX_CPU* cpu)
 {
-    CPU_Stage* stage = &cpu->stage[WB];
-    //    printf("\nstalling: %d: %d: %d\n",cpu->stage[MEM].stalled, stage->stalled, stallFlag);
-    //    if(strcmp(cpu->stage[WB].opcode, "Stall") == 0) {
-    //        print_empty_stage_content("Writeback");
-    //        return 0;
-    //    }
-    //    printf("\nwriteback1 %d: %d\n",stage->busy, stage->stalled);
-    if (!stage->busy && !stage->stalled) {
-        //        printf("\nwriteback2\n");
+    CPU_Latch* latch = &cpu->stage[WB];
+    if (!latch->busy && !latch->stalled) {
+        CPU_Stage* stage = latch_ins(cpu, latch);
         
-        /* Update register file */
-        if (strcmp(stage->opcode, "MOVC") == 0) {
-            cpu->regs[stage->rd] = stage->buffer;
-            //        printf("\nin write: %d: %d",cpu->regs[stage->rd],stage->buffer);
-        }
-        
-        /* Update register file */
-        if (strcmp(stage->opcode, "LOAD") == 0) {
-            cpu->regs[stage->rd] = stage->buffer;
-        }
-        
-        /* ADD */
-        if (strcmp(stage->opcode, "ADD") == 0) {
-            cpu->regs[stage->rd] = stage->buffer;
+        if (ENABLE_DEBUG_MESSAGES) {
+            print_stage_content("Writeback", stage);
         }
         
-        /* SUB */
-        if (strcmp(stage->opcode, "SUB") == 0) {
-            cpu->regs[stage->rd] = stage->buffer;
+        /* rd is released in end_cycle() */
+        if (APEX_cpu_commit(cpu, stage)) {
+            breakCounter = 1;
         }
         
-        /* MUL */
-        if (strcmp(stage->opcode, "MUL") == 0) {
-            cpu->regs[stage->rd] = stage->buffer;
+    } else {
+        print_stage_content("Writeback", &empty_stage);
+    }
+    return 0;
+}
+
+static unsigned long long
+fingerprint_mix(unsigned long long h, int value)
+{
+    return (h ^ (unsigned int)value) * 0x100000001b3ULL;
+}
+
+/*
+ * Fingerprint of everything that decides the next cycle: PC, flags, the
+ * register file and its valid counters, every pipeline latch and (through
+ * state_hash) every data memory word that was ever written. Two cycles
+ * with the same fingerprint are in the same state, so the program loops.
+ */
+static unsigned long long
+state_fingerprint(void* engine)
+{
+    APEX_CPU* cpu = engine;
+    unsigned long long h = 0xcbf29ce484222325ULL ^ cpu->state_hash;
+    h = fingerprint_mix(h, cpu->pc);
+    h = fingerprint_mix(h, cpu->bzFlag);
+    h = fingerprint_mix(h, stallFlag);
+    h = fingerprint_mix(h, haltFlag);
+    h = fingerprint_mix(h, cpu->dcache_accessed);
+    h = fingerprint_mix(h, cpu->dcache_wait);
+    for (int i = 0; i < 16; ++i) {
+        h = fingerprint_mix(h, cpu->regs[i]);
+        /* A negative valid counter behaves the same whatever its value:
+         * it never reads as ready and the next decode resets it to 1 */
+        h = fingerprint_mix(h, cpu->regs_valid[i] < 0 ? -1 : cpu->regs_valid[i]);
+    }
+    for (int i = 0; i < NUM_STAGES; ++i) {
+        CPU_Stage* stage = latch_ins(cpu, &cpu->stage[i]);
+        h = fingerprint_mix(h, stage->pc);
+        h = fingerprint_mix(h, stage->op);
+        h = fingerprint_mix(h, stage->rd);
+        h = fingerprint_mix(h, stage->rs1);
+        h = fingerprint_mix(h, stage->rs2);
+        h = fingerprint_mix(h, stage->imm);
+        h = fingerprint_mix(h, stage->rs1_value);
+        h = fingerprint_mix(h, stage->rs2_value);
+        h = fingerprint_mix(h, stage->buffer);
+        h = fingerprint_mix(h, stage->mem_address);
+        h = fingerprint_mix(h, cpu->stage[i].busy);
+        h = fingerprint_mix(h, cpu->stage[i].stalled);
+        h = fingerprint_mix(h, stage->branch_taken);
+        h = fingerprint_mix(h, stage->pred_pc);
+    }
+    return h;
+}
+
+/* Marks the PCs of all occupied pipeline latches as part of the loop */
+static void
+collect_loop_pcs(void* engine)
+{
+    APEX_CPU* cpu = engine;
+    for (int i = 0; i < NUM_STAGES; ++i) {
+        CPU_Stage* stage = latch_ins(cpu, &cpu->stage[i]);
+        if (stage->op != OP_NONE) {
+            APEX_cpu_loop_pc(cpu, stage->pc);
         }
-        
-        if (strcmp(stage->opcode, "HALT") == 0) {
-            breakCounter = 1;
+    }
+}
+
+/* While the PCs of a loop are collected, marks pc as one of them */
+void
+APEX_cpu_loop_pc(APEX_CPU* cpu, int pc)
+{
+    int index = get_code_index(pc);
+    if (cpu->loop_pcs && index >= 0 && index < cpu->code_memory_size) {
+        cpu->loop_pcs[index] = 1;
+    }
+}
+
+/* The livelock check's fingerprint table, allocated on first use */
+CPU_Loop_Sample*
+APEX_cpu_loop_table(APEX_CPU* cpu)
+{
+    if (!cpu->loop_table) {
+        cpu->loop_table = malloc(sizeof(CPU_Loop_Sample) * LOOP_TABLE_SIZE);
+        for (int i = 0; cpu->loop_table && i < LOOP_TABLE_SIZE; ++i) {
+            cpu->loop_table[i].clock = -1;
         }
-        
-//        if (cpu->regs_valid[stage->rd] == 1) {
-//            cpu->regs_valid[stage->rd] = 0;
-//            //        } else if (stage->rd == stage->rs1 || stage->rd==stage->rs2) {
-//            //            cpu->regs_valid[stage->rd] = cpu->regs_valid[stage->rd];
-//        } else {
-//            cpu->regs_valid[stage->rd]--;
-//        }
-        
-        make_reg_valid(cpu, stage);
-        
-        //        printf("\n updated cpu->regs_valid[%d]: %d", stage->rd, cpu->regs_valid[stage->rd]);
-        cpu->ins_completed++;
-        //        printf("\nins_complete: %d\n", cpu->ins_completed);
-        
-        if (ENABLE_DEBUG_MESSAGES) {
-            print_stage_content("Writeback", stage);\
+    }
+    return cpu->loop_table;
+}
+
+/*
+ * Livelock check of every engine, at the end of each cycle. Every
+ * loop_check_period cycles the state fingerprint is looked up in
+ * loop_table; once a state repeats, one more trip around the loop is run
+ * with in_flight marking the PCs it passes through, then the loop is
+ * reported. Returns 1 when the run has to stop.
+ */
+int
+APEX_cpu_loop_check(APEX_CPU* cpu, APEX_Fingerprint_Fn fingerprint,
+                    APEX_In_Flight_Fn in_flight, void* engine)
+{
+    if (cpu->loop_period) {
+        in_flight(engine);
+        if (cpu->clock < cpu->loop_end) {
+            return 0;
         }
-        if (stage->pc == (((cpu->code_memory_size-1) * 4)+4000)) {
-            breakCounter = 1;
+        printf("APEX_CPU : Livelock at clock %d, state repeats within %d "
+               "cycles, loop PCs:", cpu->clock, cpu->loop_period);
+        for (int i = 0; cpu->loop_pcs && i < cpu->code_memory_size; ++i) {
+            if (cpu->loop_pcs[i]) {
+                printf(" %d", 4000 + i * 4);
+            }
         }
-    } else {
-        make_stage_empty(stage);
-        print_stage_content("Writeback", stage);
-//        print_empty_stage_content("Writeback");
+        printf("\n");
+        cpu->exit_status = APEX_EXIT_LIVELOCK;
+        return 1;
+    }
+    if (cpu->loop_check_period <= 0 || cpu->clock % cpu->loop_check_period != 0) {
+        return 0;
+    }
+    CPU_Loop_Sample* table = APEX_cpu_loop_table(cpu);
+    if (!table) {
+        return 0;
     }
+    
+    unsigned long long fp = fingerprint(engine);
+    CPU_Loop_Sample* sample = &table[fp & (LOOP_TABLE_SIZE - 1)];
+    if (sample->clock >= 0 && sample->fingerprint == fp) {
+        cpu->loop_period = cpu->clock - sample->clock;
+        cpu->loop_end = cpu->clock + cpu->loop_period;
+        cpu->loop_pcs = calloc(cpu->code_memory_size, 1);
+        return 0;
+    }
+    sample->fingerprint = fp;
+    sample->clock = cpu->clock;
+    sample->depends = cpu->ckpt ? APEX_cpu_depends_on(cpu) : -1;
     return 0;
 }
 
@@ -736,8 +1290,13 @@ APEX_cpu_run(APEX_CPU* cpu)
     //    stageE->rd = current_ins->rd;
     //    stageE->pc =
     int count = 0;
+    
     while (1) {
         
+        if (cpu->ckpt && cpu->clock >= cpu->ckpt->next && !cpu->loop_period) {
+            APEX_ckpt_take(cpu);
+        }
+        
         /* All the instructions committed, so exit */
 //        if (cpu->ins_completed == cpu->code_memory_size) {
 //            printf("(apex) >> Simulation Complete\n");
@@ -749,20 +1308,44 @@ APEX_cpu_run(APEX_CPU* cpu)
             printf("Clock Cycle #: %d\n", cpu->clock);
             printf("--------------------------------\n");
         }
-        //        printf("F: %d\n",DRF);
+        /* Stages only read the current latch bank, any order works; this
+         * one keeps the debug trace in pipeline order */
+        resolve_cycle(cpu);
+        if (cpu->breaks && cpu->breaks->stall_watch) {
+            APEX_break_stall(cpu);
+        }
         writeback(cpu);
         memory(cpu);
         execute(cpu);
         decode(cpu);
         fetch(cpu);
+        end_cycle(cpu);
         
-        if (cpu->stage[WB].pc == (((cpu->code_memory_size-1) * 4)+4000)) {
-            printf("\nwb.pc: %d\n", cpu->stage[WB].pc);
+        if (latch_ins(cpu, &cpu->stage[WB])->pc == (((cpu->code_memory_size-1) * 4)+4000)) {
+            printf("\nwb.pc: %d\n", latch_ins(cpu, &cpu->stage[WB])->pc);
             count++;
         }
         if(breakCounter==1){
             break;
         }
+        if (cpu->breaks) {
+            if (cpu->clock == cpu->breaks->next_cycle) {
+                APEX_break_cycle(cpu);
+            }
+            if (cpu->breaks->hit) {
+                break;
+            }
+        }
+        
+        if (APEX_cpu_loop_check(cpu, state_fingerprint, collect_loop_pcs, cpu)) {
+            break;
+        }
+        if (cpu->max_cycles && cpu->clock + 1 >= cpu->max_cycles) {
+            printf("APEX_CPU : Cycle limit %d reached at pc(%d)\n",
+                   cpu->max_cycles, cpu->pc);
+            cpu->exit_status = APEX_EXIT_CYCLE_LIMIT;
+            break;
+        }
 //        printf("\n in main: %d\n",(((cpu->code_memory_size-1) * 4)+4000));
         
         //      fetch(cpu);
@@ -773,5 +1356,5 @@ APEX_cpu_run(APEX_CPU* cpu)
         cpu->clock++;
     }
     
-    return 0;
+    return cpu->exit_status;
 }
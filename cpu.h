@@ -19,10 +19,34 @@ enum
     NUM_STAGES
 };
 
+/* Decoded opcode, filled in by the parser alongside the opcode string.
+ * OP_NONE is never parsed: it marks a latch or group slot with nothing in
+ * it, or a fetch past the end of code memory */
+enum
+{
+    OP_MOVC,
+    OP_STORE,
+    OP_LOAD,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_BZ,
+    OP_BNZ,
+    OP_JUMP,
+    OP_HALT,
+    OP_UNKNOWN,
+    OP_NONE,
+    NUM_OPCODES
+};
+
 /* Format of an APEX instruction  */
 typedef struct APEX_Instruction
 {
     char opcode[128];	// Operation Code
+    int op;		    // Decoded Operation Code (OP_*)
     int rd;		    // Destination Register Address
     int rs1;		    // Source-1 Register Address
     int rs2;		    // Source-2 Register Address
@@ -30,11 +54,12 @@ typedef struct APEX_Instruction
     //int mulFlag;      //flag to see if MUL instruction was in execution or not
 } APEX_Instruction;
 
-/* Model of CPU stage latch */
+/* An instruction in flight: its fields from code memory and the values
+ * the stages work out for it */
 typedef struct CPU_Stage
 {
     int pc;		    // Program Counter
-    char opcode[128];	// Operation Code
+    int op;		    // Decoded Operation Code (OP_*)
     int rs1;		    // Source-1 Register Address
     int rs2;		    // Source-2 Register Address
     int rd;		    // Destination Register Address
@@ -43,12 +68,60 @@ typedef struct CPU_Stage
     int rs2_value;	// Source-2 Register Value
     int buffer;		// Latch to hold some value
     int mem_address;	// Computed Memory Address
-    int busy;		    // Flag to indicate, stage is performing some action
-    int stalled;		// Flag to indicate, stage is stalled
+    int branch_taken;	// Set in EX when a BZ/BNZ is taken
+    int pred_pc;	    // PC fetch went on with after this instruction
+    int pred_index;	    // Predictor counter pred_pc came from (bpred.h)
     
     //int mulFlag;      //flag to see if MUL instruction was in execution or not
 } CPU_Stage;
 
+/* Instruction records of the 5-stage pipeline. Both latch banks together
+ * hold at most 2 * NUM_STAGES of them; record 0 is the empty one */
+#define CPU_INS_POOL 16
+
+/* Model of CPU stage latch: the record of the instruction it holds, which
+ * moves on to the next latch by index, and the state of the stage */
+typedef struct CPU_Latch
+{
+    int ins;		    // Index into APEX_CPU.ins, 0 when empty
+    int busy;		    // Flag to indicate, stage is performing some action
+    int stalled;	    // Flag to indicate, stage is stalled
+} CPU_Latch;
+
+/*
+ * What the stages need to know about each other within one cycle. Worked
+ * out from the current latch bank before any stage runs, plus the updates
+ * to shared state that are applied when the banks are swapped.
+ */
+typedef struct CPU_Signals
+{
+    int squash;		    // Taken (or mispredicted) BZ/BNZ or JUMP in MEM flushes DRF and EX
+    int resolved;	    // BZ/BNZ or JUMP in MEM this cycle
+    int resolved_pc;	    // PC it actually continues with
+    int halt;		    // HALT in EX flushes DRF and stops fetch
+    int fetch_pc;	    // PC fetched this cycle
+    int fetch_next;	    // PC fetch goes on with, set by fetch
+    int fetch_advance;	    // Fetch latch moves into DRF
+    int drf_advance;	    // DRF latch moves into EX
+    int drf_hazard;	    // DRF waits on a source register
+    int drf_stalled;	    // DRF latch is stalled at the end of the cycle
+    int reserve_rd;	    // Destination claimed by decode, -1 if none
+    int store_pending;	    // Data memory write from MEM
+    int store_address;
+    int store_value;
+    int mem_stall;	    // MEM holds a LOAD/STORE waiting on the data cache
+} CPU_Signals;
+
+/* Number of fingerprints remembered by the loop check, power of 2 */
+#define LOOP_TABLE_SIZE 4096
+
+typedef struct CPU_Loop_Sample
+{
+    unsigned long long fingerprint;
+    int clock;
+    int depends;	// APEX_cpu_depends_on() when sampled, for checkpoints
+} CPU_Loop_Sample;
+
 /* Model of APEX CPU */
 typedef struct APEX_CPU
 {
@@ -58,19 +131,51 @@ typedef struct APEX_CPU
     /* Current program counter */
     int pc;
     
+    /* PC the instruction after the last one committed is at */
+    int commit_pc;
+    
     /* Integer register file */
     int regs[16];
     int regs_valid[16];
     
-    /* Array of 5 CPU_stage */
-    CPU_Stage stage[5];
+    /* Two banks of 5 latches: stages read stage[] (the current bank) and
+     * write next_stage[]; the pointers swap every cycle. The instructions
+     * they hold are in ins[] */
+    CPU_Stage ins[CPU_INS_POOL];
+    CPU_Latch latch[2][NUM_STAGES];
+    CPU_Latch* stage;
+    CPU_Latch* next_stage;
+    CPU_Signals sig;
     
     /* Code Memory where instructions are stored */
     APEX_Instruction* code_memory;
     int code_memory_size;
     
-    /* Data Memory */
-    int data_memory[4096];
+    /* Per code index, the registers decode reads (analysis.h) */
+    struct APEX_Sources* sources;
+    
+    /* Data Memory, 4096 words mapped by APEX_image_map (image.h) */
+    int* data_memory;
+    
+    /* Optional L1 data cache timing model (cache.h), NULL when off. The
+     * LOAD/STORE in MEM has dcache_wait more cycles to go once accessed */
+    struct APEX_Cache* dcache;
+    int dcache_accessed;
+    int dcache_wait;
+    
+    /* Memory access and branch trace being written (trace.h), else NULL */
+    struct APEX_Trace* trace;
+    
+    /* Fetch stage branch predictor (bpred.h), NULL to always fetch pc + 4 */
+    struct APEX_BPred* bpred;
+    
+    /* Breakpoint and watchpoint table (break.h), NULL when there are none */
+    struct APEX_Breaks* breaks;
+    
+    /* Checkpoints being taken (checkpoint.h), NULL when off. commit_max is
+     * the highest code index committed so far, -1 before the first commit */
+    struct APEX_Checkpoints* ckpt;
+    int commit_max;
     
     /* Some stats */
     int ins_completed;
@@ -78,11 +183,91 @@ typedef struct APEX_CPU
     int bzFlag;
     int bnzFlag;
     
+    /* Incremental hash of registers and data memory, see apex_hash_slot */
+    unsigned long long state_hash;
+    
+    /* Run limits: stop after max_cycles (0 = no limit); sample a state
+     * fingerprint every loop_check_period cycles (0 = off) to catch a
+     * program that is stuck in a loop */
+    int max_cycles;
+    int loop_check_period;
+    CPU_Loop_Sample* loop_table;  // [LOOP_TABLE_SIZE], NULL until the first sample
+    int loop_period;	// Length of the loop found, 0 until then
+    int loop_end;	// Clock at which collecting its PCs ends
+    char* loop_pcs;	// Per code index, set while collecting loop PCs
+    int exit_status;	// APEX_EXIT_*
+    
+    /* Functional reference run in lockstep when co-simulating, else NULL */
+    struct APEX_Func* ref;
+    int cosim_mismatch;
+    
 } APEX_CPU;
 
+/*
+ * Everything the 5-stage pipeline carries from one cycle into the next
+ * apart from data memory, for checkpoints (checkpoint.h)
+ */
+typedef struct CPU_Snapshot
+{
+    int clock;
+    int pc;
+    int commit_pc;
+    int regs[16];
+    int regs_valid[16];
+    CPU_Stage ins[CPU_INS_POOL];
+    CPU_Latch latch[2][NUM_STAGES];
+    int bank;		    // Index of the current latch bank
+    CPU_Signals sig;
+    int ins_completed;
+    int bzFlag;
+    int bnzFlag;
+    int stallFlag;
+    int breakCounter;
+    int haltFlag;
+    int commit_max;
+    unsigned long long state_hash;
+} CPU_Snapshot;
+
+/* How a simulation ended; also the exit status of apex_sim */
+enum
+{
+    APEX_EXIT_OK = 0,
+    APEX_EXIT_ERROR = 1,
+    APEX_EXIT_COSIM_MISMATCH = 2,
+    APEX_EXIT_CYCLE_LIMIT = 3,
+    APEX_EXIT_LIVELOCK = 4,
+    APEX_EXIT_GOLDEN_MISMATCH = 5,
+    APEX_EXIT_BREAK = 6
+};
+
+/*
+ * Contribution of one architectural slot (register r is slot r, data
+ * memory word a is slot 16 + a) to the state hash. The hash is the XOR of
+ * the contributions of all slots, so a write updates it in O(1):
+ *     hash ^= apex_hash_slot(slot, old) ^ apex_hash_slot(slot, new)
+ * Zero contributes nothing, which makes the hash of the reset state 0.
+ */
+static inline unsigned long long
+apex_hash_slot(int slot, int value)
+{
+    if (!value) {
+        return 0;
+    }
+    unsigned long long x = ((unsigned long long)slot << 32) | (unsigned int)value;
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+#define APEX_HASH_MEM_SLOT(addr) (16 + (addr))
+
 APEX_Instruction*
 create_code_memory(const char* filename, int* size);
 
+const char*
+get_opcode_name(int op);
+
 APEX_CPU*
 APEX_cpu_init(const char* filename);
 
@@ -92,6 +277,58 @@ APEX_cpu_run(APEX_CPU* cpu);
 void
 APEX_cpu_stop(APEX_CPU* cpu);
 
+int
+APEX_cpu_load_images(APEX_CPU* cpu, const char* data_file, const char* reg_file);
+
+int
+get_code_index(int pc);
+
+/*
+ * Hash of the state an engine's next cycle depends on, and a function
+ * passing each PC the engine has in flight to APEX_cpu_loop_pc(), for
+ * APEX_cpu_loop_check()
+ */
+typedef unsigned long long (*APEX_Fingerprint_Fn)(void* engine);
+typedef void (*APEX_In_Flight_Fn)(void* engine);
+
+/* Shared with the superscalar and out-of-order models (wide.h, ooo.h) */
+void
+APEX_cpu_write_reg(APEX_CPU* cpu, int rd, int value);
+
+void
+APEX_cpu_write_mem(APEX_CPU* cpu, int address, int value);
+
+void
+APEX_cpu_commit_check(APEX_CPU* cpu, CPU_Stage* stage);
+
+int
+APEX_cpu_commit(APEX_CPU* cpu, CPU_Stage* stage);
+
+void
+APEX_cpu_trace_memory(APEX_CPU* cpu, CPU_Stage* stage);
+
+int
+APEX_cpu_loop_check(APEX_CPU* cpu, APEX_Fingerprint_Fn fingerprint,
+                    APEX_In_Flight_Fn in_flight, void* engine);
+
+void
+APEX_cpu_loop_pc(APEX_CPU* cpu, int pc);
+
+void
+APEX_cpu_print_stage(const char* name, CPU_Stage* stage);
+
+void
+APEX_cpu_snapshot(APEX_CPU* cpu, CPU_Snapshot* snap);
+
+void
+APEX_cpu_restore(APEX_CPU* cpu, const CPU_Snapshot* snap);
+
+int
+APEX_cpu_depends_on(APEX_CPU* cpu);
+
+CPU_Loop_Sample*
+APEX_cpu_loop_table(APEX_CPU* cpu);
+
 int
 fetch(APEX_CPU* cpu);
 
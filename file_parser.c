@@ -31,6 +31,36 @@ get_num_from_string(char* buffer)
     return atoi(str);
 }
 
+static const char* opcode_names[OP_UNKNOWN] = {
+    "MOVC", "STORE", "LOAD", "ADD", "SUB", "MUL", "AND",
+    "OR", "XOR", "BZ", "BNZ", "JUMP", "HALT"
+};
+
+/*
+ * Maps an opcode string onto its OP_* id. Matching is exact, so an
+ * instruction the pipeline does not know is OP_UNKNOWN.
+ */
+static int
+get_opcode_id(const char* opcode)
+{
+    for (int i = 0; i < OP_UNKNOWN; ++i) {
+        if (strcmp(opcode, opcode_names[i]) == 0) {
+            return i;
+        }
+    }
+    return OP_UNKNOWN;
+}
+
+/* Mnemonic of an OP_* id, empty for OP_UNKNOWN and OP_NONE */
+const char*
+get_opcode_name(int op)
+{
+    if (op < 0 || op >= OP_UNKNOWN) {
+        return "";
+    }
+    return opcode_names[op];
+}
+
 /*
  * This function is related to parsing input file
  *
@@ -48,7 +78,10 @@ create_APEX_instruction(APEX_Instruction* ins, char* buffer)
         token = strtok(NULL, ",");
     }
     
+    /* Operands an instruction does not use read as R0 / #0 */
+    memset(ins, 0, sizeof(*ins));
     strcpy(ins->opcode, tokens[0]);
+    ins->op = get_opcode_id(ins->opcode);
     
     if (strcmp(ins->opcode, "MOVC") == 0) {
         ins->rd = get_num_from_string(tokens[1]);
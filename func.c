@@ -0,0 +1,501 @@
+/*
+ *  func.c
+ *  Functional reference model of APEX: executes one instruction per step
+ *  straight from code memory, with the same architectural semantics as the
+ *  pipeline in cpu.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "func.h"
+#include "image.h"
+
+APEX_Func*
+APEX_func_init(APEX_Instruction* code_memory, int code_memory_size)
+{
+    APEX_Func* func = malloc(sizeof(*func));
+    if (!func) {
+        return NULL;
+    }
+
+    memset(func, 0, sizeof(*func));
+    func->data_memory = APEX_image_map(NULL, APEX_DATA_WORDS);
+    if (!func->data_memory) {
+        free(func);
+        return NULL;
+    }
+    func->pc = 4000;
+    func->status = FUNC_RUNNING;
+    func->code_memory = code_memory;
+    func->code_memory_size = code_memory_size;
+    return func;
+}
+
+/* Translated blocks are defined further down */
+static void
+free_tcache(APEX_Func* func);
+
+void
+APEX_func_stop(APEX_Func* func)
+{
+    free_tcache(func);
+    APEX_image_unmap(func->data_memory, APEX_DATA_WORDS);
+    free(func);
+}
+
+/*
+ * Preloads data memory and/or the registers from binary images, see
+ * image.h. Returns 0, or -1 if an image cannot be loaded.
+ */
+int
+APEX_func_load_images(APEX_Func* func, const char* data_file, const char* reg_file)
+{
+    return APEX_image_load(data_file, reg_file, &func->data_memory, func->regs,
+                           &func->state_hash);
+}
+
+static void
+func_write_reg(APEX_Func* func, int rd, int value)
+{
+    func->state_hash ^=
+    apex_hash_slot(rd, func->regs[rd]) ^ apex_hash_slot(rd, value);
+    func->regs[rd] = value;
+}
+
+static int
+func_check_address(APEX_Func* func, int pc, int address)
+{
+    if (address < 0 || address >= 4096) {
+        fprintf(stderr,
+                "APEX_Func : pc(%d) data memory address %d out of range\n",
+                pc, address);
+        func->status = FUNC_FAULT;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Executes the instruction at the current PC.
+ * Returns the PC of the executed instruction, or -1 once the model has
+ * stopped (see func->status).
+ */
+int
+APEX_func_step(APEX_Func* func)
+{
+    if (func->status != FUNC_RUNNING) {
+        return -1;
+    }
+
+    int index = (func->pc - 4000) / 4;
+    if (func->pc < 4000 || index >= func->code_memory_size) {
+        func->status = FUNC_END;
+        return -1;
+    }
+
+    APEX_Instruction* ins = &func->code_memory[index];
+    int pc = func->pc;
+    int next_pc = pc + 4;
+    int address;
+
+    switch (ins->op) {
+        case OP_MOVC:
+            func_write_reg(func, ins->rd, ins->imm);
+            break;
+
+        case OP_STORE:
+            address = func->regs[ins->rs2] + ins->imm;
+            if (!func_check_address(func, pc, address)) {
+                return -1;
+            }
+            func->state_hash ^=
+            apex_hash_slot(APEX_HASH_MEM_SLOT(address),
+                           func->data_memory[address]) ^
+            apex_hash_slot(APEX_HASH_MEM_SLOT(address), func->regs[ins->rs1]);
+            func->data_memory[address] = func->regs[ins->rs1];
+            break;
+
+        case OP_LOAD:
+            address = func->regs[ins->rs1] + ins->imm;
+            if (!func_check_address(func, pc, address)) {
+                return -1;
+            }
+            func_write_reg(func, ins->rd, func->data_memory[address]);
+            break;
+
+        case OP_ADD:
+            func_write_reg(func, ins->rd,
+                           func->regs[ins->rs1] + func->regs[ins->rs2]);
+            func->zero_flag = (func->regs[ins->rd] == 0);
+            break;
+
+        case OP_SUB:
+            func_write_reg(func, ins->rd,
+                           func->regs[ins->rs1] - func->regs[ins->rs2]);
+            func->zero_flag = (func->regs[ins->rd] == 0);
+            break;
+
+        case OP_MUL:
+            func_write_reg(func, ins->rd,
+                           func->regs[ins->rs1] * func->regs[ins->rs2]);
+            func->zero_flag = (func->regs[ins->rd] == 0);
+            break;
+
+        /* AND/OR/XOR write the register file but leave the zero flag */
+        case OP_AND:
+            func_write_reg(func, ins->rd,
+                           func->regs[ins->rs1] & func->regs[ins->rs2]);
+            break;
+
+        case OP_OR:
+            func_write_reg(func, ins->rd,
+                           func->regs[ins->rs1] | func->regs[ins->rs2]);
+            break;
+
+        case OP_XOR:
+            func_write_reg(func, ins->rd,
+                           func->regs[ins->rs1] ^ func->regs[ins->rs2]);
+            break;
+
+        case OP_BZ:
+            if (func->zero_flag) {
+                next_pc = pc + ins->imm;
+            }
+            break;
+
+        case OP_BNZ:
+            if (!func->zero_flag) {
+                next_pc = pc + ins->imm;
+            }
+            break;
+
+        case OP_JUMP:
+            next_pc = func->regs[ins->rs1] + ins->imm;
+            break;
+
+        case OP_HALT:
+            func->status = FUNC_HALTED;
+            break;
+
+        default:
+            /* Unrecognised opcodes retire without effect, as in the pipeline */
+            break;
+    }
+
+    func->pc = next_pc;
+    func->ins_completed++;
+    return pc;
+}
+
+/*
+ * Basic-block translation
+ *
+ * APEX_func_run translates each basic block the first time it is entered:
+ * the straight-line instructions up to (and including) the first BZ, BNZ,
+ * JUMP or HALT become an array of specialised handlers with their register
+ * operands resolved to pointers into the register file. Blocks are cached
+ * by the code index they start at, and the BZ/BNZ successors of a block are
+ * chained to it once resolved, so a hot loop runs without touching
+ * code_memory or the cache again.
+ */
+
+typedef struct Func_Op
+{
+    int (*handler)(APEX_Func* func, struct Func_Op* op);
+    int* rd;
+    int* rs1;
+    int* rs2;
+    int rd_index;
+    int imm;
+    int pc;
+} Func_Op;
+
+typedef struct Func_Block
+{
+    int pc;		    // PC of the first instruction
+    int body_size;	    // Straight-line ops in ops[]
+    Func_Op* ops;
+    int exit_op;	    // OP_BZ, OP_BNZ, OP_JUMP, OP_HALT or -1 at end of code
+    int exit_pc;	    // PC of the exit instruction (or end of code)
+    int* exit_rs1;	    // JUMP base register
+    int exit_imm;
+    struct Func_Block* taken;	// Chained BZ/BNZ taken successor
+    struct Func_Block* fall;	// Chained BZ/BNZ fall-through successor
+} Func_Block;
+
+/* Handlers return non-zero to stop the block (data memory fault) */
+static int
+op_movc(APEX_Func* func, Func_Op* op)
+{
+    func_write_reg(func, op->rd_index, op->imm);
+    return 0;
+}
+
+static int
+op_add(APEX_Func* func, Func_Op* op)
+{
+    func_write_reg(func, op->rd_index, *op->rs1 + *op->rs2);
+    func->zero_flag = (*op->rd == 0);
+    return 0;
+}
+
+static int
+op_sub(APEX_Func* func, Func_Op* op)
+{
+    func_write_reg(func, op->rd_index, *op->rs1 - *op->rs2);
+    func->zero_flag = (*op->rd == 0);
+    return 0;
+}
+
+static int
+op_mul(APEX_Func* func, Func_Op* op)
+{
+    func_write_reg(func, op->rd_index, *op->rs1 * *op->rs2);
+    func->zero_flag = (*op->rd == 0);
+    return 0;
+}
+
+static int
+op_and(APEX_Func* func, Func_Op* op)
+{
+    func_write_reg(func, op->rd_index, *op->rs1 & *op->rs2);
+    return 0;
+}
+
+static int
+op_or(APEX_Func* func, Func_Op* op)
+{
+    func_write_reg(func, op->rd_index, *op->rs1 | *op->rs2);
+    return 0;
+}
+
+static int
+op_xor(APEX_Func* func, Func_Op* op)
+{
+    func_write_reg(func, op->rd_index, *op->rs1 ^ *op->rs2);
+    return 0;
+}
+
+static int
+op_load(APEX_Func* func, Func_Op* op)
+{
+    int address = *op->rs1 + op->imm;
+    if (!func_check_address(func, op->pc, address)) {
+        return 1;
+    }
+    func_write_reg(func, op->rd_index, func->data_memory[address]);
+    return 0;
+}
+
+static int
+op_store(APEX_Func* func, Func_Op* op)
+{
+    int address = *op->rs2 + op->imm;
+    if (!func_check_address(func, op->pc, address)) {
+        return 1;
+    }
+    func->state_hash ^=
+    apex_hash_slot(APEX_HASH_MEM_SLOT(address), func->data_memory[address]) ^
+    apex_hash_slot(APEX_HASH_MEM_SLOT(address), *op->rs1);
+    func->data_memory[address] = *op->rs1;
+    return 0;
+}
+
+static int
+op_nop(APEX_Func* func, Func_Op* op)
+{
+    return 0;
+}
+
+static Func_Block*
+translate_block(APEX_Func* func, int index)
+{
+    int end = index;
+    while (end < func->code_memory_size) {
+        int op = func->code_memory[end].op;
+        if (op == OP_BZ || op == OP_BNZ || op == OP_JUMP || op == OP_HALT) {
+            break;
+        }
+        end++;
+    }
+
+    Func_Block* block = malloc(sizeof(*block));
+    if (!block) {
+        return NULL;
+    }
+    block->pc = 4000 + index * 4;
+    block->body_size = end - index;
+    block->ops = malloc(sizeof(Func_Op) * (block->body_size ? block->body_size : 1));
+    if (!block->ops) {
+        free(block);
+        return NULL;
+    }
+    block->taken = NULL;
+    block->fall = NULL;
+
+    for (int i = 0; i < block->body_size; ++i) {
+        APEX_Instruction* ins = &func->code_memory[index + i];
+        Func_Op* op = &block->ops[i];
+        op->rd = &func->regs[ins->rd];
+        op->rs1 = &func->regs[ins->rs1];
+        op->rs2 = &func->regs[ins->rs2];
+        op->rd_index = ins->rd;
+        op->imm = ins->imm;
+        op->pc = block->pc + i * 4;
+
+        switch (ins->op) {
+            case OP_MOVC:  op->handler = op_movc; break;
+            case OP_ADD:   op->handler = op_add; break;
+            case OP_SUB:   op->handler = op_sub; break;
+            case OP_MUL:   op->handler = op_mul; break;
+            case OP_AND:   op->handler = op_and; break;
+            case OP_OR:    op->handler = op_or; break;
+            case OP_XOR:   op->handler = op_xor; break;
+            case OP_LOAD:  op->handler = op_load; break;
+            case OP_STORE: op->handler = op_store; break;
+            default:       op->handler = op_nop; break;
+        }
+    }
+
+    block->exit_pc = 4000 + end * 4;
+    if (end < func->code_memory_size) {
+        APEX_Instruction* ins = &func->code_memory[end];
+        block->exit_op = ins->op;
+        block->exit_rs1 = &func->regs[ins->rs1];
+        block->exit_imm = ins->imm;
+    } else {
+        block->exit_op = -1;
+        block->exit_rs1 = NULL;
+        block->exit_imm = 0;
+    }
+    return block;
+}
+
+/*
+ * Returns the translated block starting at pc, translating it on first use.
+ * NULL when pc is outside code memory (or not word aligned, which is left
+ * to APEX_func_step).
+ */
+static Func_Block*
+lookup_block(APEX_Func* func, int pc)
+{
+    int index = (pc - 4000) / 4;
+    if (pc < 4000 || index >= func->code_memory_size || (pc - 4000) % 4) {
+        return NULL;
+    }
+    if (!func->tcache[index]) {
+        func->tcache[index] = translate_block(func, index);
+    }
+    return func->tcache[index];
+}
+
+static void
+free_tcache(APEX_Func* func)
+{
+    if (!func->tcache) {
+        return;
+    }
+    for (int i = 0; i < func->code_memory_size; ++i) {
+        if (func->tcache[i]) {
+            free(func->tcache[i]->ops);
+            free(func->tcache[i]);
+        }
+    }
+    free(func->tcache);
+    func->tcache = NULL;
+}
+
+/*
+ * Runs the functional model until it halts, runs off the end of code
+ * memory or faults, one translated block at a time. The result is the same
+ * as calling APEX_func_step until it returns -1.
+ */
+void
+APEX_func_run(APEX_Func* func)
+{
+    if (!func->tcache) {
+        func->tcache = calloc(func->code_memory_size, sizeof(Func_Block*));
+        if (!func->tcache) {
+            while (APEX_func_step(func) >= 0) {
+            }
+            return;
+        }
+    }
+
+    while (func->status == FUNC_RUNNING) {
+        Func_Block* block = lookup_block(func, func->pc);
+        if (!block) {
+            /* Unaligned PC or end of code memory */
+            if (APEX_func_step(func) < 0) {
+                return;
+            }
+            continue;
+        }
+
+        while (block) {
+            for (int i = 0; i < block->body_size; ++i) {
+                if (block->ops[i].handler(func, &block->ops[i])) {
+                    func->pc = block->pc + i * 4;
+                    func->ins_completed += i;
+                    return;
+                }
+            }
+            func->ins_completed += block->body_size;
+
+            Func_Block* next = NULL;
+            switch (block->exit_op) {
+                case OP_BZ:
+                case OP_BNZ:
+                    func->ins_completed++;
+                    if (func->zero_flag == (block->exit_op == OP_BZ)) {
+                        func->pc = block->exit_pc + block->exit_imm;
+                        if (!block->taken) {
+                            block->taken = lookup_block(func, func->pc);
+                        }
+                        next = block->taken;
+                    } else {
+                        func->pc = block->exit_pc + 4;
+                        if (!block->fall) {
+                            block->fall = lookup_block(func, func->pc);
+                        }
+                        next = block->fall;
+                    }
+                    break;
+
+                case OP_JUMP:
+                    func->ins_completed++;
+                    func->pc = *block->exit_rs1 + block->exit_imm;
+                    next = lookup_block(func, func->pc);
+                    break;
+
+                case OP_HALT:
+                    func->ins_completed++;
+                    func->pc = block->exit_pc + 4;
+                    func->status = FUNC_HALTED;
+                    return;
+
+                default:
+                    func->pc = block->exit_pc;
+                    func->status = FUNC_END;
+                    return;
+            }
+            block = next;
+        }
+    }
+}
+
+void
+APEX_func_print(APEX_Func* func)
+{
+    static const char* status_names[] = { "running", "halted", "end", "fault" };
+
+    printf("APEX_Func : %s pc(%d) ins(%d) hash(%016llx)\n",
+           status_names[func->status], func->pc, func->ins_completed,
+           func->state_hash);
+    for (int r = 0; r < 16; ++r) {
+        printf("R%d=%d ", r, func->regs[r]);
+    }
+    printf("\n");
+}
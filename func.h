@@ -0,0 +1,56 @@
+#ifndef _APEX_FUNC_H_
+#define _APEX_FUNC_H_
+/**
+ *  func.h
+ *  Functional (instruction-at-a-time) reference model of APEX. It has no
+ *  pipeline timing and defines the architectural result every timing model
+ *  has to agree with.
+ */
+#include "cpu.h"
+
+enum
+{
+    FUNC_RUNNING,
+    FUNC_HALTED,      // HALT executed
+    FUNC_END,         // PC ran past the end of code memory
+    FUNC_FAULT,       // Data memory access out of range
+    FUNC_LIMIT        // Step limit reached (--lanes with --max-cycles)
+};
+
+/* Architectural state of the functional model */
+typedef struct APEX_Func
+{
+    int pc;
+    int regs[16];
+    int zero_flag;	// 1 when the last ADD/SUB/MUL produced zero
+    int* data_memory;	// 4096 words mapped by APEX_image_map (image.h)
+    int status;		// FUNC_*
+    int ins_completed;
+    unsigned long long state_hash;	// Same scheme as APEX_CPU.state_hash
+
+    APEX_Instruction* code_memory;
+    int code_memory_size;
+
+    /* Translation cache: translated block starting at each code index */
+    struct Func_Block** tcache;
+} APEX_Func;
+
+APEX_Func*
+APEX_func_init(APEX_Instruction* code_memory, int code_memory_size);
+
+int
+APEX_func_load_images(APEX_Func* func, const char* data_file, const char* reg_file);
+
+int
+APEX_func_step(APEX_Func* func);
+
+void
+APEX_func_run(APEX_Func* func);
+
+void
+APEX_func_print(APEX_Func* func);
+
+void
+APEX_func_stop(APEX_Func* func);
+
+#endif
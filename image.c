@@ -0,0 +1,146 @@
+/*
+ *  image.c
+ *  Data memory and register images, see image.h
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "image.h"
+
+/*
+ * Maps words zero words, with filename (if not NULL) mapped copy on write
+ * over the start of them. Returns NULL if the file cannot be mapped or is
+ * larger than the words.
+ */
+int*
+APEX_image_map(const char* filename, int words)
+{
+    size_t length = sizeof(int) * words;
+    int* image = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (image == MAP_FAILED) {
+        return NULL;
+    }
+    if (!filename) {
+        return image;
+    }
+
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "APEX_Image : Unable to open %s\n", filename);
+        goto fail;
+    }
+    if ((size_t)st.st_size > length) {
+        fprintf(stderr, "APEX_Image : %s has %lld bytes, more than %d words\n",
+                filename, (long long)st.st_size, words);
+        goto fail;
+    }
+    /* Whole pages of the file; the tail of its last page reads as zero and
+     * the pages past it stay anonymous */
+    if (st.st_size > 0 &&
+        mmap(image, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+             fd, 0) == MAP_FAILED) {
+        fprintf(stderr, "APEX_Image : Unable to map %s\n", filename);
+        goto fail;
+    }
+    close(fd);
+    return image;
+
+fail:
+    if (fd >= 0) {
+        close(fd);
+    }
+    munmap(image, length);
+    return NULL;
+}
+
+void
+APEX_image_unmap(int* image, int words)
+{
+    if (image) {
+        munmap(image, sizeof(int) * words);
+    }
+}
+
+/*
+ * Replaces *data_memory with a mapping of data_file and reads reg_file
+ * into regs (either may be NULL), adding what they hold to the state hash.
+ * Returns 0, or -1 leaving everything as it was.
+ */
+int
+APEX_image_load(const char* data_file, const char* reg_file, int** data_memory,
+                int* regs, unsigned long long* state_hash)
+{
+    int* data = NULL;
+    int* reg_image = NULL;
+
+    if (data_file && !(data = APEX_image_map(data_file, APEX_DATA_WORDS))) {
+        return -1;
+    }
+    if (reg_file && !(reg_image = APEX_image_map(reg_file, 16))) {
+        APEX_image_unmap(data, APEX_DATA_WORDS);
+        return -1;
+    }
+
+    if (data) {
+        for (int i = 0; i < APEX_DATA_WORDS; ++i) {
+            *state_hash ^= apex_hash_slot(APEX_HASH_MEM_SLOT(i), (*data_memory)[i]) ^
+                           apex_hash_slot(APEX_HASH_MEM_SLOT(i), data[i]);
+        }
+        APEX_image_unmap(*data_memory, APEX_DATA_WORDS);
+        *data_memory = data;
+    }
+    if (reg_image) {
+        for (int r = 0; r < 16; ++r) {
+            *state_hash ^= apex_hash_slot(r, regs[r]) ^ apex_hash_slot(r, reg_image[r]);
+            regs[r] = reg_image[r];
+        }
+        APEX_image_unmap(reg_image, 16);
+    }
+    return 0;
+}
+
+/*
+ * Writes words of image to filename, through a shared mapping of a
+ * temporary file that is then renamed over filename. filename may be the
+ * image data memory was mapped from: that mapping keeps the old file, and
+ * truncating it in place would zero the data being written. Returns 0, or
+ * -1 if the file cannot be written.
+ */
+int
+APEX_image_write(const char* filename, const int* image, int words)
+{
+    size_t length = sizeof(int) * words;
+    char tmp[PATH_MAX + 16];
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", filename, (int)getpid());
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, length) != 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    void* out = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (out == MAP_FAILED) {
+        unlink(tmp);
+        return -1;
+    }
+    memcpy(out, image, length);
+    if (munmap(out, length) != 0 || rename(tmp, filename) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
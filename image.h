@@ -0,0 +1,31 @@
+#ifndef _APEX_IMAGE_H_
+#define _APEX_IMAGE_H_
+/**
+ *  image.h
+ *  Binary images of data memory and the register file: raw 32-bit words
+ *  in host byte order, word i at byte 4 * i. A file shorter than the
+ *  memory it fills leaves the rest zero.
+ *
+ *  Data memory is itself an mmap()ed region. Loading an image maps the
+ *  file over it privately, so the simulator reads the file's pages in
+ *  place and only the pages it stores to are copied (copy on write);
+ *  the file is never modified.
+ */
+
+/* Words of data memory */
+#define APEX_DATA_WORDS 4096
+
+int*
+APEX_image_map(const char* filename, int words);
+
+void
+APEX_image_unmap(int* image, int words);
+
+int
+APEX_image_load(const char* data_file, const char* reg_file, int** data_memory,
+                int* regs, unsigned long long* state_hash);
+
+int
+APEX_image_write(const char* filename, const int* image, int words);
+
+#endif
@@ -7,24 +7,597 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "analysis.h"
+#include "batch.h"
+#include "bpred.h"
+#include "break.h"
+#include "cache.h"
+#include "checkpoint.h"
 #include "cpu.h"
+#include "func.h"
+#include "image.h"
+#include "ooo.h"
+#include "perf.h"
+#include "queue.h"
+#include "state.h"
+#include "trace.h"
+#include "wide.h"
+
+/* Cycles between two livelock fingerprints unless --loop-check says so */
+#define DEFAULT_LOOP_CHECK_PERIOD 64
+
+/* Predictor counters unless --bpred gives a size */
+#define DEFAULT_BPRED_SIZE 256
+
+/* Data cache hit and miss latency unless --dcache-latency says so */
+#define DEFAULT_DCACHE_HIT_LATENCY 1
+#define DEFAULT_DCACHE_MISS_LATENCY 10
+
+/* Out-of-order ROB, issue queue and load/store queue entries unless
+ * --ooo-size says so */
+#define DEFAULT_OOO_ROB 32
+#define DEFAULT_OOO_IQ 16
+#define DEFAULT_OOO_LSQ 16
+
+static void
+print_usage(const char* prog)
+{
+    fprintf(stderr, "APEX_Help : Usage %s <input_file> [options]\n", prog);
+    fprintf(stderr, "APEX_Help :        %s --coordinator <dir> <job_list> "
+            "<workers>\n", prog);
+    fprintf(stderr, "APEX_Help :        %s --queue-init <dir> <job_list> "
+            "<shards>\n", prog);
+    fprintf(stderr, "APEX_Help :        %s --worker <dir> <shard>\n", prog);
+    fprintf(stderr, "APEX_Help :        %s --merge <dir> [<report>]\n", prog);
+    fprintf(stderr, "APEX_Help : Options:\n");
+    fprintf(stderr,
+            "APEX_Help :   --perf    sample host wall-clock time and hardware "
+            "counters per simulation phase\n");
+    fprintf(stderr,
+            "APEX_Help :   --cosim   check every commit against the "
+            "functional reference model\n");
+    fprintf(stderr,
+            "APEX_Help :   --max-cycles <n>  stop the pipeline after n cycles, "
+            "or a --lanes lane after n instructions (exit status 3)\n");
+    fprintf(stderr,
+            "APEX_Help :   --loop-check <n>  fingerprint the pipeline state every "
+            "n cycles to detect livelock (exit status 4), 0 disables, "
+            "default %d\n", DEFAULT_LOOP_CHECK_PERIOD);
+    fprintf(stderr,
+            "APEX_Help :   --functional  run the functional model only "
+            "(translated basic blocks, no pipeline timing)\n");
+    fprintf(stderr,
+            "APEX_Help :   --lanes <seed_file>  run the program functionally "
+            "once per seed line, all lanes in parallel\n");
+    fprintf(stderr,
+            "APEX_Help :   --no-simd  use the scalar batch engine even if "
+            "the host has AVX2\n");
+    fprintf(stderr,
+            "APEX_Help :   --dcache <size>,<ways>,<line>[,lru|fifo|random][,wb|wt]"
+            "  model an L1 data cache (bytes)\n");
+    fprintf(stderr,
+            "APEX_Help :   --dcache-latency <hit>,<miss>  cycles in MEM, "
+            "default %d,%d\n", DEFAULT_DCACHE_HIT_LATENCY,
+            DEFAULT_DCACHE_MISS_LATENCY);
+    fprintf(stderr,
+            "APEX_Help :   --bpred <not-taken|btfn|bimodal|gshare>[,<size>]  "
+            "predict branches in fetch, default %d counters\n",
+            DEFAULT_BPRED_SIZE);
+    fprintf(stderr,
+            "APEX_Help :   --trace <file>  write LOAD/STORE addresses and "
+            "branch outcomes to a compact trace file\n");
+    fprintf(stderr,
+            "APEX_Help :   --analyze  print the static hazard analysis and "
+            "a lower bound on the cycle count, without simulating\n");
+    fprintf(stderr,
+            "APEX_Help :   --width <w>  fetch, decode, execute and commit up "
+            "to w instructions per cycle (1-%d), default 1\n", APEX_MAX_WIDTH);
+    fprintf(stderr,
+            "APEX_Help :   --ooo     run the out-of-order model instead of "
+            "the 5-stage pipeline, --width wide\n");
+    fprintf(stderr,
+            "APEX_Help :   --ooo-size <rob>,<iq>,<lsq>  out-of-order structure "
+            "entries, default %d,%d,%d\n", DEFAULT_OOO_ROB, DEFAULT_OOO_IQ,
+            DEFAULT_OOO_LSQ);
+    fprintf(stderr,
+            "APEX_Help :   --data-image <file>  preload data memory from a "
+            "binary image (32-bit words, mapped copy-on-write)\n");
+    fprintf(stderr,
+            "APEX_Help :   --reg-image <file>  preload R0-R15 from a binary "
+            "image\n");
+    fprintf(stderr,
+            "APEX_Help :   --data-out <file>  write the final data memory as a "
+            "binary image\n");
+    fprintf(stderr,
+            "APEX_Help :   --state-out <file>  write pc, cycles, registers and "
+            "non-zero data memory as a binary dump\n");
+    fprintf(stderr,
+            "APEX_Help :   --state-json <file>  the same as JSON\n");
+    fprintf(stderr,
+            "APEX_Help :   --golden <file>  compare the final state with a "
+            "binary dump, report the first mismatch (exit status 5)\n");
+    fprintf(stderr,
+            "APEX_Help :   --break <spec>  stop at pc=<pc>, cycle=<n>, "
+            "R<r>[=<v>], mem[<a>][=<v>] or stall:<decode|hazard|dcache>><n> "
+            "(exit status 6), repeatable\n");
+    fprintf(stderr,
+            "APEX_Help :   --checkpoint <dir>  checkpoint the 5-stage pipeline "
+            "into dir and resume an edited program from the latest checkpoint "
+            "before its first change\n");
+    fprintf(stderr,
+            "APEX_Help :   --checkpoint-every <n>  cycles between checkpoints, "
+            "default %d\n", DEFAULT_CKPT_PERIOD);
+}
+
+/*
+ * Analysis mode: only the load time hazard analysis is run and printed
+ */
+static int
+run_analysis(const char* filename)
+{
+    int code_memory_size = 0;
+    APEX_Instruction* code_memory = create_code_memory(filename, &code_memory_size);
+    if (!code_memory) {
+        fprintf(stderr, "APEX_Error : Unable to load %s\n", filename);
+        return 1;
+    }
+
+    APEX_Static_Info* info = APEX_analyze(code_memory, code_memory_size);
+    if (!info) {
+        fprintf(stderr, "APEX_Error : Unable to analyze %s\n", filename);
+        exit(1);
+    }
+    APEX_analysis_print(info, code_memory, code_memory_size);
+
+    free(info);
+    free(code_memory);
+    return 0;
+}
+
+/* Files the state at the end of a run goes to, NULL for none */
+typedef struct Run_Outputs
+{
+    const char* data_out;	// --data-out
+    const char* state_out;	// --state-out
+    const char* state_json;	// --state-json
+    const char* golden;		// --golden
+} Run_Outputs;
+
+/*
+ * Writes the final state where asked and compares it with the golden
+ * dump. Returns an APEX_EXIT_* status, APEX_EXIT_OK if all went well.
+ */
+static int
+write_outputs(const Run_Outputs* out, int pc, int cycles, const int* regs,
+              const int* data_memory)
+{
+    int ret = APEX_EXIT_OK;
+
+    if (out->data_out &&
+        APEX_image_write(out->data_out, data_memory, APEX_DATA_WORDS) != 0) {
+        fprintf(stderr, "APEX_Error : Unable to write %s\n", out->data_out);
+        ret = APEX_EXIT_ERROR;
+    }
+    if (!out->state_out && !out->state_json && !out->golden) {
+        return ret;
+    }
+
+    APEX_State* state = malloc(sizeof(*state));
+    APEX_State* golden = out->golden ? malloc(sizeof(*golden)) : NULL;
+    if (!state || (out->golden && !golden)) {
+        free(state);
+        free(golden);
+        return APEX_EXIT_ERROR;
+    }
+    APEX_state_capture(state, pc, cycles, regs, data_memory);
+
+    if (out->state_out && APEX_state_write(state, out->state_out) != 0) {
+        fprintf(stderr, "APEX_Error : Unable to write %s\n", out->state_out);
+        ret = APEX_EXIT_ERROR;
+    }
+    if (out->state_json && APEX_state_write_json(state, out->state_json) != 0) {
+        fprintf(stderr, "APEX_Error : Unable to write %s\n", out->state_json);
+        ret = APEX_EXIT_ERROR;
+    }
+    if (golden) {
+        if (APEX_state_read(golden, out->golden) != 0) {
+            fprintf(stderr, "APEX_Error : %s is not a readable state dump\n",
+                    out->golden);
+            ret = APEX_EXIT_ERROR;
+        } else if (APEX_state_compare(golden, state) != 0) {
+            if (ret == APEX_EXIT_OK) {
+                ret = APEX_EXIT_GOLDEN_MISMATCH;
+            }
+        } else {
+            printf("APEX_State : Final state matches %s\n", out->golden);
+        }
+    }
+
+    free(state);
+    free(golden);
+    return ret;
+}
+
+/*
+ * Functional mode: no pipeline, the program runs on the translated
+ * functional model
+ */
+static int
+run_functional(const char* filename, const char* data_image,
+               const char* reg_image, const Run_Outputs* out)
+{
+    int code_memory_size = 0;
+    APEX_perf_phase(PERF_PHASE_PARSE);
+    APEX_Instruction* code_memory = create_code_memory(filename, &code_memory_size);
+    if (!code_memory) {
+        fprintf(stderr, "APEX_Error : Unable to load %s\n", filename);
+        return 1;
+    }
+
+    APEX_perf_phase(PERF_PHASE_INIT);
+    APEX_Func* func = APEX_func_init(code_memory, code_memory_size);
+    if (!func) {
+        fprintf(stderr, "APEX_Error : Unable to initialize functional model\n");
+        exit(1);
+    }
+    if (APEX_func_load_images(func, data_image, reg_image) != 0) {
+        fprintf(stderr, "APEX_Error : Unable to load memory images\n");
+        exit(1);
+    }
+
+    APEX_perf_phase(PERF_PHASE_RUN);
+    APEX_func_run(func);
+    APEX_func_print(func);
+
+    /* No timing, the dump has 0 cycles */
+    int ret = write_outputs(out, func->pc, 0, func->regs, func->data_memory);
+
+    APEX_perf_phase(PERF_PHASE_TEARDOWN);
+    APEX_func_stop(func);
+    free(code_memory);
+    APEX_perf_phase(PERF_PHASE_NONE);
+    return ret;
+}
+
+/*
+ * Batch mode: no pipeline, the program is run by the lane-parallel
+ * functional engine once per line of the seed file
+ */
+static int
+run_batch(const char* filename, const char* seed_file, int no_simd,
+          int max_cycles)
+{
+    int lanes = APEX_batch_count_lanes(seed_file);
+    if (!lanes) {
+        fprintf(stderr, "APEX_Error : No lanes in seed file %s\n", seed_file);
+        return 1;
+    }
+
+    int code_memory_size = 0;
+    APEX_perf_phase(PERF_PHASE_PARSE);
+    APEX_Instruction* code_memory = create_code_memory(filename, &code_memory_size);
+    if (!code_memory) {
+        fprintf(stderr, "APEX_Error : Unable to load %s\n", filename);
+        return 1;
+    }
+
+    APEX_perf_phase(PERF_PHASE_INIT);
+    APEX_Batch* batch = APEX_batch_init(code_memory, code_memory_size, lanes);
+    if (!batch || APEX_batch_load_seeds(batch, seed_file) != 0) {
+        fprintf(stderr, "APEX_Error : Unable to initialize %d lanes\n", lanes);
+        exit(1);
+    }
+    if (no_simd) {
+        batch->use_avx2 = 0;
+    }
+    batch->max_steps = max_cycles;
+
+    APEX_perf_phase(PERF_PHASE_RUN);
+    int limited = APEX_batch_run(batch);
+    APEX_batch_print(batch);
+    if (limited) {
+        printf("APEX_Batch : %d of %d lanes stopped after %d instructions\n",
+               limited, lanes, max_cycles);
+    }
+
+    APEX_perf_phase(PERF_PHASE_TEARDOWN);
+    APEX_batch_stop(batch);
+    free(code_memory);
+    APEX_perf_phase(PERF_PHASE_NONE);
+    return limited ? APEX_EXIT_CYCLE_LIMIT : APEX_EXIT_OK;
+}
+
+/*
+ * Queue mode: argv[1] is --coordinator, --queue-init, --worker or --merge
+ * and the job queue in argv[2] is worked on instead of running a program.
+ * Returns -1 if argv[1] is none of them.
+ */
+static int
+run_queue(int argc, char const* argv[])
+{
+    /* Jobs are run by this binary */
+    const char* exe = access("/proc/self/exe", X_OK) == 0 ? "/proc/self/exe"
+                                                          : argv[0];
+
+    if (strcmp(argv[1], "--coordinator") == 0 && argc == 5) {
+        return APEX_queue_coordinate(argv[2], argv[3], atoi(argv[4]), exe);
+    }
+    if (strcmp(argv[1], "--queue-init") == 0 && argc == 5) {
+        return APEX_queue_init(argv[2], argv[3], atoi(argv[4]));
+    }
+    if (strcmp(argv[1], "--worker") == 0 && argc == 4) {
+        return APEX_queue_work(argv[2], atoi(argv[3]), exe);
+    }
+    if (strcmp(argv[1], "--merge") == 0 && (argc == 3 || argc == 4)) {
+        return APEX_queue_merge(argv[2], argc == 4 ? argv[3] : NULL);
+    }
+    if (strcmp(argv[1], "--coordinator") == 0 ||
+        strcmp(argv[1], "--queue-init") == 0 ||
+        strcmp(argv[1], "--worker") == 0 || strcmp(argv[1], "--merge") == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    return -1;
+}
 
 int
 main(int argc, char const* argv[])
 {
-    if (argc != 2) {
-        fprintf(stderr, "APEX_Help : Usage %s <input_file>\n", argv[0]);
+    if (argc < 2) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    int queue_ret = run_queue(argc, argv);
+    if (queue_ret >= 0) {
+        return queue_ret;
+    }
+
+    int perf = 0;
+    int cosim = 0;
+    int no_simd = 0;
+    int functional = 0;
+    int analyze = 0;
+    int max_cycles = 0;
+    int width = 1;
+    int ooo = 0;
+    int ooo_rob = DEFAULT_OOO_ROB;
+    int ooo_iq = DEFAULT_OOO_IQ;
+    int ooo_lsq = DEFAULT_OOO_LSQ;
+    int loop_check_period = DEFAULT_LOOP_CHECK_PERIOD;
+    const char* seed_file = NULL;
+    const char* dcache = NULL;
+    const char* trace_file = NULL;
+    const char* data_image = NULL;
+    const char* reg_image = NULL;
+    Run_Outputs out = { NULL, NULL, NULL, NULL };
+    const char* ckpt_dir = NULL;
+    int ckpt_period = DEFAULT_CKPT_PERIOD;
+    const char* break_specs[BREAK_MAX_CHECKS + 1];
+    int num_breaks = 0;
+    char bpred[32] = "";
+    int bpred_size = DEFAULT_BPRED_SIZE;
+    int dcache_hit = DEFAULT_DCACHE_HIT_LATENCY;
+    int dcache_miss = DEFAULT_DCACHE_MISS_LATENCY;
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--perf") == 0) {
+            perf = 1;
+        } else if (strcmp(argv[i], "--cosim") == 0) {
+            cosim = 1;
+        } else if (strcmp(argv[i], "--max-cycles") == 0 && i + 1 < argc) {
+            max_cycles = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--loop-check") == 0 && i + 1 < argc) {
+            loop_check_period = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--functional") == 0) {
+            functional = 1;
+        } else if (strcmp(argv[i], "--lanes") == 0 && i + 1 < argc) {
+            seed_file = argv[++i];
+        } else if (strcmp(argv[i], "--no-simd") == 0) {
+            no_simd = 1;
+        } else if (strcmp(argv[i], "--analyze") == 0) {
+            analyze = 1;
+        } else if (strcmp(argv[i], "--dcache") == 0 && i + 1 < argc) {
+            dcache = argv[++i];
+        } else if (strcmp(argv[i], "--dcache-latency") == 0 && i + 1 < argc &&
+                   sscanf(argv[i + 1], "%d,%d", &dcache_hit, &dcache_miss) == 2) {
+            i++;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else if (strcmp(argv[i], "--bpred") == 0 && i + 1 < argc &&
+                   sscanf(argv[i + 1], "%31[^,],%d", bpred, &bpred_size) >= 1) {
+            i++;
+        } else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+            width = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--data-image") == 0 && i + 1 < argc) {
+            data_image = argv[++i];
+        } else if (strcmp(argv[i], "--reg-image") == 0 && i + 1 < argc) {
+            reg_image = argv[++i];
+        } else if (strcmp(argv[i], "--data-out") == 0 && i + 1 < argc) {
+            out.data_out = argv[++i];
+        } else if (strcmp(argv[i], "--state-out") == 0 && i + 1 < argc) {
+            out.state_out = argv[++i];
+        } else if (strcmp(argv[i], "--state-json") == 0 && i + 1 < argc) {
+            out.state_json = argv[++i];
+        } else if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc) {
+            out.golden = argv[++i];
+        } else if (strcmp(argv[i], "--break") == 0 && i + 1 < argc &&
+                   num_breaks <= BREAK_MAX_CHECKS) {
+            break_specs[num_breaks++] = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            ckpt_dir = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+            ckpt_period = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ooo") == 0) {
+            ooo = 1;
+        } else if (strcmp(argv[i], "--ooo-size") == 0 && i + 1 < argc &&
+                   sscanf(argv[i + 1], "%d,%d,%d", &ooo_rob, &ooo_iq, &ooo_lsq) == 3) {
+            i++;
+        } else {
+            fprintf(stderr, "APEX_Error : Unknown option %s\n", argv[i]);
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (width < 1 || width > APEX_MAX_WIDTH) {
+        fprintf(stderr, "APEX_Error : Width must be 1 to %d\n", APEX_MAX_WIDTH);
+        exit(1);
+    }
+    if (ooo && (dcache || trace_file)) {
+        fprintf(stderr, "APEX_Error : --dcache and --trace need the 5-stage "
+                "pipeline\n");
+        exit(1);
+    }
+
+    if (ckpt_dir && (ooo || width > 1 || seed_file || functional || cosim ||
+                     dcache || bpred[0] || trace_file)) {
+        fprintf(stderr, "APEX_Error : --checkpoint needs the plain 5-stage "
+                "pipeline, without --cosim, --dcache, --bpred or --trace\n");
+        exit(1);
+    }
+
+    if (analyze) {
+        return run_analysis(argv[1]);
+    }
+
+    if (perf) {
+        APEX_perf_init();
+    }
+
+    if ((seed_file || functional) && num_breaks) {
+        fprintf(stderr, "APEX_Error : --break needs a timing model\n");
+        exit(1);
+    }
+    if (seed_file && (data_image || reg_image || out.data_out || out.state_out ||
+                      out.state_json || out.golden)) {
+        fprintf(stderr, "APEX_Error : Memory images and state dumps do not "
+                "apply to --lanes\n");
         exit(1);
     }
-    
+
+    if (seed_file || functional) {
+        int ret = seed_file ? run_batch(argv[1], seed_file, no_simd, max_cycles)
+                            : run_functional(argv[1], data_image, reg_image,
+                                             &out);
+        APEX_perf_report(0);
+        APEX_perf_close();
+        return ret;
+    }
+
+    APEX_perf_phase(PERF_PHASE_INIT);
     APEX_CPU* cpu = APEX_cpu_init(argv[1]);
     if (!cpu) {
         fprintf(stderr, "APEX_Error : Unable to initialize CPU\n");
         exit(1);
     }
-    
-    APEX_cpu_run(cpu);
+
+    if (APEX_cpu_load_images(cpu, data_image, reg_image) != 0) {
+        fprintf(stderr, "APEX_Error : Unable to load memory images\n");
+        exit(1);
+    }
+
+    if (cosim) {
+        cpu->ref = APEX_func_init(cpu->code_memory, cpu->code_memory_size);
+        if (!cpu->ref ||
+            APEX_func_load_images(cpu->ref, data_image, reg_image) != 0) {
+            fprintf(stderr, "APEX_Error : Unable to initialize reference model\n");
+            exit(1);
+        }
+    }
+
+    if (dcache) {
+        cpu->dcache = APEX_cache_init(dcache, dcache_hit, dcache_miss);
+        if (!cpu->dcache) {
+            fprintf(stderr, "APEX_Error : Unable to initialize data cache\n");
+            exit(1);
+        }
+    }
+
+    if (bpred[0]) {
+        cpu->bpred = APEX_bpred_init(bpred, bpred_size);
+        if (!cpu->bpred) {
+            fprintf(stderr, "APEX_Error : Unable to initialize branch predictor\n");
+            exit(1);
+        }
+    }
+
+    if (trace_file) {
+        cpu->trace = APEX_trace_create(trace_file);
+        if (!cpu->trace) {
+            fprintf(stderr, "APEX_Error : Unable to create trace %s\n", trace_file);
+            exit(1);
+        }
+    }
+
+    if (num_breaks) {
+        cpu->breaks = APEX_break_compile(break_specs, num_breaks,
+                                         cpu->code_memory_size);
+        if (!cpu->breaks) {
+            exit(1);
+        }
+        if (cpu->breaks->stall_watch && (ooo || width > 1)) {
+            fprintf(stderr, "APEX_Error : Stall breakpoints need the 5-stage "
+                    "pipeline\n");
+            exit(1);
+        }
+    }
+
+    cpu->max_cycles = max_cycles;
+    cpu->loop_check_period = loop_check_period;
+
+    /* Last, the checkpoint key covers the loaded images */
+    if (ckpt_dir) {
+        cpu->ckpt = APEX_ckpt_init(cpu, ckpt_dir, ckpt_period);
+        if (!cpu->ckpt) {
+            exit(1);
+        }
+        APEX_ckpt_resume(cpu);
+    }
+
+    APEX_perf_phase(PERF_PHASE_RUN);
+    int ret = ooo ? APEX_ooo_run(cpu, width, ooo_rob, ooo_iq, ooo_lsq)
+                  : APEX_wide_run(cpu, width);
+
+    /* The clock is not advanced on the cycle the simulation stops in */
+    int sim_cycles = cpu->clock + 1;
+
+    if (cpu->ref && !cpu->cosim_mismatch) {
+        printf("APEX_Cosim : %d commits matched the reference model\n",
+               cpu->ref->ins_completed);
+    }
+    if (cpu->dcache) {
+        APEX_cache_print(cpu->dcache);
+    }
+    if (cpu->bpred) {
+        APEX_bpred_print(cpu->bpred, ooo ? 0 : BPRED_PENALTY);
+    }
+    if (cpu->ckpt) {
+        printf("APEX_Ckpt : %d checkpoints written to %s\n", cpu->ckpt->taken,
+               ckpt_dir);
+    }
+    if (cpu->trace) {
+        if (APEX_trace_finish(cpu->trace) != 0) {
+            fprintf(stderr, "APEX_Error : Unable to write trace %s\n", trace_file);
+            ret = APEX_EXIT_ERROR;
+        }
+        printf("APEX_Trace : %lld records, %lld bytes written to %s\n",
+               cpu->trace->records, cpu->trace->bytes, trace_file);
+    }
+
+    int out_ret = write_outputs(&out, cpu->commit_pc, sim_cycles, cpu->regs,
+                                cpu->data_memory);
+    if (ret == APEX_EXIT_OK) {
+        ret = out_ret;
+    }
+
+    APEX_perf_phase(PERF_PHASE_TEARDOWN);
     APEX_cpu_stop(cpu);
-    return 0;
+    APEX_perf_phase(PERF_PHASE_NONE);
+
+    APEX_perf_report(sim_cycles);
+    APEX_perf_close();
+    return ret;
 }
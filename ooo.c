@@ -0,0 +1,725 @@
+/*
+ *  ooo.c
+ *  Out-of-order APEX timing model, see ooo.h
+ *
+ *  A cycle runs commit, writeback, issue, dispatch and fetch in that
+ *  order, so a result written back can wake up and issue a dependent in
+ *  the same cycle, and an instruction fetched in one cycle is dispatched
+ *  in the next. Results are computed with the architectural semantics of
+ *  func.c; AND/OR/XOR write their register and leave the zero flag.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bpred.h"
+#include "break.h"
+#include "ooo.h"
+
+static int
+phys_is_ready(APEX_OoO* ooo, int p)
+{
+    return (ooo->phys_ready[p / 64] >> (p % 64)) & 1;
+}
+
+static void
+set_phys_ready(APEX_OoO* ooo, int p, int ready)
+{
+    if (ready) {
+        ooo->phys_ready[p / 64] |= 1ULL << (p % 64);
+    } else {
+        ooo->phys_ready[p / 64] &= ~(1ULL << (p % 64));
+    }
+}
+
+static int
+alloc_phys(APEX_OoO* ooo)
+{
+    int p = ooo->free_list[ooo->free_head];
+    ooo->free_head = (ooo->free_head + 1) % OOO_NUM_PHYS;
+    ooo->free_count--;
+    set_phys_ready(ooo, p, 0);
+    return p;
+}
+
+/* Commit frees at the tail of the free list */
+static void
+release_phys(APEX_OoO* ooo, int p)
+{
+    ooo->free_list[(ooo->free_head + ooo->free_count) % OOO_NUM_PHYS] = p;
+    ooo->free_count++;
+}
+
+/* A squash gives back in reverse order of allocation, at the head */
+static void
+unalloc_phys(APEX_OoO* ooo, int p)
+{
+    ooo->free_head = (ooo->free_head + OOO_NUM_PHYS - 1) % OOO_NUM_PHYS;
+    ooo->free_list[ooo->free_head] = p;
+    ooo->free_count++;
+}
+
+/* ROB slot n entries after the head */
+static int
+rob_slot(APEX_OoO* ooo, int n)
+{
+    return (ooo->rob_head + n) % ooo->rob_size;
+}
+
+/* Position of a ROB slot in program order, 0 for the oldest */
+static int
+rob_age(APEX_OoO* ooo, int slot)
+{
+    return (slot - ooo->rob_head + ooo->rob_size) % ooo->rob_size;
+}
+
+static int
+writes_register(int op)
+{
+    switch (op) {
+    case OP_MOVC:
+    case OP_LOAD:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+        return 1;
+    }
+    return 0;
+}
+
+static int
+sets_flag(int op)
+{
+    return op == OP_ADD || op == OP_SUB || op == OP_MUL;
+}
+
+/* Removes an IQ slot, including its bits in the wakeup matrix */
+static void
+iq_remove(APEX_OoO* ooo, int slot)
+{
+    OoO_ROB_Entry* e = &ooo->rob[ooo->iq_rob[slot]];
+    unsigned int bit = 1u << slot;
+
+    for (int i = 0; i < 2; ++i) {
+        if (e->src[i] >= 0) {
+            ooo->wakeup[e->src[i]] &= ~bit;
+        }
+    }
+    ooo->iq_used &= ~bit;
+    ooo->ready &= ~bit;
+    e->iq = -1;
+}
+
+/* Writes a physical register and wakes up the IQ slots waiting on it */
+static void
+broadcast(APEX_OoO* ooo, int p, int value)
+{
+    ooo->phys_value[p] = value;
+    set_phys_ready(ooo, p, 1);
+
+    unsigned int waiters = ooo->wakeup[p];
+    ooo->wakeup[p] = 0;
+    while (waiters) {
+        int slot = __builtin_ctz(waiters);
+        waiters &= waiters - 1;
+        if (--ooo->waiting[slot] == 0) {
+            ooo->ready |= 1u << slot;
+        }
+    }
+}
+
+/*
+ * Throws away everything younger than ROB slot keep, undoing its renames
+ * youngest first, and sends fetch to pc
+ */
+static void
+squash_after(APEX_OoO* ooo, int keep, int pc)
+{
+    int keep_age = rob_age(ooo, keep);
+
+    while (ooo->rob_count > keep_age + 1) {
+        int slot = rob_slot(ooo, ooo->rob_count - 1);
+        OoO_ROB_Entry* e = &ooo->rob[slot];
+
+        if (e->iq >= 0) {
+            iq_remove(ooo, e->iq);
+        }
+        if (e->flag_dest >= 0) {
+            ooo->rat[OOO_FLAG_REG] = e->old_flag;
+            unalloc_phys(ooo, e->flag_dest);
+        }
+        if (e->dest >= 0) {
+            ooo->rat[e->rd] = e->old_dest;
+            unalloc_phys(ooo, e->dest);
+        }
+        if (e->lsq >= 0) {
+            ooo->lsq_count--;
+        }
+        ooo->executing &= ~(1ULL << slot);
+        ooo->rob_count--;
+        ooo->squashed++;
+    }
+
+    ooo->fetch_count = 0;
+    ooo->fetch_pc = pc;
+    /* A HALT dispatched after keep was on the wrong path */
+    ooo->fetch_halted = 0;
+}
+
+/*
+ * Commits up to width done instructions from the head of the ROB:
+ * registers and stores reach the architectural state, and the mappings
+ * they replaced go back to the free list
+ */
+static void
+ooo_commit(APEX_OoO* ooo)
+{
+    APEX_CPU* cpu = ooo->cpu;
+
+    for (int n = 0; n < ooo->width && ooo->rob_count && !ooo->done; ++n) {
+        OoO_ROB_Entry* e = &ooo->rob[ooo->rob_head];
+        if (!e->done) {
+            break;
+        }
+
+        if (e->fault) {
+            printf("APEX_OoO : pc(%d) data memory address %d out of range\n",
+                   e->pc, ooo->lsq[e->lsq].address);
+            cpu->exit_status = APEX_EXIT_ERROR;
+            ooo->done = 1;
+            break;
+        }
+        if (e->dest >= 0) {
+            APEX_cpu_write_reg(cpu, e->rd, e->result);
+            release_phys(ooo, e->old_dest);
+        }
+        if (e->flag_dest >= 0) {
+            ooo->zero_flag = e->flag;
+            release_phys(ooo, e->old_flag);
+        }
+        if (e->lsq >= 0) {
+            OoO_LSQ_Entry* entry = &ooo->lsq[e->lsq];
+            if (entry->is_store) {
+                APEX_cpu_write_mem(cpu, entry->address, entry->value);
+            }
+            ooo->lsq_head = (ooo->lsq_head + 1) % ooo->lsq_size;
+            ooo->lsq_count--;
+        }
+        if (cpu->bpred && (e->op == OP_BZ || e->op == OP_BNZ || e->op == OP_JUMP)) {
+            APEX_bpred_update(cpu->bpred, e->op, e->pc, e->pred_index,
+                              e->next_pc != e->pc + 4, e->next_pc,
+                              e->next_pc != e->pred_pc);
+        }
+
+        CPU_Stage committed = { .pc = e->pc, .op = e->op };
+        cpu->ins_completed++;
+        ooo->commit_pc = e->next_pc;
+        cpu->commit_pc = e->next_pc;
+        APEX_cpu_commit_check(cpu, &committed);
+
+        if (e->op == OP_HALT || cpu->cosim_mismatch ||
+            (cpu->breaks && cpu->breaks->hit) ||
+            e->pc == (((cpu->code_memory_size - 1) * 4) + 4000)) {
+            ooo->done = 1;
+        }
+        ooo->rob_head = rob_slot(ooo, 1);
+        ooo->rob_count--;
+    }
+}
+
+/*
+ * Writes back the instructions whose latency is up, oldest first. A
+ * BZ/BNZ/JUMP that went another way than fetch did squashes everything
+ * younger, including results due later this cycle.
+ */
+static void
+ooo_writeback(APEX_OoO* ooo)
+{
+    APEX_CPU* cpu = ooo->cpu;
+
+    for (int n = 0; n < ooo->rob_count && ooo->executing; ++n) {
+        int slot = rob_slot(ooo, n);
+        OoO_ROB_Entry* e = &ooo->rob[slot];
+        if (!((ooo->executing >> slot) & 1) || e->finish > cpu->clock) {
+            continue;
+        }
+
+        ooo->executing &= ~(1ULL << slot);
+        e->done = 1;
+        if (e->dest >= 0) {
+            broadcast(ooo, e->dest, e->result);
+        }
+        if (e->flag_dest >= 0) {
+            broadcast(ooo, e->flag_dest, e->flag);
+        }
+        if (e->next_pc != e->pred_pc) {
+            ooo->mispredicts++;
+            squash_after(ooo, slot, e->next_pc);
+        }
+    }
+}
+
+/* LOADs wait until every older STORE has its address */
+static int
+older_stores_known(APEX_OoO* ooo, int lsq_slot)
+{
+    for (int i = ooo->lsq_head; i != lsq_slot; i = (i + 1) % ooo->lsq_size) {
+        if (ooo->lsq[i].is_store && !ooo->lsq[i].address_ready) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Value a LOAD reads: the youngest older STORE to its address, else memory */
+static int
+load_value(APEX_OoO* ooo, OoO_LSQ_Entry* load, int lsq_slot)
+{
+    int value = ooo->cpu->data_memory[load->address];
+    for (int i = ooo->lsq_head; i != lsq_slot; i = (i + 1) % ooo->lsq_size) {
+        if (ooo->lsq[i].is_store && ooo->lsq[i].address == load->address) {
+            value = ooo->lsq[i].value;
+        }
+    }
+    return value;
+}
+
+/* Computes the result of an instruction whose operands are all ready */
+static void
+execute_entry(APEX_OoO* ooo, OoO_ROB_Entry* e)
+{
+    int a = e->src[0] >= 0 ? ooo->phys_value[e->src[0]] : 0;
+    int b = e->src[1] >= 0 ? ooo->phys_value[e->src[1]] : 0;
+    int latency = OOO_ALU_LATENCY;
+
+    e->next_pc = e->pc + 4;
+    switch (e->op) {
+    case OP_MOVC:
+        e->result = e->imm;
+        break;
+    case OP_ADD:
+        e->result = a + b;
+        break;
+    case OP_SUB:
+        e->result = a - b;
+        break;
+    case OP_MUL:
+        e->result = a * b;
+        latency = OOO_MUL_LATENCY;
+        break;
+    case OP_AND:
+        e->result = a & b;
+        break;
+    case OP_OR:
+        e->result = a | b;
+        break;
+    case OP_XOR:
+        e->result = a ^ b;
+        break;
+    case OP_BZ:
+    case OP_BNZ:
+        /* The source is the renamed zero flag */
+        if (a == (e->op == OP_BZ)) {
+            e->next_pc = e->pc + e->imm;
+        }
+        break;
+    case OP_JUMP:
+        e->next_pc = a + e->imm;
+        break;
+    case OP_LOAD:
+    case OP_STORE: {
+        OoO_LSQ_Entry* entry = &ooo->lsq[e->lsq];
+        entry->address = (e->op == OP_LOAD ? a : b) + e->imm;
+        entry->value = a;
+        entry->address_ready = 1;
+        if (entry->address < 0 || entry->address >= 4096) {
+            /* Only an error if it commits, it may be on a wrong path */
+            e->fault = 1;
+        } else if (e->op == OP_LOAD) {
+            e->result = load_value(ooo, entry, e->lsq);
+            latency = OOO_LOAD_LATENCY;
+        }
+        break;
+    }
+    }
+    e->flag = e->result == 0;
+    e->finish = ooo->cpu->clock + latency;
+}
+
+/* Selects up to width ready IQ slots, oldest first, and issues them */
+static void
+ooo_issue(APEX_OoO* ooo)
+{
+    for (int n = 0; n < ooo->width && ooo->ready; ++n) {
+        int best = -1;
+        int best_age = ooo->rob_size;
+
+        unsigned int candidates = ooo->ready;
+        while (candidates) {
+            int slot = __builtin_ctz(candidates);
+            candidates &= candidates - 1;
+            OoO_ROB_Entry* e = &ooo->rob[ooo->iq_rob[slot]];
+            int age = rob_age(ooo, ooo->iq_rob[slot]);
+            if (age < best_age &&
+                (e->op != OP_LOAD || older_stores_known(ooo, e->lsq))) {
+                best = slot;
+                best_age = age;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+
+        int rob = ooo->iq_rob[best];
+        iq_remove(ooo, best);
+        execute_entry(ooo, &ooo->rob[rob]);
+        ooo->executing |= 1ULL << rob;
+        ooo->issued++;
+    }
+}
+
+/* Architectural registers read, the zero flag as OOO_FLAG_REG, -1 if unused */
+static void
+source_registers(APEX_Instruction* ins, int src[2])
+{
+    src[0] = -1;
+    src[1] = -1;
+    switch (ins->op) {
+    case OP_STORE:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+        src[1] = ins->rs2;
+        /* fall through */
+    case OP_LOAD:
+    case OP_JUMP:
+        src[0] = ins->rs1;
+        break;
+    case OP_BZ:
+    case OP_BNZ:
+        src[0] = OOO_FLAG_REG;
+        break;
+    }
+}
+
+/*
+ * Renames up to width fetched instructions in order and puts them in the
+ * ROB, the IQ and the LSQ; stops at the first one that does not fit
+ */
+static void
+ooo_dispatch(APEX_OoO* ooo)
+{
+    APEX_CPU* cpu = ooo->cpu;
+
+    for (int n = 0; n < ooo->width && ooo->fetch_count; ++n) {
+        OoO_Fetched* f = &ooo->fetched[ooo->fetch_head];
+        APEX_Instruction* ins = &cpu->code_memory[get_code_index(f->pc)];
+        int is_mem = ins->op == OP_LOAD || ins->op == OP_STORE;
+        int needs_iq = ins->op != OP_HALT && ins->op != OP_UNKNOWN;
+        int phys_needed = writes_register(ins->op) + sets_flag(ins->op);
+
+        if (ooo->rob_count == ooo->rob_size) {
+            ooo->rob_full++;
+            break;
+        }
+        if (needs_iq && ooo->iq_used == ooo->iq_mask) {
+            ooo->iq_full++;
+            break;
+        }
+        if (is_mem && ooo->lsq_count == ooo->lsq_size) {
+            ooo->lsq_full++;
+            break;
+        }
+        if (ooo->free_count < phys_needed) {
+            /* Cannot happen, there are two per ROB entry */
+            break;
+        }
+
+        int slot = rob_slot(ooo, ooo->rob_count);
+        OoO_ROB_Entry* e = &ooo->rob[slot];
+        int src[2];
+        memset(e, 0, sizeof(*e));
+        e->pc = f->pc;
+        e->op = ins->op;
+        e->rd = writes_register(ins->op) ? ins->rd : -1;
+        e->imm = ins->imm;
+        e->pred_pc = f->pred_pc;
+        e->pred_index = f->pred_index;
+        e->next_pc = f->pc + 4;
+        e->dest = -1;
+        e->flag_dest = -1;
+        e->lsq = -1;
+        e->iq = -1;
+
+        /* Sources are read through the map before the destination is */
+        source_registers(ins, src);
+        for (int i = 0; i < 2; ++i) {
+            e->src[i] = src[i] >= 0 ? ooo->rat[src[i]] : -1;
+        }
+        if (e->rd >= 0) {
+            e->old_dest = ooo->rat[e->rd];
+            e->dest = alloc_phys(ooo);
+            ooo->rat[e->rd] = e->dest;
+        }
+        if (sets_flag(ins->op)) {
+            e->old_flag = ooo->rat[OOO_FLAG_REG];
+            e->flag_dest = alloc_phys(ooo);
+            ooo->rat[OOO_FLAG_REG] = e->flag_dest;
+        }
+        if (is_mem) {
+            e->lsq = (ooo->lsq_head + ooo->lsq_count) % ooo->lsq_size;
+            memset(&ooo->lsq[e->lsq], 0, sizeof(ooo->lsq[e->lsq]));
+            ooo->lsq[e->lsq].rob = slot;
+            ooo->lsq[e->lsq].is_store = ins->op == OP_STORE;
+            ooo->lsq_count++;
+        }
+
+        if (needs_iq) {
+            int iq = __builtin_ctz(~ooo->iq_used & ooo->iq_mask);
+            unsigned int bit = 1u << iq;
+            ooo->iq_used |= bit;
+            ooo->iq_rob[iq] = slot;
+            ooo->waiting[iq] = 0;
+            e->iq = iq;
+            for (int i = 0; i < 2; ++i) {
+                /* A register read twice is one wakeup */
+                if (e->src[i] >= 0 && !phys_is_ready(ooo, e->src[i]) &&
+                    !(ooo->wakeup[e->src[i]] & bit)) {
+                    ooo->wakeup[e->src[i]] |= bit;
+                    ooo->waiting[iq]++;
+                }
+            }
+            if (!ooo->waiting[iq]) {
+                ooo->ready |= bit;
+            }
+        } else {
+            /* HALT and unknown opcodes have nothing to execute */
+            e->done = 1;
+            if (ins->op == OP_HALT) {
+                /* Stop fetch and drop what it fetched past the HALT */
+                ooo->fetch_halted = 1;
+                ooo->fetch_count = 1;
+            }
+        }
+
+        ooo->rob_count++;
+        ooo->fetch_head = (ooo->fetch_head + 1) % OOO_FETCH_QUEUE;
+        ooo->fetch_count--;
+    }
+}
+
+/* Fetches up to width instructions, following the branch predictor */
+static void
+ooo_fetch(APEX_OoO* ooo)
+{
+    APEX_CPU* cpu = ooo->cpu;
+
+    for (int n = 0; n < ooo->width && !ooo->fetch_halted &&
+         ooo->fetch_count < OOO_FETCH_QUEUE; ++n) {
+        int index = get_code_index(ooo->fetch_pc);
+        if (ooo->fetch_pc < 4000 || index >= cpu->code_memory_size) {
+            break;
+        }
+        APEX_Instruction* ins = &cpu->code_memory[index];
+        OoO_Fetched* f =
+        &ooo->fetched[(ooo->fetch_head + ooo->fetch_count) % OOO_FETCH_QUEUE];
+        f->pc = ooo->fetch_pc;
+        f->pred_pc = cpu->bpred ? APEX_bpred_predict(cpu->bpred, ins, f->pc,
+                                                     &f->pred_index)
+                                : f->pc + 4;
+        ooo->fetch_count++;
+        ooo->fetch_pc = f->pred_pc;
+        if (f->pred_pc != f->pc + 4) {
+            break;
+        }
+    }
+}
+
+static unsigned long long
+ooo_mix(unsigned long long h, int value)
+{
+    return (h ^ (unsigned int)value) * 0x100000001b3ULL;
+}
+
+/*
+ * A physical register by what it holds rather than its number: its value
+ * once ready, else the age of the ROB entry that will write it
+ */
+static unsigned long long
+ooo_mix_phys(APEX_OoO* ooo, unsigned long long h, int p)
+{
+    if (p < 0 || phys_is_ready(ooo, p)) {
+        return ooo_mix(ooo_mix(h, 1), p < 0 ? 0 : ooo->phys_value[p]);
+    }
+    for (int n = 0; n < ooo->rob_count; ++n) {
+        OoO_ROB_Entry* e = &ooo->rob[rob_slot(ooo, n)];
+        if (e->dest == p || e->flag_dest == p) {
+            return ooo_mix(ooo_mix(h, 0), n);
+        }
+    }
+    return ooo_mix(ooo_mix(h, 0), -1);
+}
+
+/*
+ * Architectural state plus everything in flight: the rename map, the ROB
+ * with its issue and completion state, the LSQ and the fetch queue. Slot
+ * and physical register numbers rotate from one iteration to the next, so
+ * entries are hashed by age, operands by value or producer, and results
+ * still executing by cycles left
+ */
+static unsigned long long
+ooo_fingerprint(void* engine)
+{
+    APEX_OoO* ooo = engine;
+    unsigned long long h = 0xcbf29ce484222325ULL ^ ooo->cpu->state_hash;
+    h = ooo_mix(h, ooo->commit_pc);
+    h = ooo_mix(h, ooo->zero_flag);
+    for (int r = 0; r <= OOO_FLAG_REG; ++r) {
+        h = ooo_mix_phys(ooo, h, ooo->rat[r]);
+    }
+    h = ooo_mix(h, ooo->rob_count);
+    for (int n = 0; n < ooo->rob_count; ++n) {
+        int slot = rob_slot(ooo, n);
+        OoO_ROB_Entry* e = &ooo->rob[slot];
+        h = ooo_mix(h, e->pc);
+        h = ooo_mix(h, e->pred_pc);
+        h = ooo_mix(h, e->iq >= 0);
+        h = ooo_mix(h, e->done);
+        h = ooo_mix(h, e->fault);
+        h = ooo_mix_phys(ooo, h, e->src[0]);
+        h = ooo_mix_phys(ooo, h, e->src[1]);
+        if ((ooo->executing >> slot) & 1) {
+            h = ooo_mix(h, e->finish - ooo->cpu->clock);
+        }
+        if (e->done) {
+            h = ooo_mix(h, e->result);
+            h = ooo_mix(h, e->flag);
+            h = ooo_mix(h, e->next_pc);
+        }
+    }
+    h = ooo_mix(h, ooo->lsq_count);
+    for (int n = 0; n < ooo->lsq_count; ++n) {
+        OoO_LSQ_Entry* l = &ooo->lsq[(ooo->lsq_head + n) % ooo->lsq_size];
+        h = ooo_mix(h, rob_age(ooo, l->rob));
+        h = ooo_mix(h, l->address_ready);
+        if (l->address_ready) {
+            h = ooo_mix(h, l->address);
+            h = ooo_mix(h, l->value);
+        }
+    }
+    h = ooo_mix(h, ooo->fetch_pc);
+    h = ooo_mix(h, ooo->fetch_halted);
+    h = ooo_mix(h, ooo->fetch_count);
+    for (int n = 0; n < ooo->fetch_count; ++n) {
+        OoO_Fetched* f = &ooo->fetched[(ooo->fetch_head + n) % OOO_FETCH_QUEUE];
+        h = ooo_mix(h, f->pc);
+        h = ooo_mix(h, f->pred_pc);
+    }
+    return h;
+}
+
+/* Passes the PCs in the ROB and the fetch queue to the livelock check */
+static void
+ooo_in_flight(void* engine)
+{
+    APEX_OoO* ooo = engine;
+    for (int n = 0; n < ooo->rob_count; ++n) {
+        APEX_cpu_loop_pc(ooo->cpu, ooo->rob[rob_slot(ooo, n)].pc);
+    }
+    for (int n = 0; n < ooo->fetch_count; ++n) {
+        APEX_cpu_loop_pc(ooo->cpu,
+                         ooo->fetched[(ooo->fetch_head + n) % OOO_FETCH_QUEUE].pc);
+    }
+}
+
+/*
+ * Runs the program on the out-of-order model with the given structure
+ * sizes, with the same run limits, co-simulation and exit statuses as
+ * APEX_cpu_run
+ */
+int
+APEX_ooo_run(APEX_CPU* cpu, int width, int rob_size, int iq_size, int lsq_size)
+{
+    if (width < 1 || rob_size < 1 || rob_size > OOO_MAX_ROB ||
+        iq_size < 1 || iq_size > OOO_MAX_IQ || lsq_size < 1 ||
+        lsq_size > OOO_MAX_LSQ) {
+        fprintf(stderr, "APEX_OoO : Invalid sizes ROB %d IQ %d LSQ %d "
+                "(at most %d, %d, %d)\n", rob_size, iq_size, lsq_size,
+                OOO_MAX_ROB, OOO_MAX_IQ, OOO_MAX_LSQ);
+        return APEX_EXIT_ERROR;
+    }
+
+    APEX_OoO* ooo = calloc(1, sizeof(*ooo));
+    if (!ooo) {
+        return APEX_EXIT_ERROR;
+    }
+    ooo->cpu = cpu;
+    ooo->width = width;
+    ooo->rob_size = rob_size;
+    ooo->iq_size = iq_size;
+    ooo->lsq_size = lsq_size;
+    ooo->iq_mask = iq_size == 32 ? ~0u : (1u << iq_size) - 1;
+    ooo->fetch_pc = cpu->pc;
+    ooo->commit_pc = cpu->pc;
+
+    /* Register r and the flag start out in physical registers 0-16 with
+     * the architectural values, the rest are free */
+    for (int r = 0; r <= OOO_FLAG_REG; ++r) {
+        ooo->rat[r] = r;
+        ooo->phys_value[r] = r < 16 ? cpu->regs[r] : 0;
+        set_phys_ready(ooo, r, 1);
+    }
+    for (int p = OOO_FLAG_REG + 1; p < OOO_NUM_PHYS; ++p) {
+        ooo->free_list[ooo->free_count++] = p;
+    }
+
+    while (1) {
+        ooo_commit(ooo);
+        ooo_writeback(ooo);
+        ooo_issue(ooo);
+        ooo_dispatch(ooo);
+        ooo_fetch(ooo);
+
+        if (cpu->breaks && cpu->clock == cpu->breaks->next_cycle) {
+            APEX_break_cycle(cpu);
+        }
+        if (ooo->done || (cpu->breaks && cpu->breaks->hit)) {
+            break;
+        }
+        if (!ooo->rob_count && !ooo->fetch_count) {
+            /* Fetch ran off the end of code memory and everything committed */
+            break;
+        }
+        if (APEX_cpu_loop_check(cpu, ooo_fingerprint, ooo_in_flight, ooo)) {
+            break;
+        }
+        if (cpu->max_cycles && cpu->clock + 1 >= cpu->max_cycles) {
+            printf("APEX_CPU : Cycle limit %d reached at pc(%d)\n",
+                   cpu->max_cycles, ooo->commit_pc);
+            cpu->exit_status = APEX_EXIT_CYCLE_LIMIT;
+            break;
+        }
+        cpu->clock++;
+    }
+    cpu->pc = ooo->commit_pc;
+
+    long long cycles = cpu->clock + 1;
+    printf("APEX_OoO : width %d, ROB %d, IQ %d, LSQ %d\n", ooo->width,
+           ooo->rob_size, ooo->iq_size, ooo->lsq_size);
+    printf("APEX_OoO : %d instructions in %lld cycles, IPC %.2f, %lld issued\n",
+           cpu->ins_completed, cycles, (double)cpu->ins_completed / cycles,
+           ooo->issued);
+    printf("APEX_OoO : %lld mispredicted branches, %lld instructions squashed\n",
+           ooo->mispredicts, ooo->squashed);
+    printf("APEX_OoO : dispatch stopped on full ROB %lld, IQ %lld, LSQ %lld "
+           "cycles\n", ooo->rob_full, ooo->iq_full, ooo->lsq_full);
+
+    free(ooo);
+    return cpu->exit_status;
+}
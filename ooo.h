@@ -0,0 +1,138 @@
+#ifndef _APEX_OOO_H_
+#define _APEX_OOO_H_
+/**
+ *  ooo.h
+ *  Out-of-order timing model of APEX, run instead of the 5-stage pipeline
+ *  with --ooo. Fetch and dispatch are in order, the 16 architectural
+ *  registers and the zero flag are renamed onto a physical register file,
+ *  instructions issue from an issue queue as soon as their operands are
+ *  ready, and a reorder buffer commits them in order. LOAD/STORE go
+ *  through a load/store queue; stores write data memory at commit.
+ *
+ *  Every structure is a fixed-capacity array sized at init, the ROB, LSQ,
+ *  fetch queue and free list used as circular buffers. Nothing is
+ *  allocated once the run has started.
+ */
+#include "cpu.h"
+
+/* Largest structures --ooo-size accepts: ROB slots and IQ slots are bits
+ * in 64-bit and 32-bit masks */
+#define OOO_MAX_ROB 64
+#define OOO_MAX_IQ 32
+#define OOO_MAX_LSQ 64
+
+/* Registers, the zero flag, and a value and a flag for every ROB entry */
+#define OOO_NUM_PHYS (16 + 1 + 2 * OOO_MAX_ROB)
+#define OOO_PHYS_WORDS ((OOO_NUM_PHYS + 63) / 64)
+
+/* Architectural register number the zero flag is renamed as */
+#define OOO_FLAG_REG 16
+
+#define OOO_FETCH_QUEUE 16
+
+/* Cycles from issue to result */
+#define OOO_ALU_LATENCY 1
+#define OOO_MUL_LATENCY 2
+#define OOO_LOAD_LATENCY 2
+
+typedef struct OoO_ROB_Entry
+{
+    int pc;
+    int op;		    // OP_*
+    int rd;		    // Architectural destination, -1 if none
+    int imm;
+    int src[2];		    // Physical sources, -1 if unused
+    int dest;		    // Physical destination, -1 if none
+    int old_dest;	    // Mapping of rd before this, freed at commit
+    int flag_dest;	    // Physical zero flag written by ADD/SUB/MUL, else -1
+    int old_flag;
+    int lsq;		    // LSQ slot of a LOAD/STORE, else -1
+    int iq;		    // IQ slot while waiting to issue, else -1
+    int result;		    // Value (and flag) written at completion
+    int flag;
+    int finish;		    // Cycle the result is written back
+    int done;		    // Completed, can commit
+    int fault;		    // LOAD/STORE address out of range
+    int pred_pc;	    // PC fetch went on with after this
+    int pred_index;	    // Predictor counter pred_pc came from
+    int next_pc;	    // PC it actually continues with, once done
+} OoO_ROB_Entry;
+
+typedef struct OoO_LSQ_Entry
+{
+    int rob;
+    int is_store;
+    int address_ready;	    // Address (and store value) known
+    int address;
+    int value;
+} OoO_LSQ_Entry;
+
+typedef struct OoO_Fetched
+{
+    int pc;
+    int pred_pc;
+    int pred_index;
+} OoO_Fetched;
+
+typedef struct APEX_OoO
+{
+    APEX_CPU* cpu;	    // Architectural registers, data memory, code memory
+    int width;		    // Fetch, dispatch, issue and commit per cycle
+    int rob_size;
+    int iq_size;
+    int lsq_size;
+
+    /* Rename table and physical register file; ready is a bit per
+     * physical register */
+    int rat[17];
+    int phys_value[OOO_NUM_PHYS];
+    unsigned long long phys_ready[OOO_PHYS_WORDS];
+    int free_list[OOO_NUM_PHYS];
+    int free_head;
+    int free_count;
+
+    /* Reorder buffer, oldest at rob_head */
+    OoO_ROB_Entry rob[OOO_MAX_ROB];
+    int rob_head;
+    int rob_count;
+    unsigned long long executing;   // ROB slots issued and not yet written back
+
+    /* Issue queue: wakeup[p] has a bit for every IQ slot waiting on
+     * physical register p, and waiting[] counts the operands a slot still
+     * waits for; a slot is in ready once that reaches 0 */
+    unsigned int iq_mask;   // A bit for each of the iq_size slots
+    int iq_rob[OOO_MAX_IQ];
+    int waiting[OOO_MAX_IQ];
+    unsigned int iq_used;
+    unsigned int ready;
+    unsigned int wakeup[OOO_NUM_PHYS];
+
+    /* Load/store queue, in program order */
+    OoO_LSQ_Entry lsq[OOO_MAX_LSQ];
+    int lsq_head;
+    int lsq_count;
+
+    /* Fetch queue between fetch and dispatch */
+    OoO_Fetched fetched[OOO_FETCH_QUEUE];
+    int fetch_head;
+    int fetch_count;
+    int fetch_pc;
+    int fetch_halted;	    // HALT dispatched, fetch has stopped
+
+    int commit_pc;	    // PC of the next instruction to commit
+    int zero_flag;	    // Committed zero flag, 1 when the last ADD/SUB/MUL gave 0
+    int done;
+
+    /* Run summary */
+    long long mispredicts;
+    long long squashed;
+    long long issued;
+    long long rob_full;	    // Cycles dispatch stopped on a full ROB
+    long long iq_full;
+    long long lsq_full;
+} APEX_OoO;
+
+int
+APEX_ooo_run(APEX_CPU* cpu, int width, int rob_size, int iq_size, int lsq_size);
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ *  perf.c
+ *  Samples wall-clock time and host hardware counters (through
+ *  perf_event_open) while the simulator runs, and attributes them to the
+ *  phase the simulator was in: parse, init, run loop or teardown.
+ *
+ *  Counters that cannot be opened (no permission, virtualised host, non
+ *  Linux build) are reported as n/a; wall-clock time is always available.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perf.h"
+
+static const char* phase_names[NUM_PERF_PHASES] = {
+    "parse", "init", "run", "teardown"
+};
+
+static const char* counter_names[NUM_PERF_COUNTERS] = {
+    "instructions", "cycles", "br-misses", "L1D-misses", "LLC-misses"
+};
+
+static int perf_enabled = 0;
+static int current_phase = PERF_PHASE_NONE;
+static int counter_fd[NUM_PERF_COUNTERS];
+
+/* Values at the last phase switch and totals accumulated per phase */
+static unsigned long long last_value[NUM_PERF_COUNTERS];
+static unsigned long long phase_value[NUM_PERF_PHASES][NUM_PERF_COUNTERS];
+static double last_time;
+static double phase_time[NUM_PERF_PHASES];
+
+static double
+get_wall_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#ifdef __linux__
+static int
+open_counter(unsigned int type, unsigned long long config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+    PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/* Reads a counter, scaled up if the kernel had to multiplex it */
+static unsigned long long
+read_counter(int fd)
+{
+    unsigned long long buf[3];
+    if (read(fd, buf, sizeof(buf)) != sizeof(buf) || !buf[2]) {
+        return 0;
+    }
+    if (buf[2] < buf[1]) {
+        return (unsigned long long)((double)buf[0] * buf[1] / buf[2]);
+    }
+    return buf[0];
+}
+
+/*
+ * Opens the host counters. Returns the number of hardware counters that
+ * could be opened; 0 still leaves wall-clock phase timing enabled.
+ */
+int
+APEX_perf_init(void)
+{
+    int opened = 0;
+
+    for (int i = 0; i < NUM_PERF_COUNTERS; ++i) {
+        counter_fd[i] = -1;
+    }
+
+#ifdef __linux__
+    counter_fd[PERF_INSTRUCTIONS] =
+    open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    counter_fd[PERF_CYCLES] =
+    open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    counter_fd[PERF_BRANCH_MISSES] =
+    open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    counter_fd[PERF_L1D_MISSES] =
+    open_counter(PERF_TYPE_HW_CACHE,
+                 PERF_COUNT_HW_CACHE_L1D |
+                 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    counter_fd[PERF_LLC_MISSES] =
+    open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+    for (int i = 0; i < NUM_PERF_COUNTERS; ++i) {
+        if (counter_fd[i] >= 0) {
+            ioctl(counter_fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counter_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+            opened++;
+        }
+    }
+#endif
+
+    if (!opened) {
+        fprintf(stderr,
+                "APEX_Perf : Hardware counters unavailable, "
+                "reporting wall-clock time only\n");
+    }
+
+    memset(last_value, 0, sizeof(last_value));
+    memset(phase_value, 0, sizeof(phase_value));
+    memset(phase_time, 0, sizeof(phase_time));
+    last_time = get_wall_time();
+    current_phase = PERF_PHASE_NONE;
+    perf_enabled = 1;
+    return opened;
+}
+
+/*
+ * Closes the currently running phase, charging it everything counted since
+ * the previous switch, and starts charging the given phase.
+ * PERF_PHASE_NONE stops charging. This is a no-op unless perf is enabled.
+ */
+void
+APEX_perf_phase(int phase)
+{
+    if (!perf_enabled) {
+        return;
+    }
+
+    double now = get_wall_time();
+    for (int i = 0; i < NUM_PERF_COUNTERS; ++i) {
+        if (counter_fd[i] < 0) {
+            continue;
+        }
+        unsigned long long value = read_counter(counter_fd[i]);
+        if (current_phase != PERF_PHASE_NONE) {
+            phase_value[current_phase][i] += value - last_value[i];
+        }
+        last_value[i] = value;
+    }
+    if (current_phase != PERF_PHASE_NONE) {
+        phase_time[current_phase] += now - last_time;
+    }
+    last_time = now;
+    current_phase = phase;
+}
+
+static void
+print_row(const char* name, double time, double* values)
+{
+    printf("%-14s %-12.6f", name, time);
+    for (int i = 0; i < NUM_PERF_COUNTERS; ++i) {
+        if (counter_fd[i] < 0) {
+            printf(" %-14s", "n/a");
+        } else {
+            printf(" %-14.4g", values[i]);
+        }
+    }
+    printf("\n");
+}
+
+/*
+ * Prints the per-phase table, followed by the run loop normalised per
+ * simulated cycle
+ */
+void
+APEX_perf_report(int sim_cycles)
+{
+    if (!perf_enabled) {
+        return;
+    }
+
+    double values[NUM_PERF_COUNTERS];
+
+    printf("APEX_Perf : Host counters per simulation phase\n");
+    printf("%-14s %-12s", "phase", "wall(s)");
+    for (int i = 0; i < NUM_PERF_COUNTERS; ++i) {
+        printf(" %-14s", counter_names[i]);
+    }
+    printf("\n");
+
+    for (int p = 0; p < NUM_PERF_PHASES; ++p) {
+        for (int i = 0; i < NUM_PERF_COUNTERS; ++i) {
+            values[i] = phase_value[p][i];
+        }
+        print_row(phase_names[p], phase_time[p], values);
+    }
+
+    if (sim_cycles > 0) {
+        for (int i = 0; i < NUM_PERF_COUNTERS; ++i) {
+            values[i] = (double)phase_value[PERF_PHASE_RUN][i] / sim_cycles;
+        }
+        print_row("run/sim-cycle", phase_time[PERF_PHASE_RUN] / sim_cycles,
+                  values);
+    }
+}
+
+void
+APEX_perf_close(void)
+{
+    for (int i = 0; i < NUM_PERF_COUNTERS; ++i) {
+        if (perf_enabled && counter_fd[i] >= 0) {
+            close(counter_fd[i]);
+        }
+        counter_fd[i] = -1;
+    }
+    perf_enabled = 0;
+}
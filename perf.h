@@ -0,0 +1,41 @@
+#ifndef _APEX_PERF_H_
+#define _APEX_PERF_H_
+/**
+ *  perf.h
+ *  Host-side wall-clock and hardware counter sampling of the simulator
+ *  itself, split by simulation phase
+ */
+
+enum
+{
+    PERF_PHASE_PARSE,
+    PERF_PHASE_INIT,
+    PERF_PHASE_RUN,
+    PERF_PHASE_TEARDOWN,
+    NUM_PERF_PHASES,
+    PERF_PHASE_NONE = -1
+};
+
+enum
+{
+    PERF_INSTRUCTIONS,
+    PERF_CYCLES,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    NUM_PERF_COUNTERS
+};
+
+int
+APEX_perf_init(void);
+
+void
+APEX_perf_phase(int phase);
+
+void
+APEX_perf_report(int sim_cycles);
+
+void
+APEX_perf_close(void);
+
+#endif
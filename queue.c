@@ -0,0 +1,539 @@
+/*
+ *  queue.c
+ *  Shared directory job queue, see queue.h
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "queue.h"
+#include "state.h"
+
+/* Status of a job that has no result yet */
+#define QUEUE_PENDING -1000
+#define QUEUE_RUNNING -1001
+
+static const char* exit_names[] = { "ok", "error", "cosim", "cycle-limit",
+                                    "livelock", "golden", "break" };
+
+/* Status of a job as shown in the report: its exit status or signal */
+static void
+status_name(char* buf, size_t size, int status)
+{
+    if (status == QUEUE_PENDING) {
+        snprintf(buf, size, "pending");
+    } else if (status == QUEUE_RUNNING) {
+        snprintf(buf, size, "running");
+    } else if (status < 0) {
+        snprintf(buf, size, "signal-%d", -status);
+    } else if (status < (int)(sizeof(exit_names) / sizeof(exit_names[0]))) {
+        snprintf(buf, size, "%s", exit_names[status]);
+    } else {
+        snprintf(buf, size, "exit-%d", status);
+    }
+}
+
+/* Reads the job and shard counts of the queue in dir. Returns 0 or -1. */
+static int
+read_queue(const char* dir, int* jobs, int* shards)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/queue", dir);
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "APEX_Queue : %s is not a job queue\n", dir);
+        return -1;
+    }
+    int ok = fscanf(fp, "jobs %d shards %d", jobs, shards) == 2 && *shards > 0;
+    fclose(fp);
+    if (!ok) {
+        fprintf(stderr, "APEX_Queue : %s is not a valid queue file\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+make_dir(const char* path)
+{
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "APEX_Queue : Unable to create %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes text to path through a temporary file and rename(), so readers
+ * see either nothing or all of it. Returns 0 or -1.
+ */
+static int
+write_atomic(const char* path, const char* text)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+    FILE* fp = fopen(tmp, "w");
+    if (!fp) {
+        return -1;
+    }
+    fputs(text, fp);
+    int err = ferror(fp);
+    if (fclose(fp) != 0 || err || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Coordinator: creates a queue in dir holding one job per line of
+ * job_list (blank lines and lines starting with # are skipped), dealt
+ * round robin over shards shards. Returns 0, or 1 on error.
+ */
+int
+APEX_queue_init(const char* dir, const char* job_list, int shards)
+{
+    char path[PATH_MAX];
+    char line[QUEUE_MAX_LINE];
+    int jobs = 0;
+
+    if (shards < 1) {
+        fprintf(stderr, "APEX_Queue : Need at least one shard\n");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/queue", dir);
+    if (access(path, F_OK) == 0) {
+        fprintf(stderr, "APEX_Queue : %s already holds a queue\n", dir);
+        return 1;
+    }
+
+    FILE* fp = fopen(job_list, "r");
+    if (!fp) {
+        fprintf(stderr, "APEX_Queue : Unable to open %s\n", job_list);
+        return 1;
+    }
+    int err = make_dir(dir);
+    for (int k = 0; k < shards && !err; ++k) {
+        snprintf(path, sizeof(path), "%s/shard.%d", dir, k);
+        err = make_dir(path);
+    }
+    snprintf(path, sizeof(path), "%s/running", dir);
+    err = err || make_dir(path);
+    snprintf(path, sizeof(path), "%s/results", dir);
+    err = err || make_dir(path);
+
+    while (!err && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        const char* job = line + strspn(line, " \t");
+        if (!job[0] || job[0] == '#') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/shard.%d/job.%05d", dir,
+                 jobs % shards, jobs);
+        if (write_atomic(path, job) != 0) {
+            fprintf(stderr, "APEX_Queue : Unable to write %s\n", path);
+            err = 1;
+        }
+        jobs++;
+    }
+    fclose(fp);
+    if (err) {
+        return 1;
+    }
+
+    /* Last, workers only start on a complete queue */
+    char text[64];
+    snprintf(text, sizeof(text), "jobs %d shards %d\n", jobs, shards);
+    snprintf(path, sizeof(path), "%s/queue", dir);
+    if (write_atomic(path, text) != 0) {
+        fprintf(stderr, "APEX_Queue : Unable to write %s\n", path);
+        return 1;
+    }
+    printf("APEX_Queue : %d jobs in %d shards in %s\n", jobs, shards, dir);
+    return 0;
+}
+
+/*
+ * Claims a job of shard k: the lowest numbered one for its owner, the
+ * highest for a thief, so the two work from opposite ends. Returns the job
+ * number, or -1 once the shard is empty.
+ */
+static int
+claim_from(const char* dir, int k, int own)
+{
+    char shard_dir[PATH_MAX];
+    char from[PATH_MAX + 16];
+    char to[PATH_MAX];
+
+    snprintf(shard_dir, sizeof(shard_dir), "%s/shard.%d", dir, k);
+    for (;;) {
+        DIR* d = opendir(shard_dir);
+        if (!d) {
+            return -1;
+        }
+        int best = -1;
+        struct dirent* ent;
+        while ((ent = readdir(d))) {
+            int n;
+            char tail;
+            if (sscanf(ent->d_name, "job.%d%c", &n, &tail) == 1 &&
+                (best < 0 || (own ? n < best : n > best))) {
+                best = n;
+            }
+        }
+        closedir(d);
+        if (best < 0) {
+            return -1;
+        }
+
+        snprintf(from, sizeof(from), "%s/job.%05d", shard_dir, best);
+        snprintf(to, sizeof(to), "%s/running/job.%05d", dir, best);
+        if (rename(from, to) == 0) {
+            return best;
+        }
+        /* Another worker got it first, look again */
+    }
+}
+
+/* Splits line into args at blanks. Returns the number of args. */
+static int
+split_args(char* line, char** args, int max)
+{
+    int count = 0;
+    for (char* tok = strtok(line, " \t"); tok && count < max;
+         tok = strtok(NULL, " \t")) {
+        args[count++] = tok;
+    }
+    return count;
+}
+
+/*
+ * Runs job n (already in running/) as its own apex_sim process with its
+ * output in results/. Returns its exit status, minus the signal if it was
+ * killed by one, or APEX_EXIT_ERROR if it cannot be started.
+ */
+static int
+run_job(const char* dir, int n, const char* exe, char* command, size_t size)
+{
+    char path[PATH_MAX];
+    char state_path[PATH_MAX];
+    char line[QUEUE_MAX_LINE];
+    char* args[QUEUE_MAX_ARGS + 4];
+
+    command[0] = '\0';
+    snprintf(path, sizeof(path), "%s/running/job.%05d", dir, n);
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return APEX_EXIT_ERROR;
+    }
+    if (!fgets(line, sizeof(line), fp)) {
+        line[0] = '\0';
+    }
+    fclose(fp);
+    line[strcspn(line, "\r\n")] = '\0';
+    snprintf(command, size, "%s", line);
+
+    /* exe <program> --state-out <results>/job.n.state [options], the
+     * job's own --state-out comes later and wins */
+    int argc = 1 + split_args(line, args + 1, QUEUE_MAX_ARGS);
+    if (argc < 2) {
+        return APEX_EXIT_ERROR;
+    }
+    int dump = 1;
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(args[i], "--lanes") == 0 || strcmp(args[i], "--analyze") == 0) {
+            dump = 0;
+        }
+    }
+    snprintf(state_path, sizeof(state_path), "%s/results/job.%05d.state", dir, n);
+    if (dump) {
+        memmove(&args[4], &args[2], sizeof(args[0]) * (argc - 2));
+        args[2] = "--state-out";
+        args[3] = state_path;
+        argc += 2;
+    }
+    args[0] = (char*)exe;
+    args[argc] = NULL;
+
+    snprintf(path, sizeof(path), "%s/results/job.%05d.out", dir, n);
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return APEX_EXIT_ERROR;
+    }
+    if (pid == 0) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            _exit(APEX_EXIT_ERROR);
+        }
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+        execv(exe, args);
+        fprintf(stderr, "APEX_Queue : Unable to run %s\n", exe);
+        _exit(APEX_EXIT_ERROR);
+    }
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0) {
+        if (errno != EINTR) {
+            return APEX_EXIT_ERROR;
+        }
+    }
+    return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -WTERMSIG(wstatus);
+}
+
+static double
+now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Worker: runs jobs of the queue in dir, first from its own shard
+ * (shard modulo the shard count) and then stolen from the others, until
+ * none are left. exe is the apex_sim binary to run them with. Returns 0,
+ * or 1 on error.
+ */
+int
+APEX_queue_work(const char* dir, int shard, const char* exe)
+{
+    int jobs;
+    int shards;
+    char host[64];
+    char worker[96];
+    char command[QUEUE_MAX_LINE];
+    char path[PATH_MAX];
+    char text[QUEUE_MAX_LINE + 256];
+    char name[32];
+    int ran = 0;
+    int stole = 0;
+
+    if (read_queue(dir, &jobs, &shards) != 0) {
+        return 1;
+    }
+    shard %= shards;
+    if (shard < 0) {
+        shard += shards;
+    }
+    if (gethostname(host, sizeof(host)) != 0) {
+        snprintf(host, sizeof(host), "localhost");
+    }
+    host[sizeof(host) - 1] = '\0';
+    snprintf(worker, sizeof(worker), "%s:%d", host, (int)getpid());
+
+    for (int s = 0; s < shards; ) {
+        int k = (shard + s) % shards;
+        int n = claim_from(dir, k, s == 0);
+        if (n < 0) {
+            /* Shard k is empty and stays so, move on to the next one */
+            s++;
+            continue;
+        }
+
+        double start = now_seconds();
+        int status = run_job(dir, n, exe, command, sizeof(command));
+        double seconds = now_seconds() - start;
+
+        snprintf(text, sizeof(text),
+                 "status %d\nworker %s\nshard %d\nstolen %d\nseconds %.3f\n"
+                 "command %s\n", status, worker, k, s != 0, seconds, command);
+        snprintf(path, sizeof(path), "%s/results/job.%05d.result", dir, n);
+        if (write_atomic(path, text) != 0) {
+            fprintf(stderr, "APEX_Queue : Unable to write %s\n", path);
+            return 1;
+        }
+        snprintf(path, sizeof(path), "%s/running/job.%05d", dir, n);
+        unlink(path);
+
+        status_name(name, sizeof(name), status);
+        printf("APEX_Queue : %s job.%05d %s%s\n", worker, n, name,
+               s ? " (stolen)" : "");
+        fflush(stdout);
+        ran++;
+        stole += s != 0;
+    }
+
+    printf("APEX_Queue : %s ran %d jobs, %d stolen\n", worker, ran, stole);
+    return 0;
+}
+
+typedef struct Queue_Result
+{
+    int status;
+    char worker[96];
+    int shard;
+    int stolen;
+    double seconds;
+    char command[QUEUE_MAX_LINE];
+} Queue_Result;
+
+/* Reads the result of job n. Returns 0, or -1 if there is none yet. */
+static int
+read_result(const char* dir, int n, Queue_Result* result)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/results/job.%05d.result", dir, n);
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    int ok = fscanf(fp, "status %d\nworker %95s\nshard %d\nstolen %d\n"
+                    "seconds %lf\n", &result->status, result->worker,
+                    &result->shard, &result->stolen, &result->seconds) == 5 &&
+             fgets(result->command, sizeof(result->command), fp) &&
+             strncmp(result->command, "command ", 8) == 0;
+    fclose(fp);
+    if (!ok) {
+        return -1;
+    }
+    memmove(result->command, result->command + 8, strlen(result->command + 8) + 1);
+    result->command[strcspn(result->command, "\n")] = '\0';
+    return 0;
+}
+
+/*
+ * Merge step: collates the results of the queue in dir, finished or not,
+ * into one report (stdout if report is NULL). Returns 0 if every job ran
+ * and exited with status 0, otherwise 1.
+ */
+int
+APEX_queue_merge(const char* dir, const char* report)
+{
+    int jobs;
+    int shards;
+    int counts[sizeof(exit_names) / sizeof(exit_names[0])] = { 0 };
+    int other = 0;
+    int missing = 0;
+    int stolen = 0;
+    double seconds = 0;
+    char path[PATH_MAX];
+    char name[32];
+
+    if (read_queue(dir, &jobs, &shards) != 0) {
+        return 1;
+    }
+    APEX_State* state = malloc(sizeof(*state));
+    Queue_Result* result = malloc(sizeof(*result));
+    FILE* fp = report ? fopen(report, "w") : stdout;
+    if (!state || !result || !fp) {
+        fprintf(stderr, "APEX_Queue : Unable to write %s\n", report);
+        free(state);
+        free(result);
+        return 1;
+    }
+
+    fprintf(fp, "%-10s %-12s %8s %6s  %-24s %5s %6s %8s  %s\n", "job", "status",
+            "cycles", "pc", "worker", "shard", "stolen", "seconds", "command");
+    for (int n = 0; n < jobs; ++n) {
+        if (read_result(dir, n, result) != 0) {
+            snprintf(path, sizeof(path), "%s/running/job.%05d", dir, n);
+            status_name(name, sizeof(name),
+                        access(path, F_OK) == 0 ? QUEUE_RUNNING : QUEUE_PENDING);
+            fprintf(fp, "job.%05d  %-12s\n", n, name);
+            missing++;
+            continue;
+        }
+
+        char cycles[16] = "-";
+        char pc[16] = "-";
+        snprintf(path, sizeof(path), "%s/results/job.%05d.state", dir, n);
+        if (APEX_state_read(state, path) == 0) {
+            snprintf(cycles, sizeof(cycles), "%d", state->cycles);
+            snprintf(pc, sizeof(pc), "%d", state->pc);
+        }
+        status_name(name, sizeof(name), result->status);
+        fprintf(fp, "job.%05d  %-12s %8s %6s  %-24s %5d %6s %8.3f  %s\n", n,
+                name, cycles, pc, result->worker, result->shard,
+                result->stolen ? "yes" : "no", result->seconds, result->command);
+
+        if (result->status >= 0 &&
+            result->status < (int)(sizeof(counts) / sizeof(counts[0]))) {
+            counts[result->status]++;
+        } else {
+            other++;
+        }
+        stolen += result->stolen;
+        seconds += result->seconds;
+    }
+
+    fprintf(fp, "\n%d jobs:", jobs);
+    for (int i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); ++i) {
+        if (counts[i]) {
+            fprintf(fp, " %s %d,", exit_names[i], counts[i]);
+        }
+    }
+    fprintf(fp, " other %d, not finished %d; %d stolen, %.3f job seconds\n",
+            other, missing, stolen, seconds);
+    if (report) {
+        fclose(fp);
+        printf("APEX_Queue : %d of %d jobs ok, %d not finished, report in %s\n",
+               counts[APEX_EXIT_OK], jobs, missing, report);
+    }
+
+    free(state);
+    free(result);
+    return counts[APEX_EXIT_OK] == jobs ? 0 : 1;
+}
+
+/*
+ * Runs a whole queue on this host: creates it in dir from job_list with a
+ * shard per worker, forks workers workers, and merges their results into
+ * <dir>/report.txt once all have finished. Returns as APEX_queue_merge().
+ */
+int
+APEX_queue_coordinate(const char* dir, const char* job_list, int workers,
+                      const char* exe)
+{
+    char report[PATH_MAX];
+    int ret = 0;
+
+    if (APEX_queue_init(dir, job_list, workers) != 0) {
+        return 1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int k = 0; k < workers; ++k) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "APEX_Queue : Unable to start worker %d\n", k);
+            ret = 1;
+            break;
+        }
+        if (pid == 0) {
+            int err = APEX_queue_work(dir, k, exe);
+            fflush(stdout);
+            _exit(err);
+        }
+    }
+
+    /* Workers started so far still drain the whole queue between them */
+    for (;;) {
+        int wstatus;
+        if (wait(&wstatus) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+            ret = 1;
+        }
+    }
+
+    snprintf(report, sizeof(report), "%s/report.txt", dir);
+    return APEX_queue_merge(dir, report) || ret;
+}
@@ -0,0 +1,44 @@
+#ifndef _APEX_QUEUE_H_
+#define _APEX_QUEUE_H_
+/**
+ *  queue.h
+ *  Sharded batch runs through a job queue in a shared directory, for
+ *  workers on any number of hosts (or processes on one host) with no
+ *  service other than the file system:
+ *
+ *      <dir>/queue		    "jobs <n> shards <s>", written last by init
+ *      <dir>/shard.<k>/job.<n>	    jobs not yet claimed, dealt round robin
+ *      <dir>/running/job.<n>	    claimed jobs
+ *      <dir>/results/job.<n>.result  written when job n is done
+ *      <dir>/results/job.<n>.out   its output
+ *      <dir>/results/job.<n>.state   its final state (--state-out)
+ *
+ *  A job is one line of the job list, "<program> [options]" as given to
+ *  apex_sim. A worker claims a job by rename()ing it from a shard into
+ *  running/, so exactly one worker gets each job. It takes the lowest
+ *  numbered job of its own shard and, once that is empty, steals the
+ *  highest numbered job of the other shards. Each job runs in its own
+ *  apex_sim process, and the result file appears by rename() once the job
+ *  has finished, so the merge never sees half a result.
+ */
+
+/* Most words in a job line */
+#define QUEUE_MAX_ARGS 64
+
+/* Longest job line */
+#define QUEUE_MAX_LINE 1024
+
+int
+APEX_queue_init(const char* dir, const char* job_list, int shards);
+
+int
+APEX_queue_work(const char* dir, int shard, const char* exe);
+
+int
+APEX_queue_merge(const char* dir, const char* report);
+
+int
+APEX_queue_coordinate(const char* dir, const char* job_list, int workers,
+                      const char* exe);
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ *  state.c
+ *  Final state dumps and golden comparison, see state.h
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "state.h"
+
+static const char state_magic[4] = { 'A', 'P', 'X', 'S' };
+
+static unsigned long long
+range_hash(const int* words, int start, int count)
+{
+    unsigned long long hash = 0;
+    for (int i = 0; i < count; ++i) {
+        hash ^= apex_hash_slot(APEX_HASH_MEM_SLOT(start + i), words[i]);
+    }
+    return hash;
+}
+
+/*
+ * Takes the state at the end of a run: the registers and the non-zero
+ * ranges of data memory are copied into state
+ */
+void
+APEX_state_capture(APEX_State* state, int pc, int cycles, const int* regs,
+                   const int* data_memory)
+{
+    int used = 0;
+
+    state->pc = pc;
+    state->cycles = cycles;
+    memcpy(state->regs, regs, sizeof(state->regs));
+    state->num_ranges = 0;
+
+    for (int a = 0; a < APEX_DATA_WORDS; ) {
+        if (!data_memory[a]) {
+            a++;
+            continue;
+        }
+        /* Extend over gaps of up to STATE_RANGE_GAP zeros */
+        int end = a + 1;
+        for (int b = end; b < APEX_DATA_WORDS && b - end <= STATE_RANGE_GAP; ++b) {
+            if (data_memory[b]) {
+                end = b + 1;
+            }
+        }
+
+        APEX_State_Range* range = &state->ranges[state->num_ranges++];
+        range->start = a;
+        range->count = end - a;
+        range->words = &state->words[used];
+        memcpy(range->words, &data_memory[a], sizeof(int) * range->count);
+        range->hash = range_hash(range->words, a, range->count);
+        used += range->count;
+        a = end;
+    }
+}
+
+/* Returns 0, or -1 if the file cannot be written */
+int
+APEX_state_write(const APEX_State* state, const char* filename)
+{
+    FILE* fp = fopen(filename, "wb");
+    if (!fp) {
+        return -1;
+    }
+
+    unsigned char version = APEX_STATE_VERSION;
+    int header[19];
+    header[0] = state->pc;
+    header[1] = state->cycles;
+    memcpy(&header[2], state->regs, sizeof(state->regs));
+    header[18] = state->num_ranges;
+    fwrite(state_magic, 1, sizeof(state_magic), fp);
+    fwrite(&version, 1, 1, fp);
+    fwrite(header, sizeof(int), 19, fp);
+
+    for (int i = 0; i < state->num_ranges; ++i) {
+        const APEX_State_Range* range = &state->ranges[i];
+        fwrite(&range->start, sizeof(int), 1, fp);
+        fwrite(&range->count, sizeof(int), 1, fp);
+        fwrite(&range->hash, sizeof(range->hash), 1, fp);
+        fwrite(range->words, sizeof(int), range->count, fp);
+    }
+
+    int err = ferror(fp);
+    return (fclose(fp) == 0 && !err) ? 0 : -1;
+}
+
+/* Returns 0, or -1 if the file cannot be written */
+int
+APEX_state_write_json(const APEX_State* state, const char* filename)
+{
+    FILE* fp = fopen(filename, "w");
+    if (!fp) {
+        return -1;
+    }
+
+    fprintf(fp, "{\n  \"pc\": %d,\n  \"cycles\": %d,\n  \"regs\": [", state->pc,
+            state->cycles);
+    for (int r = 0; r < 16; ++r) {
+        fprintf(fp, "%s%d", r ? ", " : "", state->regs[r]);
+    }
+    fprintf(fp, "],\n  \"memory\": [");
+    for (int i = 0; i < state->num_ranges; ++i) {
+        const APEX_State_Range* range = &state->ranges[i];
+        fprintf(fp, "%s\n    {\"start\": %d, \"hash\": \"%016llx\", \"words\": [",
+                i ? "," : "", range->start, range->hash);
+        for (int k = 0; k < range->count; ++k) {
+            fprintf(fp, "%s%d", k ? ", " : "", range->words[k]);
+        }
+        fprintf(fp, "]}");
+    }
+    fprintf(fp, "%s]\n}\n", state->num_ranges ? "\n  " : "");
+
+    int err = ferror(fp);
+    return (fclose(fp) == 0 && !err) ? 0 : -1;
+}
+
+/*
+ * Reads a binary dump. Returns 0, or -1 if the file cannot be read or is
+ * not a valid dump.
+ */
+int
+APEX_state_read(APEX_State* state, const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    char magic[sizeof(state_magic)];
+    unsigned char version;
+    int header[19];
+    int used = 0;
+    int next = 0;
+
+    if (!fp) {
+        return -1;
+    }
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+        memcmp(magic, state_magic, sizeof(magic)) != 0 ||
+        fread(&version, 1, 1, fp) != 1 || version != APEX_STATE_VERSION ||
+        fread(header, sizeof(int), 19, fp) != 19 || header[18] < 0 ||
+        header[18] > (int)(sizeof(state->ranges) / sizeof(state->ranges[0]))) {
+        fclose(fp);
+        return -1;
+    }
+    state->pc = header[0];
+    state->cycles = header[1];
+    memcpy(state->regs, &header[2], sizeof(state->regs));
+    state->num_ranges = header[18];
+
+    for (int i = 0; i < state->num_ranges; ++i) {
+        APEX_State_Range* range = &state->ranges[i];
+        if (fread(&range->start, sizeof(int), 1, fp) != 1 ||
+            fread(&range->count, sizeof(int), 1, fp) != 1 ||
+            fread(&range->hash, sizeof(range->hash), 1, fp) != 1 ||
+            range->start < next || range->count < 1 ||
+            range->start + range->count > APEX_DATA_WORDS) {
+            fclose(fp);
+            return -1;
+        }
+        range->words = &state->words[used];
+        if (fread(range->words, sizeof(int), range->count, fp) !=
+            (size_t)range->count) {
+            fclose(fp);
+            return -1;
+        }
+        used += range->count;
+        next = range->start + range->count;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* Data memory word a of a dump, 0 outside its ranges */
+static int
+state_word(const APEX_State* state, int a)
+{
+    int lo = 0;
+    int hi = state->num_ranges - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const APEX_State_Range* range = &state->ranges[mid];
+        if (a < range->start) {
+            hi = mid - 1;
+        } else if (a >= range->start + range->count) {
+            lo = mid + 1;
+        } else {
+            return range->words[a - range->start];
+        }
+    }
+    return 0;
+}
+
+/* Prints the first data memory word from a on that differs */
+static void
+print_first_word(const APEX_State* golden, const APEX_State* state, int a)
+{
+    for (; a < APEX_DATA_WORDS; ++a) {
+        int expected = state_word(golden, a);
+        int got = state_word(state, a);
+        if (expected != got) {
+            printf("APEX_State : First mismatch MEM[%d] golden %d, got %d\n",
+                   a, expected, got);
+            return;
+        }
+    }
+    /* Only a hash differed */
+    printf("APEX_State : First mismatch in data memory from %d (hash)\n", a);
+}
+
+/*
+ * Compares a state against a golden one and prints the first mismatch.
+ * Cycles are only compared if both have them. Returns 0 if they match.
+ */
+int
+APEX_state_compare(const APEX_State* golden, const APEX_State* state)
+{
+    if (golden->pc != state->pc) {
+        printf("APEX_State : First mismatch pc golden %d, got %d\n",
+               golden->pc, state->pc);
+        return 1;
+    }
+    if (golden->cycles && state->cycles && golden->cycles != state->cycles) {
+        printf("APEX_State : First mismatch cycles golden %d, got %d\n",
+               golden->cycles, state->cycles);
+        return 1;
+    }
+    for (int r = 0; r < 16; ++r) {
+        if (golden->regs[r] != state->regs[r]) {
+            printf("APEX_State : First mismatch R%d golden %d, got %d\n",
+                   r, golden->regs[r], state->regs[r]);
+            return 1;
+        }
+    }
+
+    /* Everything before the first range pair that differs is equal, and
+     * so is memory outside the ranges */
+    int n = golden->num_ranges < state->num_ranges ? golden->num_ranges
+                                                   : state->num_ranges;
+    for (int i = 0; i < n; ++i) {
+        const APEX_State_Range* g = &golden->ranges[i];
+        const APEX_State_Range* s = &state->ranges[i];
+        if (g->start != s->start || g->count != s->count || g->hash != s->hash) {
+            print_first_word(golden, state, g->start < s->start ? g->start : s->start);
+            return 1;
+        }
+    }
+    if (golden->num_ranges != state->num_ranges) {
+        const APEX_State* longer = golden->num_ranges > n ? golden : state;
+        print_first_word(golden, state, longer->ranges[n].start);
+        return 1;
+    }
+    return 0;
+}
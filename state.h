@@ -0,0 +1,62 @@
+#ifndef _APEX_STATE_H_
+#define _APEX_STATE_H_
+/**
+ *  state.h
+ *  Final architectural state of a run: pc, cycle count, R0-R15 and the
+ *  non-zero ranges of data memory, written as a compact binary dump or as
+ *  JSON, and compared against a golden binary dump.
+ *
+ *  Binary format: the 4 byte magic "APXS" and a version byte, then 32-bit
+ *  words in host byte order:
+ *
+ *      pc, cycles, R0..R15, number of ranges
+ *      per range: start, count, hash (2 words), count data words
+ *
+ *  A range is a run of data memory words holding no more than
+ *  STATE_RANGE_GAP zeros in a row that starts and ends non-zero. Its
+ *  hash is the XOR of apex_hash_slot() over its words, the same scheme as
+ *  the pipeline state hash, so two dumps are compared range by range and
+ *  words are only looked at in a range whose hash differs.
+ */
+#include "image.h"
+
+#define APEX_STATE_VERSION 1
+
+/* Zero words a range may span before it is split in two */
+#define STATE_RANGE_GAP 3
+
+typedef struct APEX_State_Range
+{
+    int start;		    // First data memory word
+    int count;
+    unsigned long long hash;
+    int* words;		    // Into APEX_State.words
+} APEX_State_Range;
+
+typedef struct APEX_State
+{
+    int pc;
+    int cycles;		    // Simulated cycles, 0 for the functional model
+    int regs[16];
+    int num_ranges;
+    APEX_State_Range ranges[APEX_DATA_WORDS / 2 + 1];
+    int words[APEX_DATA_WORDS];
+} APEX_State;
+
+void
+APEX_state_capture(APEX_State* state, int pc, int cycles, const int* regs,
+                   const int* data_memory);
+
+int
+APEX_state_write(const APEX_State* state, const char* filename);
+
+int
+APEX_state_write_json(const APEX_State* state, const char* filename);
+
+int
+APEX_state_read(APEX_State* state, const char* filename);
+
+int
+APEX_state_compare(const APEX_State* golden, const APEX_State* state);
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ *  trace.c
+ *  Delta and varint coded memory access / branch trace, see trace.h
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/* Records are encoded into this buffer and written out when it fills */
+#define TRACE_BUFFER_SIZE 65536
+
+/* Longest record: four 5 byte varints */
+#define TRACE_MAX_RECORD 20
+
+static const unsigned char trace_magic[4] = { 'A', 'P', 'X', 'T' };
+
+static unsigned int
+zigzag(int value)
+{
+    return ((unsigned int)value << 1) ^ (unsigned int)(value >> 31);
+}
+
+static int
+unzigzag(unsigned int value)
+{
+    return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+/* a - b and a + b wrapping around, addresses and targets can be anything */
+static int
+delta(int a, int b)
+{
+    return (int)((unsigned int)a - (unsigned int)b);
+}
+
+static int
+undelta(int a, int b)
+{
+    return (int)((unsigned int)a + (unsigned int)b);
+}
+
+static int
+put_varint(unsigned char* out, unsigned int value)
+{
+    int n = 0;
+    while (value >= 0x80) {
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = value;
+    return n;
+}
+
+static void
+trace_reset(APEX_Trace* trace)
+{
+    trace->last.kind = 0;
+    trace->last.cycle = 0;
+    trace->last.pc = 4000;
+    trace->last.value = 0;
+    trace->last_address = 0;
+}
+
+static APEX_Trace*
+trace_alloc(const char* filename, const char* mode)
+{
+    APEX_Trace* trace = calloc(1, sizeof(*trace));
+    if (!trace) {
+        return NULL;
+    }
+    trace->buf = malloc(TRACE_BUFFER_SIZE);
+    trace->fp = fopen(filename, mode);
+    if (!trace->buf || !trace->fp) {
+        APEX_trace_close(trace);
+        return NULL;
+    }
+    trace_reset(trace);
+    return trace;
+}
+
+static void
+trace_flush(APEX_Trace* trace)
+{
+    if (trace->len) {
+        fwrite(trace->buf, 1, trace->len, trace->fp);
+        trace->bytes += trace->len;
+        trace->len = 0;
+    }
+}
+
+/*
+ * Creates a trace file for writing. Returns NULL if it cannot be created.
+ */
+APEX_Trace*
+APEX_trace_create(const char* filename)
+{
+    APEX_Trace* trace = trace_alloc(filename, "wb");
+    if (!trace) {
+        return NULL;
+    }
+    memcpy(trace->buf, trace_magic, sizeof(trace_magic));
+    trace->buf[sizeof(trace_magic)] = APEX_TRACE_VERSION;
+    trace->len = sizeof(trace_magic) + 1;
+    return trace;
+}
+
+void
+APEX_trace_write(APEX_Trace* trace, int kind, int cycle, int pc, int value)
+{
+    if (trace->len + TRACE_MAX_RECORD > TRACE_BUFFER_SIZE) {
+        trace_flush(trace);
+    }
+
+    unsigned char* out = trace->buf + trace->len;
+    int n = put_varint(out, zigzag(delta(pc, trace->last.pc)) << 3 | kind);
+    n += put_varint(out + n, cycle - trace->last.cycle);
+    if (kind == TRACE_LOAD || kind == TRACE_STORE) {
+        n += put_varint(out + n, zigzag(delta(value, trace->last_address)));
+        trace->last_address = value;
+    } else {
+        n += put_varint(out + n, zigzag(delta(value, pc)));
+    }
+    trace->len += n;
+
+    trace->last.kind = kind;
+    trace->last.cycle = cycle;
+    trace->last.pc = pc;
+    trace->last.value = value;
+    trace->records++;
+}
+
+/*
+ * Writes out what is buffered and closes the file. Returns 0, or -1 if
+ * the trace could not be written completely.
+ */
+int
+APEX_trace_finish(APEX_Trace* trace)
+{
+    trace_flush(trace);
+    int ret = ferror(trace->fp) ? -1 : 0;
+    if (fclose(trace->fp) != 0) {
+        ret = -1;
+    }
+    trace->fp = NULL;
+    return ret;
+}
+
+/*
+ * Opens a trace file for reading. Returns NULL if it cannot be opened or
+ * is not a trace of this version.
+ */
+APEX_Trace*
+APEX_trace_open(const char* filename)
+{
+    unsigned char header[sizeof(trace_magic) + 1];
+    APEX_Trace* trace = trace_alloc(filename, "rb");
+    if (!trace) {
+        return NULL;
+    }
+    if (fread(header, 1, sizeof(header), trace->fp) != sizeof(header) ||
+        memcmp(header, trace_magic, sizeof(trace_magic)) != 0 ||
+        header[sizeof(trace_magic)] != APEX_TRACE_VERSION) {
+        APEX_trace_close(trace);
+        return NULL;
+    }
+    trace->bytes = sizeof(header);
+    return trace;
+}
+
+/*
+ * Next varint of the file into *value. Returns 1, 0 if the file ends
+ * before it and -1 if it ends inside it.
+ */
+static int
+get_varint(APEX_Trace* trace, unsigned int* value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (trace->pos == trace->len) {
+            trace->len = fread(trace->buf, 1, TRACE_BUFFER_SIZE, trace->fp);
+            trace->pos = 0;
+            trace->bytes += trace->len;
+            if (!trace->len) {
+                return shift ? -1 : 0;
+            }
+        }
+        unsigned char byte = trace->buf[trace->pos++];
+        *value |= (unsigned int)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Reads the next record. Returns 1 on success, 0 at the end of the trace
+ * and -1 if the file is truncated or corrupt.
+ */
+int
+APEX_trace_read(APEX_Trace* trace, APEX_Trace_Record* record)
+{
+    unsigned int head, cycle, value;
+
+    int ret = get_varint(trace, &head);
+    if (ret <= 0) {
+        return ferror(trace->fp) ? -1 : ret;
+    }
+    if (get_varint(trace, &cycle) != 1 || get_varint(trace, &value) != 1 ||
+        (head & 7) >= NUM_TRACE_KINDS) {
+        return -1;
+    }
+
+    record->kind = head & 7;
+    record->pc = undelta(trace->last.pc, unzigzag(head >> 3));
+    record->cycle = trace->last.cycle + cycle;
+    if (record->kind == TRACE_LOAD || record->kind == TRACE_STORE) {
+        record->value = undelta(trace->last_address, unzigzag(value));
+        trace->last_address = record->value;
+    } else {
+        record->value = undelta(record->pc, unzigzag(value));
+    }
+    trace->last = *record;
+    trace->records++;
+    return 1;
+}
+
+void
+APEX_trace_close(APEX_Trace* trace)
+{
+    if (trace->fp) {
+        fclose(trace->fp);
+    }
+    free(trace->buf);
+    free(trace);
+}
@@ -0,0 +1,72 @@
+#ifndef _APEX_TRACE_H_
+#define _APEX_TRACE_H_
+/**
+ *  trace.h
+ *  Memory access and branch trace files: a streaming writer used by the
+ *  pipeline and a reader for offline tools. Only depends on the C library,
+ *  so trace.o can be linked into other programs on its own.
+ *
+ *  File format: the 4 byte magic "APXT" and a version byte, then one
+ *  record per event in commit order, each a sequence of LEB128 varints:
+ *
+ *      zigzag(pc delta) << 3 | kind
+ *      cycle delta
+ *      LOAD/STORE:       zigzag(address - previous LOAD/STORE address)
+ *      BZ/BNZ/JUMP:      zigzag(target - pc)
+ *
+ *  Deltas are against the previous record, starting from pc 4000, cycle 0
+ *  and address 0.
+ */
+#include <stdio.h>
+
+#define APEX_TRACE_VERSION 1
+
+enum
+{
+    TRACE_LOAD,
+    TRACE_STORE,
+    TRACE_BRANCH_NOT_TAKEN,	// BZ/BNZ that fell through, value is its target
+    TRACE_BRANCH_TAKEN,
+    TRACE_JUMP,
+    NUM_TRACE_KINDS
+};
+
+typedef struct APEX_Trace_Record
+{
+    int kind;		// TRACE_*
+    int cycle;		// Clock cycle the event reached MEM
+    int pc;
+    int value;		// Data memory address, or branch target
+} APEX_Trace_Record;
+
+typedef struct APEX_Trace
+{
+    FILE* fp;
+    unsigned char* buf;
+    int len;		// Bytes in buf (writer) or bytes left in buf (reader)
+    int pos;		// Reader position in buf
+    APEX_Trace_Record last;	// Base for the next delta
+    int last_address;
+    long long records;
+    long long bytes;
+} APEX_Trace;
+
+APEX_Trace*
+APEX_trace_create(const char* filename);
+
+void
+APEX_trace_write(APEX_Trace* trace, int kind, int cycle, int pc, int value);
+
+int
+APEX_trace_finish(APEX_Trace* trace);
+
+APEX_Trace*
+APEX_trace_open(const char* filename);
+
+int
+APEX_trace_read(APEX_Trace* trace, APEX_Trace_Record* record);
+
+void
+APEX_trace_close(APEX_Trace* trace);
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ *  trace_dump.c
+ *  Prints a trace written by apex_sim --trace, one record per line, and a
+ *  summary per record kind. Also an example of using the trace reader.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+int
+main(int argc, char const* argv[])
+{
+    static const char* names[NUM_TRACE_KINDS] = {
+        "LOAD", "STORE", "BRANCH-NT", "BRANCH-T", "JUMP"
+    };
+    long long count[NUM_TRACE_KINDS] = { 0 };
+    int quiet = argc > 2 && strcmp(argv[2], "--summary") == 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "APEX_Help : Usage %s <trace_file> [--summary]\n", argv[0]);
+        exit(1);
+    }
+
+    APEX_Trace* trace = APEX_trace_open(argv[1]);
+    if (!trace) {
+        fprintf(stderr, "APEX_Error : %s is not a readable trace\n", argv[1]);
+        exit(1);
+    }
+
+    APEX_Trace_Record record;
+    int ret;
+    while ((ret = APEX_trace_read(trace, &record)) == 1) {
+        count[record.kind]++;
+        if (!quiet) {
+            printf("%-9d %-9s pc(%d) %d\n", record.cycle, names[record.kind],
+                   record.pc, record.value);
+        }
+    }
+    if (ret < 0) {
+        fprintf(stderr, "APEX_Error : %s is truncated after %lld records\n",
+                argv[1], trace->records);
+    }
+
+    printf("APEX_Trace : %lld records in %lld bytes\n", trace->records, trace->bytes);
+    for (int i = 0; i < NUM_TRACE_KINDS; ++i) {
+        printf("APEX_Trace :   %-9s %lld\n", names[i], count[i]);
+    }
+    APEX_trace_close(trace);
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,575 @@
+/*
+ *  wide.c
+ *  W-wide in-order superscalar APEX pipeline, see wide.h
+ *
+ *  Each cycle the groups are processed from writeback back to fetch, every
+ *  stage reading its group from the current bank and writing the next
+ *  bank, with the same timing as the scalar pipeline: a result can be read
+ *  by decode in the cycle it is written back, MUL spends two cycles in EX
+ *  and holds decode in the first one, and BZ/BNZ/JUMP resolve in MEM,
+ *  where a taken one (a mispredicted one with --bpred) flushes EX and DRF
+ *  and redirects fetch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bpred.h"
+#include "break.h"
+#include "cache.h"
+#include "wide.h"
+
+/* Set this flag to 1 to enable debug messages */
+#define ENABLE_DEBUG_MESSAGES 1
+
+static const char* stage_names[NUM_STAGES] = {
+    "Fetch", "Decode/RF", "Execute", "Memory", "Writeback"
+};
+
+static void
+empty_group(CPU_Stage* group)
+{
+    for (int k = 0; k < APEX_MAX_WIDTH; ++k) {
+        memset(&group[k], 0, sizeof(group[k]));
+        group[k].op = OP_NONE;
+        group[k].rd = -1;
+        group[k].rs1 = -1;
+        group[k].rs2 = -1;
+        group[k].imm = -1;
+    }
+}
+
+static int
+slot_used(CPU_Stage* slot)
+{
+    return slot->op != OP_NONE;
+}
+
+/* Destination register an instruction writes back, -1 if none */
+static int
+dest_register(CPU_Stage* slot)
+{
+    switch (slot->op) {
+    case OP_MOVC:
+    case OP_LOAD:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+        return (slot->rd >= 0 && slot->rd <= 15) ? slot->rd : -1;
+    }
+    return -1;
+}
+
+/* Registers decode reads, -1 if unused */
+static void
+source_registers(CPU_Stage* slot, int src[2])
+{
+    src[0] = -1;
+    src[1] = -1;
+    switch (slot->op) {
+    case OP_STORE:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+        src[1] = slot->rs2;
+        /* fall through */
+    case OP_LOAD:
+    case OP_JUMP:
+        src[0] = slot->rs1;
+        break;
+    }
+}
+
+static int
+is_control(CPU_Stage* slot)
+{
+    return slot->op == OP_BZ || slot->op == OP_BNZ || slot->op == OP_JUMP;
+}
+
+static void
+print_group(int stage, CPU_Stage* group, int width)
+{
+    char name[32];
+    for (int k = 0; k < width; ++k) {
+        snprintf(name, sizeof(name), "%s[%d]", stage_names[stage], k);
+        APEX_cpu_print_stage(name, &group[k]);
+    }
+}
+
+/* Commits the writeback group in program order, STOREs included */
+static void
+wide_writeback(APEX_Wide* wide)
+{
+    APEX_CPU* cpu = wide->cpu;
+    CPU_Stage* group = wide->stage[WB];
+
+    for (int k = 0; k < wide->width && slot_used(&group[k]) && !wide->done; ++k) {
+        CPU_Stage* slot = &group[k];
+        int rd = dest_register(slot);
+        if (rd >= 0) {
+            wide->pending[rd]--;
+        }
+        if (slot->op == OP_STORE) {
+            APEX_cpu_write_mem(cpu, slot->mem_address, slot->rs1_value);
+        }
+        if (APEX_cpu_commit(cpu, slot) || cpu->cosim_mismatch ||
+            (cpu->breaks && cpu->breaks->hit)) {
+            wide->done = 1;
+        }
+    }
+}
+
+/*
+ * Data cache accesses of the memory group, through all of its ports on the
+ * first cycle the group is in MEM. Returns 1 while the slowest access
+ * holds the group there, which freezes everything behind it.
+ */
+static int
+wide_dcache_stall(APEX_Wide* wide)
+{
+    APEX_CPU* cpu = wide->cpu;
+    CPU_Stage* group = wide->stage[MEM];
+
+    if (!cpu->dcache) {
+        return 0;
+    }
+    if (!cpu->dcache_accessed) {
+        int latency = 0;
+        for (int k = 0; k < wide->width && slot_used(&group[k]); ++k) {
+            CPU_Stage* slot = &group[k];
+            if ((slot->op == OP_LOAD || slot->op == OP_STORE) &&
+                slot->mem_address >= 0 && slot->mem_address < 4096) {
+                int cycles = APEX_cache_access(cpu->dcache, slot->mem_address,
+                                               slot->op == OP_STORE);
+                if (cycles > latency) {
+                    latency = cycles;
+                }
+            }
+        }
+        if (!latency) {
+            return 0;
+        }
+        cpu->dcache_accessed = 1;
+        cpu->dcache_wait = latency - 1;
+    }
+    if (cpu->dcache_wait > 0) {
+        cpu->dcache_wait--;
+        return 1;
+    }
+    cpu->dcache_accessed = 0;
+    return 0;
+}
+
+/*
+ * Loads of the memory group and the address check of its loads and
+ * stores, in program order. Returns the PC fetch has to be redirected to
+ * by a BZ/BNZ/JUMP, or -1: a taken one without a predictor, a mispredicted
+ * one with.
+ */
+static int
+wide_memory(APEX_Wide* wide)
+{
+    APEX_CPU* cpu = wide->cpu;
+    CPU_Stage* group = wide->stage[MEM];
+    int redirect = -1;
+
+    for (int k = 0; k < wide->width && slot_used(&group[k]); ++k) {
+        CPU_Stage* slot = &group[k];
+        if (slot->op == OP_LOAD || slot->op == OP_STORE) {
+            if (slot->mem_address < 0 || slot->mem_address >= 4096) {
+                printf("APEX_Wide : pc(%d) data memory address %d out of range\n",
+                       slot->pc, slot->mem_address);
+                cpu->exit_status = APEX_EXIT_ERROR;
+                wide->done = 1;
+                break;
+            }
+            if (slot->op == OP_LOAD) {
+                /* Data memory is written at commit; forward from an older
+                 * STORE in this group */
+                slot->buffer = cpu->data_memory[slot->mem_address];
+                for (int j = 0; j < k; ++j) {
+                    if (group[j].op == OP_STORE &&
+                        group[j].mem_address == slot->mem_address) {
+                        slot->buffer = group[j].rs1_value;
+                    }
+                }
+            }
+        }
+        if (cpu->trace) {
+            APEX_cpu_trace_memory(cpu, slot);
+        }
+        /* Decode ends a group at a BZ/BNZ/JUMP, nothing younger is here */
+        if (is_control(slot)) {
+            int taken = slot->op == OP_JUMP || slot->branch_taken;
+            int target = taken ? slot->buffer : slot->pc + 4;
+            int squash = cpu->bpred ? target != slot->pred_pc : taken;
+            if (cpu->bpred) {
+                APEX_bpred_update(cpu->bpred, slot->op, slot->pc, slot->pred_index,
+                                  taken, target, squash);
+            }
+            if (squash) {
+                redirect = target;
+            }
+        }
+    }
+    memcpy(wide->next_stage[WB], group, sizeof(APEX_Group));
+    return redirect;
+}
+
+/* Runs the execute group through the execute units, in program order */
+static void
+wide_execute_group(APEX_Wide* wide, CPU_Stage* group)
+{
+    for (int k = 0; k < wide->width && slot_used(&group[k]); ++k) {
+        CPU_Stage* slot = &group[k];
+        slot->branch_taken = 0;
+
+        switch (slot->op) {
+        case OP_STORE:
+            slot->mem_address = slot->rs2_value + slot->imm;
+            break;
+        case OP_LOAD:
+            slot->mem_address = slot->rs1_value + slot->imm;
+            break;
+        case OP_MOVC:
+            slot->buffer = slot->imm;
+            break;
+        case OP_ADD:
+            slot->buffer = slot->rs1_value + slot->rs2_value;
+            wide->zero_flag = slot->buffer == 0;
+            break;
+        case OP_SUB:
+            slot->buffer = slot->rs1_value - slot->rs2_value;
+            wide->zero_flag = slot->buffer == 0;
+            break;
+        case OP_MUL:
+            slot->buffer = slot->rs1_value * slot->rs2_value;
+            wide->zero_flag = slot->buffer == 0;
+            break;
+        case OP_AND:
+            slot->buffer = slot->rs1_value & slot->rs2_value;
+            break;
+        case OP_OR:
+            slot->buffer = slot->rs1_value | slot->rs2_value;
+            break;
+        case OP_XOR:
+            slot->buffer = slot->rs1_value ^ slot->rs2_value;
+            break;
+        case OP_BZ:
+        case OP_BNZ:
+            if (wide->zero_flag == (slot->op == OP_BZ)) {
+                slot->buffer = slot->pc + slot->imm;
+                slot->branch_taken = 1;
+            }
+            break;
+        case OP_JUMP:
+            slot->buffer = slot->rs1_value + slot->imm;
+            break;
+        }
+    }
+}
+
+/*
+ * Execute stage. Returns 1 while a MUL holds the execute group (and
+ * decode) for its first cycle, or the data cache holds MEM.
+ */
+static int
+wide_execute(APEX_Wide* wide, int squash, int mem_stall)
+{
+    CPU_Stage* group = wide->stage[EX];
+
+    if (mem_stall) {
+        memcpy(wide->next_stage[EX], group, sizeof(APEX_Group));
+        return 1;
+    }
+
+    if (squash) {
+        /* Flushed: give back the registers these claimed in decode */
+        for (int k = 0; k < wide->width && slot_used(&group[k]); ++k) {
+            int rd = dest_register(&group[k]);
+            if (rd >= 0) {
+                wide->pending[rd]--;
+            }
+        }
+        wide->mul_started = 0;
+        /* A HALT decoded last cycle was on the wrong path */
+        wide->halted = 0;
+        return 0;
+    }
+
+    int has_mul = 0;
+    for (int k = 0; k < wide->width && slot_used(&group[k]); ++k) {
+        has_mul |= group[k].op == OP_MUL;
+    }
+    if (has_mul && !wide->mul_started) {
+        wide->mul_started = 1;
+        memcpy(wide->next_stage[EX], group, sizeof(APEX_Group));
+        return 1;
+    }
+    wide->mul_started = 0;
+
+    memcpy(wide->next_stage[MEM], group, sizeof(APEX_Group));
+    wide_execute_group(wide, wide->next_stage[MEM]);
+    return 0;
+}
+
+/*
+ * Decode issues the instructions of its group in order until one has a
+ * source that is not written back yet (which includes one written by an
+ * earlier instruction of the same group), and never past a BZ/BNZ/JUMP or
+ * HALT. Returns 1 if the whole group went to execute.
+ */
+static int
+wide_decode(APEX_Wide* wide, int squash, int ex_busy)
+{
+    APEX_CPU* cpu = wide->cpu;
+    CPU_Stage* group = wide->stage[DRF];
+    CPU_Stage* issue = wide->next_stage[EX];
+    int issued = 0;
+    int k;
+
+    if (squash) {
+        wide->issue_histogram[0]++;
+        return 1;
+    }
+    if (ex_busy) {
+        memcpy(wide->next_stage[DRF], group, sizeof(APEX_Group));
+        wide->issue_histogram[0]++;
+        return 0;
+    }
+
+    for (k = 0; k < wide->width && slot_used(&group[k]); ++k) {
+        CPU_Stage* slot = &group[k];
+        int src[2];
+        source_registers(slot, src);
+        if ((src[0] >= 0 && wide->pending[src[0]]) ||
+            (src[1] >= 0 && wide->pending[src[1]])) {
+            break;
+        }
+
+        issue[issued] = *slot;
+        if (src[0] >= 0) {
+            issue[issued].rs1_value = cpu->regs[src[0]];
+        }
+        if (src[1] >= 0) {
+            issue[issued].rs2_value = cpu->regs[src[1]];
+        }
+        issued++;
+
+        int rd = dest_register(slot);
+        if (rd >= 0) {
+            wide->pending[rd]++;
+        }
+        if (slot->op == OP_HALT) {
+            /* Nothing after HALT is decoded, fetch stops for good */
+            wide->halted = 1;
+            k = wide->width;
+            break;
+        }
+        if (is_control(slot)) {
+            k++;
+            break;
+        }
+    }
+    wide->issue_histogram[issued]++;
+
+    /* What is left of the group moves to the front of the decode latch */
+    int left = 0;
+    for (; k < wide->width && slot_used(&group[k]); ++k) {
+        wide->next_stage[DRF][left++] = group[k];
+    }
+    return left == 0;
+}
+
+/*
+ * Fetches the next group from pc into decode, unless decode is still busy.
+ * A BZ/BNZ/JUMP the predictor sends elsewhere ends the group.
+ */
+static void
+wide_fetch(APEX_Wide* wide, int fetch_pc, int drf_free)
+{
+    APEX_CPU* cpu = wide->cpu;
+    CPU_Stage* group = wide->next_stage[F];
+    int pc = fetch_pc;
+
+    if (wide->halted) {
+        cpu->pc = fetch_pc;
+        return;
+    }
+
+    for (int k = 0; k < wide->width; ++k) {
+        int index = get_code_index(pc);
+        if (index < 0 || index >= cpu->code_memory_size) {
+            break;
+        }
+        APEX_Instruction* ins = &cpu->code_memory[index];
+        group[k].pc = pc;
+        group[k].op = ins->op;
+        group[k].rd = ins->rd;
+        group[k].rs1 = ins->rs1;
+        group[k].rs2 = ins->rs2;
+        group[k].imm = ins->imm;
+
+        if (cpu->bpred) {
+            group[k].pred_pc = APEX_bpred_predict(cpu->bpred, ins, pc,
+                                                  &group[k].pred_index);
+        } else {
+            group[k].pred_pc = pc + 4;
+        }
+        pc = group[k].pred_pc;
+        if (pc != group[k].pc + 4) {
+            break;
+        }
+    }
+
+    if (drf_free) {
+        memcpy(wide->next_stage[DRF], group, sizeof(APEX_Group));
+        cpu->pc = pc;
+    } else {
+        cpu->pc = fetch_pc;
+    }
+}
+
+static void
+wide_cycle(APEX_Wide* wide)
+{
+    APEX_CPU* cpu = wide->cpu;
+
+    for (int i = 0; i < NUM_STAGES; ++i) {
+        empty_group(wide->next_stage[i]);
+    }
+
+    wide_writeback(wide);
+    int mem_stall = wide_dcache_stall(wide);
+    int redirect = -1;
+    if (mem_stall) {
+        /* Writeback gets an empty group */
+        memcpy(wide->next_stage[MEM], wide->stage[MEM], sizeof(APEX_Group));
+    } else {
+        redirect = wide_memory(wide);
+    }
+    int squash = redirect >= 0;
+    int ex_busy = wide_execute(wide, squash, mem_stall);
+    int drf_free = wide_decode(wide, squash, ex_busy);
+    wide_fetch(wide, squash ? redirect : cpu->pc, drf_free);
+
+    if (ENABLE_DEBUG_MESSAGES) {
+        for (int i = NUM_STAGES - 1; i >= 0; --i) {
+            print_group(i, wide->stage[i], wide->width);
+        }
+    }
+
+    APEX_Group* stage = wide->stage;
+    wide->stage = wide->next_stage;
+    wide->next_stage = stage;
+}
+
+static unsigned long long
+wide_fingerprint(void* engine)
+{
+    APEX_Wide* wide = engine;
+    APEX_CPU* cpu = wide->cpu;
+    unsigned long long h = 0xcbf29ce484222325ULL ^ cpu->state_hash;
+    int values[] = { cpu->pc, wide->zero_flag, wide->mul_started, wide->halted,
+                     cpu->dcache_accessed, cpu->dcache_wait };
+
+    for (int i = 0; i < 6; ++i) {
+        h = (h ^ (unsigned int)values[i]) * 0x100000001b3ULL;
+    }
+    for (int i = 0; i < 16; ++i) {
+        h = (h ^ (unsigned int)wide->pending[i]) * 0x100000001b3ULL;
+    }
+    for (int i = 0; i < NUM_STAGES; ++i) {
+        for (int k = 0; k < wide->width; ++k) {
+            CPU_Stage* slot = &wide->stage[i][k];
+            int fields[] = { slot->pc, slot->op, slot->rs1_value, slot->rs2_value,
+                             slot->buffer, slot->mem_address, slot->branch_taken,
+                             slot->pred_pc };
+            for (int f = 0; f < 8; ++f) {
+                h = (h ^ (unsigned int)fields[f]) * 0x100000001b3ULL;
+            }
+        }
+    }
+    return h;
+}
+
+/* Passes the PCs of every group in flight to the livelock check */
+static void
+wide_in_flight(void* engine)
+{
+    APEX_Wide* wide = engine;
+    for (int i = 0; i < NUM_STAGES; ++i) {
+        for (int k = 0; k < wide->width && slot_used(&wide->stage[i][k]); ++k) {
+            APEX_cpu_loop_pc(wide->cpu, wide->stage[i][k].pc);
+        }
+    }
+}
+
+/*
+ * Runs the program on a width-wide pipeline, with the same run limits,
+ * co-simulation and exit statuses as APEX_cpu_run
+ */
+int
+APEX_wide_run(APEX_CPU* cpu, int width)
+{
+    if (width <= 1) {
+        return APEX_cpu_run(cpu);
+    }
+
+    APEX_Wide* wide = calloc(1, sizeof(*wide));
+    if (!wide) {
+        return APEX_EXIT_ERROR;
+    }
+    wide->cpu = cpu;
+    wide->width = width > APEX_MAX_WIDTH ? APEX_MAX_WIDTH : width;
+    wide->stage = wide->latch[0];
+    wide->next_stage = wide->latch[1];
+    for (int i = 0; i < NUM_STAGES; ++i) {
+        empty_group(wide->stage[i]);
+    }
+
+    while (1) {
+        if (ENABLE_DEBUG_MESSAGES) {
+            printf("--------------------------------\n");
+            printf("Clock Cycle #: %d\n", cpu->clock);
+            printf("--------------------------------\n");
+        }
+        wide_cycle(wide);
+
+        if (cpu->breaks && cpu->clock == cpu->breaks->next_cycle) {
+            APEX_break_cycle(cpu);
+        }
+        if (wide->done || (cpu->breaks && cpu->breaks->hit)) {
+            break;
+        }
+        if (APEX_cpu_loop_check(cpu, wide_fingerprint, wide_in_flight, wide)) {
+            break;
+        }
+        if (cpu->max_cycles && cpu->clock + 1 >= cpu->max_cycles) {
+            printf("APEX_CPU : Cycle limit %d reached at pc(%d)\n",
+                   cpu->max_cycles, cpu->pc);
+            cpu->exit_status = APEX_EXIT_CYCLE_LIMIT;
+            break;
+        }
+        cpu->clock++;
+    }
+
+    long long cycles = cpu->clock + 1;
+    printf("APEX_Wide : width %d, %d instructions in %lld cycles, IPC %.2f\n",
+           wide->width, cpu->ins_completed, cycles,
+           (double)cpu->ins_completed / cycles);
+    printf("APEX_Wide : decode issued");
+    for (int n = 0; n <= wide->width; ++n) {
+        printf(" %d:%lld", n, wide->issue_histogram[n]);
+    }
+    printf(" cycles\n");
+
+    free(wide);
+    return cpu->exit_status;
+}
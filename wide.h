@@ -0,0 +1,44 @@
+#ifndef _APEX_WIDE_H_
+#define _APEX_WIDE_H_
+/**
+ *  wide.h
+ *  W-wide in-order superscalar model of the APEX pipeline. Every stage
+ *  holds a group of up to W instructions, decode issues as much of its
+ *  group as has its operands ready, and there are W execute units and W
+ *  memory ports. Width 1 is run by the scalar pipeline in cpu.c; wider
+ *  groups use this model, which has its own hazard scoreboard (pending[])
+ *  and zero flag and writes stores at commit, so its timing is not the
+ *  scalar pipeline's at W=1. Both commit through APEX_cpu_commit().
+ */
+#include "cpu.h"
+
+/* Widest group a stage can hold */
+#define APEX_MAX_WIDTH 8
+
+typedef CPU_Stage APEX_Group[APEX_MAX_WIDTH];
+
+typedef struct APEX_Wide
+{
+    APEX_CPU* cpu;	    // Registers, data memory, code memory and clock
+    int width;
+
+    /* Two banks of stage groups, the W latches of a group side by side;
+     * stages read stage[] and write next_stage[], swapped every cycle */
+    APEX_Group latch[2][NUM_STAGES];
+    APEX_Group* stage;
+    APEX_Group* next_stage;
+
+    int pending[16];	    // Writes to each register decoded but not committed
+    int zero_flag;	    // 1 when the last ADD/SUB/MUL executed produced zero
+    int mul_started;	    // EX group has done the first of its MUL cycles
+    int halted;		    // HALT decoded, fetch has stopped
+    int done;		    // Last instruction or HALT committed
+
+    /* Run summary: cycles in which decode issued n instructions */
+    long long issue_histogram[APEX_MAX_WIDTH + 1];
+} APEX_Wide;
+
+int
+APEX_wide_run(APEX_CPU* cpu, int width);
+
+#endif